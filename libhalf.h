@@ -21,1085 +21,7456 @@
 */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+
+// the compiled programs are mapped in memory and the modules cached, see "10. Half Images"
+#if defined(__unix__) || defined(__APPLE__)
+#define HALF_POSIX
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(HALF_NO_MMAP)
+#define HALF_MMAP
+#include <sys/mman.h>
+#endif
+// the inputs of a batch and the statements run in parallel, see "11. Half Batch" and "12. Half Parallel"
+#if !defined(HALF_NO_THREADS)
+#define HALF_THREADS
+#include <pthread.h>
+#endif
+#endif
 
 // 1. Half Core (only lambda calculus)
 
+/*
+   Terms use De Bruijn indices: a variable is the number of lambdas between
+   its occurrence and its binder, so `\x.\y.x` is stored as `\.\.1`.
+   Binding is done once by the parser and two alpha-equivalent terms have the
+   same structure. Parameter names are only kept in a NameTable for debugging.
+
+   The names of the globals and the builtins are symbols: the lexer interns
+   each identifier once in the NameTable and a function keeps its index, two
+   names are compared as integers.
+*/
+
+typedef enum {
+    FUNCTION_VARIABLE, // bound variable, `index` is its De Bruijn index
+    FUNCTION_LAMBDA,   // \x.body[0], `index` is the symbol of 'x' in the NameTable
+    FUNCTION_APPLY,    // (body[0] body[1])
+    FUNCTION_NAME,     // free name, resolved through the Context
+    FUNCTION_BUILTIN,  // :name with an optional argument in body[0]
+    FUNCTION_DEFINE,   // top-level "name = body[0]"
+    FUNCTION_BOOLEAN,  // native \x.\y.x (`index` 1) or \x.\y.y (`index` 0)
+    FUNCTION_NUMERAL,  // native Church numeral \f.\x.f^index x, `index` > 0
+} Function_Kind;
+
+#define FUNCTION_NO_NAME ((size_t)-1)
+#define FUNCTION_NO_SYMBOL 0 // the symbols of the NameTable start at 1
+
 // \x.x # this is an anonymous function
+// The small fields share the first word and the children are stored in the
+// node: a traversal reads one node instead of a node and its body array.
 typedef struct Function {
-    size_t id;
-    bool visited;
-    bool builtin;
-    char* name;
-    size_t body_count;      // number of functions in body (max 2)
-    struct Function **body; // dynamically allocated array of Function pointers
+    uint8_t kind;             // a Function_Kind
+    bool interned;            // owned by an InternTable, see intern_function
+    bool pooled;              // a cell of a FunctionPool, see new_function
+    uint8_t body_count;       // number of functions in body (max 2)
+    uint32_t symbol;          // name of a global, a builtin or a definition
+    size_t index;
+    struct Function* body[2];
 } Function;
 
-static inline void bind_names(Function *f, size_t id, char* name) {
-    if (f == NULL) return;
+/*
+   The functions of a Runtime come from its FunctionPool. The cells of the
+   functions are cut from large slabs and a freed cell is reused by the next
+   function: building a node doesn't call malloc on the hot path.
+   function_pool_reset releases all the functions of a pool at once and
+   keeps the slabs for the next ones.
+
+   The slabs are allocated with malloc, or with the `alloc` and `release` of
+   an embedder. A NULL pool allocates each function with malloc, like the
+   functions of an InternTable.
+
+   Only the functions come from the pool. The closures and environments of
+   the machine and the VM are cut from the blocks of their copying
+   collector, which releases them during the statement (see machine_collect
+   and vm_collect).
+*/
 
-    if (f->body_count == 0 && f->name != NULL && strcmp(f->name, name) == 0) {
-        f->id = id;
-    }
+#define FUNCTION_SLAB_CELLS 1024
 
-    for (size_t i = 0; i < f->body_count; i++) {
-        bind_names(f->body[i], id, name);
-    }
+typedef struct {
+    struct FunctionPool* pool; // NULL while the cell is free
+    Function node;             // a free node links the next one in body[0]
+} FunctionCell;
+
+typedef struct FunctionSlab {
+    struct FunctionSlab* next;
+    size_t used; // cells given out since the slab was taken
+    FunctionCell cells[FUNCTION_SLAB_CELLS];
+} FunctionSlab;
+
+typedef struct FunctionPool {
+    FunctionSlab* slabs;
+    FunctionSlab* spare; // emptied by function_pool_reset
+    Function* free_nodes;
+    size_t live; // functions not freed yet
+
+    void* (*alloc)(void* user, size_t size);
+    void (*release)(void* user, void* memory);
+    void* user;
+} FunctionPool;
+
+static void* function_pool_malloc(void* user, size_t size) {
+    (void)user;
+    return malloc(size);
 }
 
-static inline Function* new_function(size_t id, char* name, Function *body[], size_t count) {
-    if (count > 2) {
-        fprintf(stderr, "Error: Function body count exceeds maximum allowed (max=2)\n");
-        return NULL;
-    }
+static void function_pool_free(void* user, void* memory) {
+    (void)user;
+    free(memory);
+}
 
-    Function *f = (Function*)malloc(sizeof(Function));
-    if (f == NULL) {
+// `alloc` and `release` may be NULL to use malloc and free for the slabs
+FunctionPool* new_function_pool(void* (*alloc)(void*, size_t), void (*release)(void*, void*), void* user) {
+    FunctionPool* pool = (FunctionPool*)malloc(sizeof(FunctionPool));
+    if (pool == NULL) {
         fprintf(stderr, "Error: Memory allocation failed\n");
         return NULL;
     }
 
-    f->id = id;
-    f->visited = false;
-    f->builtin = false;
-    f->body_count = count;
+    pool->slabs = NULL;
+    pool->spare = NULL;
+    pool->free_nodes = NULL;
+    pool->live = 0;
+    pool->alloc = alloc != NULL ? alloc : function_pool_malloc;
+    pool->release = release != NULL ? release : function_pool_free;
+    pool->user = user;
+    return pool;
+}
+
+static inline FunctionCell* function_cell(Function* f) {
+    return (FunctionCell*)((unsigned char*)f - offsetof(FunctionCell, node));
+}
 
-    if (name == NULL) {
-        f->name = NULL;
+static inline Function* function_pool_node(FunctionPool* pool) {
+    FunctionCell* cell;
+    if (pool->free_nodes != NULL) {
+        cell = function_cell(pool->free_nodes);
+        pool->free_nodes = pool->free_nodes->body[0];
     } else {
-        f->name = (char*)malloc(strlen(name) + 1);
-        if (f->name != NULL) {
-            strcpy(f->name, name);
+        FunctionSlab* slab = pool->slabs;
+        if (slab == NULL || slab->used == FUNCTION_SLAB_CELLS) {
+            if (pool->spare != NULL) {
+                slab = pool->spare;
+                pool->spare = slab->next;
+            } else {
+                slab = (FunctionSlab*)pool->alloc(pool->user, sizeof(FunctionSlab));
+                if (slab == NULL) {
+                    fprintf(stderr, "Error: Memory allocation failed\n");
+                    return NULL;
+                }
+            }
+            slab->used = 0;
+            slab->next = pool->slabs;
+            pool->slabs = slab;
         }
+        cell = &slab->cells[slab->used++];
     }
 
-    if (count > 0) {
-        f->body = (Function**)malloc(count * sizeof(Function*));
-        if (f->body == NULL) {
-            fprintf(stderr, "Error: Memory allocation failed\n");
-            free(f->name);
-            free(f);
-            return NULL;
-        }
-        memcpy(f->body, body, count * sizeof(Function*));
-    } else {
-        f->body = NULL;
+    cell->pool = pool;
+    pool->live++;
+    return &cell->node;
+}
+
+// give the cell of the pooled function `f` back to its pool
+static inline void function_pool_release(Function* f) {
+    FunctionCell* cell = function_cell(f);
+    FunctionPool* pool = cell->pool;
+    cell->pool = NULL;
+    f->body[0] = pool->free_nodes;
+    pool->free_nodes = f;
+    pool->live--;
+}
+
+// Free all the functions of the pool, which must not be used anymore. The
+// slabs are kept for the next functions.
+void function_pool_reset(FunctionPool* pool) {
+    if (pool == NULL) return;
+
+    while (pool->slabs != NULL) {
+        FunctionSlab* slab = pool->slabs;
+        pool->slabs = slab->next;
+        slab->next = pool->spare;
+        pool->spare = slab;
+    }
+    pool->free_nodes = NULL;
+    pool->live = 0;
+}
+
+void free_function_pool(FunctionPool* pool) {
+    if (pool == NULL) return;
+
+    function_pool_reset(pool);
+    while (pool->spare != NULL) {
+        FunctionSlab* next = pool->spare->next;
+        pool->release(pool->user, pool->spare);
+        pool->spare = next;
+    }
+    free(pool);
+}
+
+// `pool` may be NULL, the function is then allocated with malloc
+static inline Function* new_function(FunctionPool* pool, Function_Kind kind, size_t index, uint32_t symbol, Function *body[], size_t count) {
+    if (count > 2) {
+        fprintf(stderr, "Error: Function body count exceeds maximum allowed (max=2)\n");
+        return NULL;
     }
 
-    if (name != NULL && count == 1) {
-        bind_names(f->body[0], id, name);
+    Function *f = pool != NULL ? function_pool_node(pool) : (Function*)malloc(sizeof(Function));
+    if (f == NULL) {
+        if (pool == NULL) fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
     }
 
+    f->kind = (uint8_t)kind;
+    f->index = index;
+    f->interned = false;
+    f->pooled = pool != NULL;
+    f->body_count = (uint8_t)count;
+    f->body[0] = count > 0 ? body[0] : NULL;
+    f->body[1] = count > 1 ? body[1] : NULL;
+    f->symbol = symbol;
     return f;
 }
 
-static inline void free_function(Function *f) {
-    if (f == NULL) return;
+/*
+   The traversals of the terms don't use the C stack: a deep term (a long
+   numeral, a long chain of applications) would overflow it. They keep their
+   pending work in a WorkStack, which starts in a local buffer and moves to
+   the heap when it grows.
+*/
 
-    if (f->body != NULL) {
-        for (size_t i = 0; i < f->body_count; i++) {
-            if (f->body[i] != NULL) {
-                free_function(f->body[i]);
-            }
-        }
-        free(f->body);
-    }
+#define WORK_STACK_LOCAL 64
 
-    free(f->name);
-    free(f);
+typedef struct {
+    unsigned char* items;
+    size_t count, capacity;
+    size_t size; // of an item
+    bool heap;
+} WorkStack;
+
+static inline void work_stack_init(WorkStack* s, size_t size, void* local, size_t capacity) {
+    s->items = (unsigned char*)local;
+    s->count = 0;
+    s->capacity = capacity;
+    s->size = size;
+    s->heap = false;
 }
 
-static inline char* find_param_name(Function* body, size_t id) {
-    if (body == NULL) return NULL;
-    if (body->body_count == 0 && body->id == id && body->name != NULL) {
-        return body->name;
-    }
-    for (size_t i = 0; i < body->body_count; i++) {
-        char* found = find_param_name(body->body[i], id);
-        if (found != NULL) return found;
+static inline bool work_stack_push(WorkStack* s, const void* item) {
+    if (s->count >= s->capacity) {
+        unsigned char* temp = s->heap
+            ? (unsigned char*)realloc(s->items, s->capacity * 2 * s->size)
+            : (unsigned char*)malloc(s->capacity * 2 * s->size);
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        if (!s->heap) memcpy(temp, s->items, s->count * s->size);
+        s->items = temp;
+        s->capacity *= 2;
+        s->heap = true;
     }
-    return NULL;
+    memcpy(s->items + s->count * s->size, item, s->size);
+    s->count++;
+    return true;
 }
 
-static inline char* function_to_string(Function *f) {
-    if (f == NULL) {
-        return strdup("NULL");
-    }
+// the item stays valid until the next push
+static inline void* work_stack_pop(WorkStack* s) {
+    return s->items + --s->count * s->size;
+}
+
+static inline void* work_stack_top(WorkStack* s) {
+    return s->items + (s->count - 1) * s->size;
+}
 
-    char buffer[256];
+static inline void free_work_stack(WorkStack* s) {
+    if (s->heap) free(s->items);
+}
 
-    if (f->body_count == 0) {
-        if (f->name != NULL) {
-            snprintf(buffer, sizeof(buffer), "%s", f->name);
+static inline void free_function(Function *f) {
+    if (f == NULL || f->interned) return;
+
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+
+    // the first child is freed right away, the others wait on the stack
+    for (;;) {
+        Function* next = NULL;
+        for (size_t i = f->body_count; i > 0; i--) {
+            Function* child = f->body[i - 1];
+            if (child == NULL || child->interned) continue;
+            // on failure the rest of the term leaks, but stays valid
+            if (next != NULL) work_stack_push(&stack, &next);
+            next = child;
+        }
+        if (f->pooled) {
+            function_pool_release(f);
         } else {
-            snprintf(buffer, sizeof(buffer), "%zu", f->id);
+            free(f);
         }
-    } else if (f->body_count == 1) {
-        char* body_str = function_to_string(f->body[0]);
-        char* param_name = find_param_name(f->body[0], f->id);
-        if (param_name != NULL) {
-            snprintf(buffer, sizeof(buffer), "(\\%s.%s)", param_name, body_str);
+
+        if (next != NULL) {
+            f = next;
+        } else if (stack.count > 0) {
+            f = *(Function**)work_stack_pop(&stack);
         } else {
-            snprintf(buffer, sizeof(buffer), "(\\%zu.%s)", f->id, body_str);
+            break;
         }
-        free(body_str);
-    } else if (f->body_count == 2) {
-        char* fn_str = function_to_string(f->body[0]);
-        char* arg_str = function_to_string(f->body[1]);
-        snprintf(buffer, sizeof(buffer), "(%s %s)", fn_str, arg_str);
-        free(fn_str);
-        free(arg_str);
     }
-
-    return strdup(buffer);
+    free_work_stack(&stack);
 }
 
-static inline Function* substitute(Function *node, size_t id, Function *arg) {
-    if (node == NULL) return NULL;
+static inline Function* copy_function(FunctionPool* pool, Function *f) {
+    if (f == NULL) return NULL;
 
-    if (node->body_count == 0) {
-        return (node->id == id) ? arg : node;
-    }
+    // a node of the copy is created before its children, in the same order
+    // as free_function releases them: the first child is copied right away
+    // and the others wait on the stack
+    typedef struct {
+        Function* source;
+        Function** target;
+    } CopyWork;
+
+    Function* result = NULL;
+    CopyWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(CopyWork), local, WORK_STACK_LOCAL);
+    CopyWork work = {f, &result};
+
+    for (;;) {
+        Function* source = work.source;
+        Function* body_array[2] = {NULL, NULL};
+        Function* node = new_function(pool, source->kind, source->index, source->symbol, body_array, source->body_count);
+        *work.target = node;
+
+        bool descend = false;
+        CopyWork next;
+        for (size_t i = node != NULL ? source->body_count : 0; i > 0; i--) {
+            if (source->body[i - 1] == NULL) continue;
+            if (descend && !work_stack_push(&stack, &next)) break;
+            next.source = source->body[i - 1];
+            next.target = &node->body[i - 1];
+            descend = true;
+        }
 
-    if (node->body_count == 1 && node->id == id) {
-        return node;
+        if (descend) {
+            work = next;
+        } else if (stack.count > 0) {
+            work = *(CopyWork*)work_stack_pop(&stack);
+        } else {
+            break;
+        }
     }
+    free_work_stack(&stack);
+    return result;
+}
+
+// the kinds whose `index` is part of the term, the slot of a lambda is only a
+// debug name
+static inline bool function_has_index(Function_Kind kind) {
+    return kind == FUNCTION_VARIABLE || kind == FUNCTION_BOOLEAN || kind == FUNCTION_NUMERAL;
+}
 
-    for (size_t i = 0; i < node->body_count; i++) {
-        node->body[i] = substitute(node->body[i], id, arg);
+// structural equality, which is alpha-equivalence thanks to De Bruijn indices
+static inline bool function_equal(Function *a, Function *b) {
+    Function* local[2 * WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, 2 * sizeof(Function*), local, WORK_STACK_LOCAL);
+    Function* root[2] = {a, b};
+    work_stack_push(&stack, root);
+
+    bool equal = true;
+    while (equal && stack.count > 0) {
+        Function** pair = (Function**)work_stack_pop(&stack);
+        a = pair[0];
+        b = pair[1];
+
+        if (a == b) continue;
+        if (a == NULL || b == NULL) equal = false;
+        else if (a->kind != b->kind || a->body_count != b->body_count) equal = false;
+        else if (function_has_index(a->kind) && a->index != b->index) equal = false;
+        else if (a->symbol != b->symbol) equal = false;
+
+        for (size_t i = 0; equal && i < a->body_count; i++) {
+            Function* children[2] = {a->body[i], b->body[i]};
+            if (!work_stack_push(&stack, children)) equal = false;
+        }
     }
+    free_work_stack(&stack);
+    return equal;
+}
+
+// number of nodes of the tree `f` (shared nodes are counted at each use)
+static inline size_t function_size(Function *f) {
+    if (f == NULL) return 0;
+
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+    work_stack_push(&stack, &f);
 
-    return node;
+    size_t size = 0;
+    while (stack.count > 0) {
+        f = *(Function**)work_stack_pop(&stack);
+        size++;
+        for (size_t i = 0; i < f->body_count; i++) {
+            if (f->body[i] != NULL && !work_stack_push(&stack, &f->body[i])) break;
+        }
+    }
+    free_work_stack(&stack);
+    return size;
 }
 
-typedef struct {
-    // map names->functions and functions->names
-    char** names;
-    Function** functions;
+/*
+   Hash-consing: with an InternTable, structurally identical functions are
+   only allocated once and shared by pointer. Thanks to De Bruijn indices this
+   also holds for open terms, a variable means the same thing everywhere.
+   Interned functions belong to the table, free_function ignores them and
+   they must never be modified.
+*/
 
+typedef struct {
+    Function** buckets;
     size_t count;
-    size_t capacity;
-} Context;
+    size_t capacity; // always a power of 2
 
-Context* new_context() {
-    Context* ctx = (Context*)malloc(sizeof(Context));
-    if (ctx == NULL) return NULL;
+    Function* church_true;  // \x.\y.x
+    Function* church_false; // \x.\y.y
+} InternTable;
 
-    ctx->capacity = 30;
-    ctx->count = 0;
-    ctx->names = (char**)malloc(ctx->capacity * sizeof(char*));
-    ctx->functions = (Function**)malloc(ctx->capacity * sizeof(Function*));
+static inline size_t intern_hash(Function_Kind kind, size_t index, uint32_t symbol, Function *body[], size_t count) {
+    size_t h = 14695981039346656037ULL & (size_t)-1;
+    h = (h ^ (size_t)kind) * 1099511628211ULL;
 
-    if (ctx->names == NULL || ctx->functions == NULL) {
-        free(ctx->names);
-        free(ctx->functions);
-        free(ctx);
-        return NULL;
+    if (function_has_index(kind)) h = (h ^ index) * 1099511628211ULL;
+    h = (h ^ symbol) * 1099511628211ULL;
+    for (size_t i = 0; i < count; i++) {
+        h = (h ^ (size_t)body[i]) * 1099511628211ULL;
+        h ^= h >> 29;
     }
+    return h;
+}
 
-    return ctx;
+static inline bool intern_match(Function* f, Function_Kind kind, size_t index, uint32_t symbol, Function *body[], size_t count) {
+    if (f->kind != kind || f->body_count != count || f->symbol != symbol) return false;
+    if (function_has_index(kind) && f->index != index) return false;
+    for (size_t i = 0; i < count; i++) {
+        if (f->body[i] != body[i]) return false;
+    }
+    return true;
 }
 
-void context_add(Context* ctx, Function* f) {
-    if (ctx->count >= ctx->capacity) {
-        ctx->capacity *= 2;
-        ctx->names = (char**)realloc(ctx->names, ctx->capacity * sizeof(char*));
-        ctx->functions = (Function**)realloc(ctx->functions, ctx->capacity * sizeof(Function*));
+static inline bool intern_grow(InternTable* t) {
+    size_t capacity = t->capacity * 2;
+    Function** buckets = (Function**)calloc(capacity, sizeof(Function*));
+    if (buckets == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
     }
 
-    ctx->names[ctx->count] = strdup(f->name);
-    ctx->functions[ctx->count] = f;
-    ctx->count++;
+    for (size_t i = 0; i < t->capacity; i++) {
+        Function* f = t->buckets[i];
+        if (f == NULL) continue;
+
+        size_t h = intern_hash(f->kind, f->index, f->symbol, f->body, f->body_count) & (capacity - 1);
+        while (buckets[h] != NULL) h = (h + 1) & (capacity - 1);
+        buckets[h] = f;
+    }
+
+    free(t->buckets);
+    t->buckets = buckets;
+    t->capacity = capacity;
+    return true;
 }
 
-Function* context_get(Context* ctx, char* name) {
-    for (size_t i = 0; i < ctx->count; i++) {
-        if (strcmp(ctx->names[i], name) == 0) {
-            return ctx->functions[i];
+// Return the interned function with this content, allocating it the first
+// time. The functions in `body` must be interned already.
+static inline Function* intern_function(InternTable* t, FunctionPool* pool, Function_Kind kind, size_t index, uint32_t symbol, Function *body[], size_t count) {
+    if (t == NULL) return new_function(pool, kind, index, symbol, body, count);
+
+    if ((t->count + 1) * 10 > t->capacity * 7 && !intern_grow(t)) return NULL;
+
+    size_t h = intern_hash(kind, index, symbol, body, count) & (t->capacity - 1);
+    while (t->buckets[h] != NULL) {
+        if (intern_match(t->buckets[h], kind, index, symbol, body, count)) {
+            return t->buckets[h];
         }
+        h = (h + 1) & (t->capacity - 1);
     }
-    return NULL;
+
+    Function* f = new_function(NULL, kind, index, symbol, body, count);
+    if (f == NULL) return NULL;
+
+    f->interned = true;
+    t->buckets[h] = f;
+    t->count++;
+    return f;
 }
 
-void free_context(Context* ctx) {
-    if (ctx == NULL) return;
-    for (size_t i = 0; i < ctx->count; i++) {
-        free(ctx->names[i]);
-    }
-    free(ctx->names);
-    free(ctx->functions);
-    free(ctx);
+// `t` may be NULL, the functions are then allocated from `pool` without
+// hash-consing
+
+static inline Function* new_variable(InternTable* t, FunctionPool* pool, size_t index) {
+    return intern_function(t, pool, FUNCTION_VARIABLE, index, FUNCTION_NO_SYMBOL, NULL, 0);
+}
+
+static inline Function* new_lambda(InternTable* t, FunctionPool* pool, size_t name_slot, Function* body) {
+    Function* body_array[1] = {body};
+    return intern_function(t, pool, FUNCTION_LAMBDA, name_slot, FUNCTION_NO_SYMBOL, body_array, 1);
 }
 
-// lazy reduction
-static inline Function* reduce_function(Function *root, Context* ctx) {
-    if (root == NULL) return NULL;
-    if (root->visited) return root;
+static inline Function* new_apply(InternTable* t, FunctionPool* pool, Function* fn, Function* arg) {
+    Function* body_array[2] = {fn, arg};
+    return intern_function(t, pool, FUNCTION_APPLY, 0, FUNCTION_NO_SYMBOL, body_array, 2);
+}
 
-    if (root->body_count == 0 && root->name != NULL && ctx != NULL) {
-        Function* resolved = context_get(ctx, root->name);
-        if (resolved != NULL) {
-            return resolved;
-        }
-    }
+/*
+   Native Church values: the canonical booleans and numerals are kept as a
+   single node instead of a lambda term. The parser recognizes them, :read
+   returns them, :show reads them without walking a term, and the engines
+   apply them without building their lambdas when they can (see
+   machine_apply_native). The booleans are shared immortal nodes.
+*/
+
+static Function church_booleans[2] = {
+    {.kind = FUNCTION_BOOLEAN, .index = 0, .interned = true},
+    {.kind = FUNCTION_BOOLEAN, .index = 1, .interned = true},
+};
 
-    if (root->body == NULL || root->body_count == 0) {
-        return root;
+static inline bool function_is_native(Function* f) {
+    return f->kind == FUNCTION_BOOLEAN || f->kind == FUNCTION_NUMERAL;
+}
+
+// numeral 0 is \x.\y.y, the boolean false
+static inline Function* new_numeral(InternTable* t, FunctionPool* pool, size_t n) {
+    if (n == 0) return &church_booleans[0];
+    return intern_function(t, pool, FUNCTION_NUMERAL, n, FUNCTION_NO_SYMBOL, NULL, 0);
+}
+
+// the value of the native numeral `f`, or SIZE_MAX when it isn't one
+static inline size_t church_numeral_value(Function* f) {
+    if (f->kind == FUNCTION_NUMERAL) return f->index;
+    if (f->kind == FUNCTION_BOOLEAN && f->index == 0) return 0;
+    return SIZE_MAX;
+}
+
+// m^n, the native value of the application `n m` for n > 0. Returns false
+// when it overflows.
+static inline bool church_power(size_t m, size_t n, size_t* result) {
+    if (m <= 1) {
+        *result = m;
+        return true;
     }
 
-    if (root->body_count > 2) {
-        fprintf(stderr, "Error: Function body array size exceeds maximum allowed (max=2)\n");
-        free_function(root);
-        return NULL;
+    size_t value = 1;
+    for (size_t i = 0; i < n; i++) {
+        if (value > SIZE_MAX / m) return false;
+        value *= m;
     }
+    *result = value;
+    return true;
+}
 
-    root->visited = true;
+// Return the native value of `f` when it is a canonical Church boolean or
+// numeral, or NULL.
+static inline Function* church_value(InternTable* t, FunctionPool* pool, Function* f) {
+    if (f == NULL || f->kind != FUNCTION_LAMBDA || f->body[0]->kind != FUNCTION_LAMBDA) return NULL;
 
-    for (size_t i = 0; i < root->body_count; i++) {
-        root->body[i] = reduce_function(root->body[i], ctx);
+    Function* body = f->body[0]->body[0];
+    if (body->kind == FUNCTION_VARIABLE) {
+        return body->index <= 1 ? &church_booleans[body->index] : NULL;
     }
 
-    if (root->builtin && root->body_count == 2) {
-        Function *fn = root->body[0];
-        Function *arg = root->body[1];
-        if (fn != NULL && fn->body_count == 1 && fn->body != NULL) {
-            Function *result = substitute(fn->body[0], fn->id, arg);
-            return reduce_function(result, ctx);
+    size_t n = 0;
+    for (; body->kind == FUNCTION_APPLY; body = body->body[1]) {
+        Function* fn = body->body[0];
+        if (fn->kind != FUNCTION_VARIABLE || fn->index != 1) return NULL;
+        n++;
+    }
+    if (body->kind != FUNCTION_VARIABLE || body->index != 0) return NULL;
+    return new_numeral(t, pool, n);
+}
+
+// the lambda term of the native value `f`, with unnamed parameters
+static inline Function* church_expand(InternTable* t, FunctionPool* pool, Function* f) {
+    Function* body = new_variable(t, pool, f->kind == FUNCTION_BOOLEAN ? f->index : 0);
+    for (size_t i = 0; body != NULL && f->kind == FUNCTION_NUMERAL && i < f->index; i++) {
+        Function* fn = new_variable(t, pool, 1);
+        Function* apply = fn != NULL ? new_apply(t, pool, fn, body) : NULL;
+        if (apply == NULL) {
+            free_function(fn);
+            free_function(body);
         }
+        body = apply;
     }
 
-    return root;
+    Function* inner = body != NULL ? new_lambda(t, pool, FUNCTION_NO_NAME, body) : NULL;
+    Function* result = inner != NULL ? new_lambda(t, pool, FUNCTION_NO_NAME, inner) : NULL;
+    if (result == NULL) free_function(inner != NULL ? inner : body);
+    return result;
 }
 
-/*
-   2. Half Lexer
-   We have a python-like syntax.
+InternTable* new_intern_table() {
+    InternTable* t = (InternTable*)malloc(sizeof(InternTable));
+    if (t == NULL) return NULL;
 
-  ```hl
-   x = \x.x # comment here
-   y = \banana.x # return '\x.x' -> currying (https://en.wikipedia.org/wiki/Currying)
-  ```
-*/
+    t->count = 0;
+    t->capacity = 1024;
+    t->buckets = (Function**)calloc(t->capacity, sizeof(Function*));
+    if (t->buckets == NULL) {
+        free(t);
+        return NULL;
+    }
 
-typedef enum {
-    TOKEN_INVALID,
-    TOKEN_NEWLINE,
-    TOKEN_LAMBDA, // defined by '\\'
-    TOKEN_DOT,
-    TOKEN_EQUAL,
-    TOKEN_NAME,
-    TOKEN_COLON, // to call a builtin
-    TOKEN_OPAREN, // (
-    TOKEN_CPAREN, // )
-} Token_Type;
+    Function* body[1];
+    body[0] = intern_function(t, NULL, FUNCTION_VARIABLE, 1, FUNCTION_NO_SYMBOL, NULL, 0);
+    body[0] = intern_function(t, NULL, FUNCTION_LAMBDA, FUNCTION_NO_NAME, FUNCTION_NO_SYMBOL, body, 1);
+    t->church_true = intern_function(t, NULL, FUNCTION_LAMBDA, FUNCTION_NO_NAME, FUNCTION_NO_SYMBOL, body, 1);
 
-typedef struct {
-    Token_Type type;
-    const char* value;
-    size_t row, line;
-} Token;
+    body[0] = intern_function(t, NULL, FUNCTION_VARIABLE, 0, FUNCTION_NO_SYMBOL, NULL, 0);
+    body[0] = intern_function(t, NULL, FUNCTION_LAMBDA, FUNCTION_NO_NAME, FUNCTION_NO_SYMBOL, body, 1);
+    t->church_false = intern_function(t, NULL, FUNCTION_LAMBDA, FUNCTION_NO_NAME, FUNCTION_NO_SYMBOL, body, 1);
 
-typedef struct {
-    size_t row, line, pos;
-} Cursor;
+    return t;
+}
 
-typedef struct {
-    Cursor* cursor;
-    const char* source;
-} Lexer;
+void free_intern_table(InternTable* t) {
+    if (t == NULL) return;
+    for (size_t i = 0; i < t->capacity; i++) {
+        Function* f = t->buckets[i];
+        if (f == NULL) continue;
+        free(f);
+    }
+    free(t->buckets);
+    free(t);
+}
 
-Lexer* new_lexer(const char* source) {
-    Lexer* l = malloc(sizeof(Lexer));
-    if (l == NULL) return NULL;
+// The symbols of the program: the names of the globals, the builtins and the
+// lambda parameters, each one stored once. A symbol is the index of its name,
+// found back from the name through a hash table. The names are stored one
+// after the other in a single buffer, a name returned by name_table_get is
+// valid until the next one is added.
+typedef struct {
+    char* chars; // the names, each one ending with '\0'
+    size_t chars_count, chars_capacity;
+    size_t* offsets; // of each name in `chars`
+    size_t count;
+    size_t capacity;
 
-    l->cursor = malloc(sizeof(Cursor));
-    if (l->cursor == NULL) {
-        free(l);
+    uint32_t* buckets; // symbols by hash of their name, FUNCTION_NO_SYMBOL when empty
+    size_t buckets_capacity; // always a power of 2
+} NameTable;
+
+NameTable* new_name_table() {
+    NameTable* t = (NameTable*)malloc(sizeof(NameTable));
+    if (t == NULL) return NULL;
+
+    t->capacity = 32;
+    t->count = 1; // FUNCTION_NO_SYMBOL has no name
+    t->offsets = (size_t*)malloc(t->capacity * sizeof(size_t));
+    t->chars_capacity = 256;
+    t->chars_count = 0;
+    t->chars = (char*)malloc(t->chars_capacity);
+    t->buckets_capacity = 64;
+    t->buckets = (uint32_t*)calloc(t->buckets_capacity, sizeof(uint32_t));
+    if (t->offsets == NULL || t->chars == NULL || t->buckets == NULL) {
+        free(t->offsets);
+        free(t->chars);
+        free(t->buckets);
+        free(t);
         return NULL;
     }
-
-    l->cursor->row = 0;
-    l->cursor->line = 0;
-    l->cursor->pos = 0;
-    l->source = source;
-    return l;
+    t->offsets[0] = 0;
+    return t;
 }
 
-static inline void free_lexer(Lexer* l) {
-    if (l) {
-        free(l->cursor);
-        free(l);
+static inline size_t name_table_hash(const char* name, size_t length) {
+    size_t h = 14695981039346656037ULL & (size_t)-1;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
     }
+    return h;
 }
 
-static inline char lexer_get_char(Lexer* l) {
-    return l->source[l->cursor->pos];
-}
+static inline bool name_table_grow(NameTable* t) {
+    size_t capacity = t->buckets_capacity * 2;
+    uint32_t* buckets = (uint32_t*)calloc(capacity, sizeof(uint32_t));
+    if (buckets == NULL) return false;
+
+    for (size_t i = 1; i < t->count; i++) {
+        const char* name = t->chars + t->offsets[i];
+        size_t h = name_table_hash(name, strlen(name)) & (capacity - 1);
+        while (buckets[h] != FUNCTION_NO_SYMBOL) h = (h + 1) & (capacity - 1);
+        buckets[h] = (uint32_t)i;
+    }
 
-static inline char lexer_get_next_char(Lexer* l) {
-    return l->source[l->cursor->pos++];
+    free(t->buckets);
+    t->buckets = buckets;
+    t->buckets_capacity = capacity;
+    return true;
 }
 
-static inline bool lexer_source_end(Lexer* l) {
-    return '\0' == lexer_get_char(l);
+// The symbol of the `length` first characters of `name`, added the first
+// time. Returns FUNCTION_NO_SYMBOL when it runs out of memory.
+uint32_t name_table_intern(NameTable* t, const char* name, size_t length) {
+    if (t == NULL) return FUNCTION_NO_SYMBOL;
+
+    size_t h = name_table_hash(name, length) & (t->buckets_capacity - 1);
+    while (t->buckets[h] != FUNCTION_NO_SYMBOL) {
+        const char* other = t->chars + t->offsets[t->buckets[h]];
+        if (strncmp(other, name, length) == 0 && other[length] == '\0') return t->buckets[h];
+        h = (h + 1) & (t->buckets_capacity - 1);
+    }
+
+    if (t->count >= (uint32_t)-1) return FUNCTION_NO_SYMBOL;
+    if ((t->count + 1) * 10 > t->buckets_capacity * 7) {
+        if (!name_table_grow(t)) return FUNCTION_NO_SYMBOL;
+        h = name_table_hash(name, length) & (t->buckets_capacity - 1);
+        while (t->buckets[h] != FUNCTION_NO_SYMBOL) h = (h + 1) & (t->buckets_capacity - 1);
+    }
+    if (t->count >= t->capacity) {
+        size_t* temp = (size_t*)realloc(t->offsets, t->capacity * 2 * sizeof(size_t));
+        if (temp == NULL) return FUNCTION_NO_SYMBOL;
+        t->offsets = temp;
+        t->capacity *= 2;
+    }
+    if (t->chars_count + length + 1 > t->chars_capacity) {
+        size_t capacity = t->chars_capacity * 2;
+        while (t->chars_count + length + 1 > capacity) capacity *= 2;
+        char* temp = (char*)realloc(t->chars, capacity);
+        if (temp == NULL) return FUNCTION_NO_SYMBOL;
+        t->chars = temp;
+        t->chars_capacity = capacity;
+    }
+
+    memcpy(t->chars + t->chars_count, name, length);
+    t->chars[t->chars_count + length] = '\0';
+
+    uint32_t symbol = (uint32_t)t->count++;
+    t->offsets[symbol] = t->chars_count;
+    t->chars_count += length + 1;
+    t->buckets[h] = symbol;
+    return symbol;
 }
 
-static inline void lexer_skip_line(Lexer* l) {
-    while (lexer_get_next_char(l) != '\n') {}
+uint32_t name_table_add(NameTable* t, const char* name) {
+    return name_table_intern(t, name, strlen(name));
 }
 
-struct LexerLexTuple{
-    Token** array;
-    size_t counter;
-};
+const char* name_table_get(NameTable* t, size_t symbol) {
+    if (t == NULL || symbol == FUNCTION_NO_SYMBOL || symbol >= t->count) return NULL;
+    return t->chars + t->offsets[symbol];
+}
 
-// Return an array of Tokens
-static inline struct LexerLexTuple lexer_lex(Lexer* l) {
-    size_t counter = 0;
-    size_t capacity = 35;
+void free_name_table(NameTable* t) {
+    if (t == NULL) return;
+    free(t->chars);
+    free(t->offsets);
+    free(t->buckets);
+    free(t);
+}
 
-    Token** array = (Token**)malloc(capacity * sizeof(Token*));
-    if (array == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        struct LexerLexTuple error = {NULL, 0};
-        return error;
+// a copy of `t`, the names keep their symbol
+NameTable* copy_name_table(NameTable* t) {
+    NameTable* copy = (NameTable*)malloc(sizeof(NameTable));
+    if (copy == NULL) return NULL;
+
+    *copy = *t;
+    copy->chars = (char*)malloc(t->chars_capacity);
+    copy->offsets = (size_t*)malloc(t->capacity * sizeof(size_t));
+    copy->buckets = (uint32_t*)malloc(t->buckets_capacity * sizeof(uint32_t));
+    if (copy->chars == NULL || copy->offsets == NULL || copy->buckets == NULL) {
+        free_name_table(copy);
+        return NULL;
     }
+    memcpy(copy->chars, t->chars, t->chars_count);
+    memcpy(copy->offsets, t->offsets, t->count * sizeof(size_t));
+    memcpy(copy->buckets, t->buckets, t->buckets_capacity * sizeof(uint32_t));
+    return copy;
+}
 
-    while (!lexer_source_end(l)){
-        char c = lexer_get_next_char(l);
-
-        Token* token = (Token*)malloc(sizeof(Token));
-        if (token == NULL) {
-            fprintf(stderr, "Error: Memory allocation failed \n");
-            free(array);
-            struct LexerLexTuple error = {NULL, 0};
-            return error;
+// growable string, for function_to_string
+typedef struct {
+    char* data;
+    size_t length, capacity;
+    bool failed;
+} StringBuffer;
+
+static inline void string_append(StringBuffer* s, const char* text) {
+    size_t length = strlen(text);
+    if (s->failed) return;
+    if (s->length + length + 1 > s->capacity) {
+        size_t capacity = s->capacity;
+        while (s->length + length + 1 > capacity) capacity *= 2;
+        char* temp = (char*)realloc(s->data, capacity);
+        if (temp == NULL) {
+            s->failed = true;
+            return;
         }
+        s->data = temp;
+        s->capacity = capacity;
+    }
+    memcpy(s->data + s->length, text, length + 1);
+    s->length += length;
+}
 
-        token->row = l->cursor->row;
-        token->line = l->cursor->line;
-        token->type = TOKEN_INVALID;
-        token->value = NULL;
+// name printed for the parameter of the `depth`-th enclosing lambda, `scope`
+// holds NULL for the generated names
+static inline const char* function_scope_name(const char** scope, size_t depth, char* buffer, size_t size) {
+    if (scope[depth] != NULL) return scope[depth];
+    snprintf(buffer, size, "x%zu", depth);
+    return buffer;
+}
 
-        // Skip whitespace
-        if (c == ' ' || c == '\t') {
-            continue;
-        }
+// the name of a global or a builtin, `names` may be NULL
+static inline const char* function_symbol_name(NameTable* names, uint32_t symbol) {
+    const char* name = name_table_get(names, symbol);
+    return name != NULL ? name : "?";
+}
 
-        if (c == '\n' || c == ';') {
-            token->type = TOKEN_NEWLINE;
-            token->value = (c == '\n') ? strdup("\n") : strdup(";");
-            if (c == '\n') l->cursor->line++;
-            array[counter++] = token;
+// `names` is optional, parameters are printed as x0, x1... without it
+static inline char* function_to_string(Function *f, NameTable* names) {
+    typedef enum {
+        PRINT_FUNCTION,
+        PRINT_TEXT,
+        PRINT_LEAVE, // leave the scope of a lambda
+    } PrintWork_Kind;
+
+    typedef struct {
+        PrintWork_Kind kind;
+        Function* f;
+        const char* text;
+    } PrintWork;
+
+    StringBuffer out = {(char*)malloc(64), 0, 64, false};
+    if (out.data == NULL) return NULL;
+    out.data[0] = '\0';
+
+    // parameters of the enclosing lambdas, innermost last
+    const char** scope = NULL;
+    size_t depth = 0, scope_capacity = 0;
+
+    PrintWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(PrintWork), local, WORK_STACK_LOCAL);
+    PrintWork root = {PRINT_FUNCTION, f, NULL};
+    work_stack_push(&stack, &root);
+
+    while (stack.count > 0 && !out.failed) {
+        PrintWork work = *(PrintWork*)work_stack_pop(&stack);
+        char buffer[64];
+
+        if (work.kind == PRINT_TEXT) {
+            string_append(&out, work.text);
             continue;
         }
-
-        // Skip comments
-        if (c == '#') {
-            lexer_skip_line(l);
-            l->cursor->line++;
+        if (work.kind == PRINT_LEAVE) {
+            depth--;
             continue;
         }
 
-        if (counter >= capacity) {
-            capacity *= 2;
-            Token** temp = (Token**)realloc(array, capacity * sizeof(Token*));
-            if (temp == NULL) {
-                fprintf(stderr, "Error: Memory reallocation failed\n");
-                free(array);
-                struct LexerLexTuple error = {NULL, 0};
-                return error;
-            }
-            array = temp;
+        f = work.f;
+        if (f == NULL) {
+            string_append(&out, "NULL");
+            continue;
         }
 
-        switch (c) {
-            case '\\':
-                token->type = TOKEN_LAMBDA;
-                token->value = strdup("\\");
-                break;
-            case '.':
-                token->type = TOKEN_DOT;
-                token->value = strdup(".");
+        PrintWork close = {PRINT_TEXT, NULL, ")"};
+        switch (f->kind) {
+            case FUNCTION_VARIABLE:
+                if (f->index < depth) {
+                    string_append(&out, function_scope_name(scope, depth - 1 - f->index, buffer, sizeof(buffer)));
+                } else {
+                    snprintf(buffer, sizeof(buffer), "#%zu", f->index - depth);
+                    string_append(&out, buffer);
+                }
                 break;
-            case '=':
-                token->type = TOKEN_EQUAL;
-                token->value = strdup("=");
+
+            case FUNCTION_NAME:
+                string_append(&out, function_symbol_name(names, f->symbol));
                 break;
-            case ':':
-                token->type = TOKEN_COLON;
-                token->value = strdup(":");
+
+            case FUNCTION_BOOLEAN:
+            case FUNCTION_NUMERAL: {
+                // printed like the lambda term it stands for
+                char param[32], value[32];
+                snprintf(param, sizeof(param), "x%zu", depth);
+                snprintf(value, sizeof(value), "x%zu", depth + 1);
+                string_append(&out, "(\\");
+                string_append(&out, param);
+                string_append(&out, ".(\\");
+                string_append(&out, value);
+                string_append(&out, ".");
+                if (f->kind == FUNCTION_BOOLEAN) {
+                    string_append(&out, f->index ? param : value);
+                } else {
+                    for (size_t i = 0; i < f->index; i++) {
+                        string_append(&out, "(");
+                        string_append(&out, param);
+                        string_append(&out, " ");
+                    }
+                    string_append(&out, value);
+                    for (size_t i = 0; i < f->index; i++) string_append(&out, ")");
+                }
+                string_append(&out, "))");
                 break;
-            case '(':
-                token->type = TOKEN_OPAREN;
-                token->value = strdup("(");
+            }
+
+            case FUNCTION_LAMBDA: {
+                // fall back to a generated name when the parameter is unnamed or
+                // when it would shadow an enclosing parameter with the same name
+                const char* param = name_table_get(names, f->index);
+                for (size_t i = 0; param != NULL && i < depth; i++) {
+                    if (strcmp(function_scope_name(scope, i, buffer, sizeof(buffer)), param) == 0) param = NULL;
+                }
+
+                if (depth >= scope_capacity) {
+                    scope_capacity = scope_capacity == 0 ? 16 : scope_capacity * 2;
+                    const char** temp = (const char**)realloc(scope, scope_capacity * sizeof(char*));
+                    if (temp == NULL) {
+                        out.failed = true;
+                        break;
+                    }
+                    scope = temp;
+                }
+                scope[depth] = param;
+
+                string_append(&out, "(\\");
+                string_append(&out, function_scope_name(scope, depth, buffer, sizeof(buffer)));
+                string_append(&out, ".");
+                depth++;
+
+                PrintWork leave = {PRINT_LEAVE, NULL, NULL};
+                PrintWork body = {PRINT_FUNCTION, f->body[0], NULL};
+                out.failed |= !work_stack_push(&stack, &close) || !work_stack_push(&stack, &leave) ||
+                              !work_stack_push(&stack, &body);
                 break;
-            case ')':
-                token->type = TOKEN_CPAREN;
-                token->value = strdup(")");
+            }
+
+            case FUNCTION_APPLY: {
+                string_append(&out, "(");
+                PrintWork space = {PRINT_TEXT, NULL, " "};
+                PrintWork fn = {PRINT_FUNCTION, f->body[0], NULL};
+                PrintWork arg = {PRINT_FUNCTION, f->body[1], NULL};
+                out.failed |= !work_stack_push(&stack, &close) || !work_stack_push(&stack, &arg) ||
+                              !work_stack_push(&stack, &space) || !work_stack_push(&stack, &fn);
                 break;
-            default:
-                if (isalnum(c) || c == '_') {
-                    char buffer[256] = {0};
-                    buffer[0] = c;
-                    int idx = 1;
-
-                    while (!lexer_source_end(l) &&
-                           (isalnum(lexer_get_char(l)) || lexer_get_char(l) == '_')) {
-                        buffer[idx++] = lexer_get_next_char(l);
-                        if (idx >= 255) break;
-                    }
+            }
 
-                    token->type = TOKEN_NAME;
-                    token->value = strdup(buffer);
+            case FUNCTION_BUILTIN:
+            case FUNCTION_DEFINE: {
+                PrintWork arg = {PRINT_FUNCTION, f->body_count > 0 ? f->body[0] : NULL, NULL};
+                if (f->kind == FUNCTION_DEFINE) {
+                    string_append(&out, function_symbol_name(names, f->symbol));
+                    string_append(&out, " = ");
+                    if (f->body_count > 0) out.failed |= !work_stack_push(&stack, &arg);
+                } else if (f->body_count > 0) {
+                    string_append(&out, "(:");
+                    string_append(&out, function_symbol_name(names, f->symbol));
+                    string_append(&out, " ");
+                    out.failed |= !work_stack_push(&stack, &close) || !work_stack_push(&stack, &arg);
                 } else {
-                    token->type = TOKEN_INVALID;
-                    char buf[2] = {c, '\0'};
-                    token->value = strdup(buf);
+                    string_append(&out, ":");
+                    string_append(&out, function_symbol_name(names, f->symbol));
                 }
                 break;
+            }
         }
+    }
 
-        if (token->value != NULL) {
-            array[counter++] = token;
+    free_work_stack(&stack);
+    free(scope);
+    if (out.failed) {
+        free(out.data);
+        return NULL;
+    }
+    return out.data;
+}
+
+// add `amount` to every variable of `node` pointing above `cutoff` lambdas
+static inline void shift_function(Function *node, size_t amount, size_t cutoff) {
+    if (node == NULL || amount == 0) return;
+
+    typedef struct {
+        Function* node;
+        size_t cutoff;
+    } ShiftWork;
+
+    ShiftWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(ShiftWork), local, WORK_STACK_LOCAL);
+    ShiftWork root = {node, cutoff};
+    work_stack_push(&stack, &root);
+
+    while (stack.count > 0) {
+        ShiftWork work = *(ShiftWork*)work_stack_pop(&stack);
+        node = work.node;
+
+        if (node->kind == FUNCTION_VARIABLE) {
+            if (node->index >= work.cutoff) node->index += amount;
+            continue;
+        }
+
+        size_t inner = node->kind == FUNCTION_LAMBDA ? work.cutoff + 1 : work.cutoff;
+        for (size_t i = 0; i < node->body_count; i++) {
+            ShiftWork child = {node->body[i], inner};
+            if (child.node != NULL && !work_stack_push(&stack, &child)) break;
+        }
+    }
+    free_work_stack(&stack);
+}
+
+// Replace the variable bound `depth` lambdas above `node` by `arg`, in place.
+// Variables bound further away lose the lambda being reduced. We own `arg`:
+// its first use takes it and the others take a copy, so an argument used once
+// isn't copied. It is freed when the variable isn't used.
+static inline Function* substitute(FunctionPool* pool, Function *node, size_t depth, Function *arg) {
+    if (node == NULL) {
+        free_function(arg);
+        return NULL;
+    }
+
+    typedef struct {
+        Function** slot;
+        size_t depth;
+    } SubstituteWork;
+
+    Function* result = node;
+    SubstituteWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(SubstituteWork), local, WORK_STACK_LOCAL);
+    SubstituteWork root = {&result, depth};
+    work_stack_push(&stack, &root);
+
+    // the first use, `arg` goes there once the copies are made
+    SubstituteWork first = {NULL, 0};
+
+    while (stack.count > 0) {
+        SubstituteWork work = *(SubstituteWork*)work_stack_pop(&stack);
+        node = *work.slot;
+
+        if (node->kind == FUNCTION_VARIABLE) {
+            if (node->index == work.depth && first.slot == NULL) {
+                first = work;
+            } else if (node->index == work.depth) {
+                Function* copy = copy_function(pool, arg);
+                shift_function(copy, work.depth, 0);
+                free_function(node);
+                *work.slot = copy;
+            } else if (node->index > work.depth) {
+                node->index--;
+            }
+            continue;
+        }
+
+        size_t inner = node->kind == FUNCTION_LAMBDA ? work.depth + 1 : work.depth;
+        for (size_t i = 0; i < node->body_count; i++) {
+            SubstituteWork child = {&node->body[i], inner};
+            if (node->body[i] != NULL && !work_stack_push(&stack, &child)) break;
+        }
+    }
+    free_work_stack(&stack);
+
+    if (first.slot != NULL) {
+        shift_function(arg, first.depth, 0);
+        free_function(*first.slot);
+        *first.slot = arg;
+    } else {
+        free_function(arg);
+    }
+    return result;
+}
+
+/*
+   The Context maps the symbols to the definitions, in the order they are
+   added. A symbol defined twice keeps its first definition: `buckets` is an
+   open addressing table from each symbol to the index of that definition.
+*/
+
+typedef struct {
+    uint32_t* symbols;
+    Function** functions;
+    size_t count;
+    size_t capacity;
+
+    size_t* buckets; // index in `functions`, or SIZE_MAX when empty
+    size_t buckets_capacity, distinct;
+} Context;
+
+Context* new_context() {
+    Context* ctx = (Context*)malloc(sizeof(Context));
+    if (ctx == NULL) return NULL;
+
+    ctx->capacity = 30;
+    ctx->count = 0;
+    ctx->distinct = 0;
+    ctx->buckets_capacity = 64;
+    ctx->symbols = (uint32_t*)malloc(ctx->capacity * sizeof(uint32_t));
+    ctx->functions = (Function**)malloc(ctx->capacity * sizeof(Function*));
+    ctx->buckets = (size_t*)malloc(ctx->buckets_capacity * sizeof(size_t));
+
+    if (ctx->symbols == NULL || ctx->functions == NULL || ctx->buckets == NULL) {
+        free(ctx->symbols);
+        free(ctx->functions);
+        free(ctx->buckets);
+        free(ctx);
+        return NULL;
+    }
+    memset(ctx->buckets, 0xff, ctx->buckets_capacity * sizeof(size_t));
+
+    return ctx;
+}
+
+static inline size_t context_hash(uint32_t symbol) {
+    return (size_t)symbol * 2654435761u;
+}
+
+// the bucket of `symbol`, or the empty bucket where it goes
+static inline size_t* context_bucket(Context* ctx, uint32_t symbol) {
+    size_t mask = ctx->buckets_capacity - 1;
+    size_t h = context_hash(symbol) & mask;
+    while (ctx->buckets[h] != SIZE_MAX && ctx->symbols[ctx->buckets[h]] != symbol) {
+        h = (h + 1) & mask;
+    }
+    return &ctx->buckets[h];
+}
+
+static inline bool context_grow_buckets(Context* ctx) {
+    size_t* old = ctx->buckets;
+    size_t old_capacity = ctx->buckets_capacity;
+    size_t* buckets = (size_t*)malloc(old_capacity * 2 * sizeof(size_t));
+    if (buckets == NULL) return false;
+
+    memset(buckets, 0xff, old_capacity * 2 * sizeof(size_t));
+    ctx->buckets = buckets;
+    ctx->buckets_capacity = old_capacity * 2;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] != SIZE_MAX) *context_bucket(ctx, ctx->symbols[old[i]]) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+void context_add(Context* ctx, uint32_t symbol, Function* f) {
+    if (ctx->count >= ctx->capacity) {
+        ctx->capacity *= 2;
+        ctx->symbols = (uint32_t*)realloc(ctx->symbols, ctx->capacity * sizeof(uint32_t));
+        ctx->functions = (Function**)realloc(ctx->functions, ctx->capacity * sizeof(Function*));
+    }
+    if ((ctx->distinct + 1) * 10 > ctx->buckets_capacity * 7 && !context_grow_buckets(ctx)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+
+    ctx->symbols[ctx->count] = symbol;
+    ctx->functions[ctx->count] = f;
+
+    size_t* bucket = context_bucket(ctx, symbol);
+    if (*bucket == SIZE_MAX) {
+        *bucket = ctx->count;
+        ctx->distinct++;
+    }
+    ctx->count++;
+}
+
+// index of `symbol` in the context, or ctx->count when it is not defined
+size_t context_find(Context* ctx, uint32_t symbol) {
+    size_t i = *context_bucket(ctx, symbol);
+    return i != SIZE_MAX ? i : ctx->count;
+}
+
+// remove all the definitions
+void context_clear(Context* ctx) {
+    ctx->count = 0;
+    ctx->distinct = 0;
+    memset(ctx->buckets, 0xff, ctx->buckets_capacity * sizeof(size_t));
+}
+
+Function* context_get(Context* ctx, uint32_t symbol) {
+    size_t i = context_find(ctx, symbol);
+    return i < ctx->count ? ctx->functions[i] : NULL;
+}
+
+void free_context(Context* ctx) {
+    if (ctx == NULL) return;
+    free(ctx->symbols);
+    free(ctx->functions);
+    free(ctx->buckets);
+    free(ctx);
+}
+
+/*
+   2. Half Lexer
+   We have a python-like syntax.
+
+  ```hl
+   x = \x.x # comment here
+   y = \banana.x # return '\x.x' -> currying (https://en.wikipedia.org/wiki/Currying)
+  ```
+*/
+
+typedef enum {
+    TOKEN_INVALID,
+    TOKEN_NEWLINE,
+    TOKEN_LAMBDA, // defined by '\\'
+    TOKEN_DOT,
+    TOKEN_EQUAL,
+    TOKEN_NAME,
+    TOKEN_COLON, // to call a builtin
+    TOKEN_OPAREN, // (
+    TOKEN_CPAREN, // )
+    TOKEN_STRING, // "text", on a single line
+} Token_Type;
+
+// A token doesn't own anything, its text is a slice of the source.
+typedef struct {
+    uint8_t type;            // Token_Type
+    uint32_t symbol;         // TOKEN_NAME: the interned identifier
+    uint32_t offset, length; // in the source
+    uint32_t line, column;   // from 0
+} Token;
+
+#define LEXER_SOURCE_MAX UINT32_MAX // the offsets of the tokens are 32 bits
+
+typedef struct {
+    const char* source;
+    size_t pos;
+    size_t line, line_start; // line of `pos` and offset of its first character
+    NameTable* names; // interns the identifiers
+} Lexer;
+
+Lexer* new_lexer(const char* source) {
+    Lexer* l = malloc(sizeof(Lexer));
+    if (l == NULL) return NULL;
+
+    l->source = source;
+    l->pos = 0;
+    l->line = 0;
+    l->line_start = 0;
+    l->names = NULL;
+    return l;
+}
+
+static inline void free_lexer(Lexer* l) {
+    free(l);
+}
+
+static inline bool lexer_is_name(char c) {
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+struct LexerLexTuple{
+    Token* array;
+    size_t counter;
+};
+
+static inline void free_tokens(Token* tokens) {
+    free(tokens);
+}
+
+// The tokens of the whole source in one array, in a single pass. Only the
+// array grows, the identifiers are interned in `l->names`.
+static inline struct LexerLexTuple lexer_lex(Lexer* l) {
+    struct LexerLexTuple error = {NULL, 0};
+    size_t counter = 0;
+    size_t capacity = 256;
+
+    Token* array = (Token*)malloc(capacity * sizeof(Token));
+    if (array == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return error;
+    }
+
+    const char* source = l->source;
+    while (source[l->pos] != '\0') {
+        size_t start = l->pos;
+        char c = source[l->pos++];
+
+        // Skip whitespace
+        if (c == ' ' || c == '\t') {
+            continue;
+        }
+
+        // Skip comments, the newline ending them is still a token
+        if (c == '#') {
+            while (source[l->pos] != '\0' && source[l->pos] != '\n') l->pos++;
+            continue;
+        }
+
+        Token_Type type;
+        switch (c) {
+            case '\n':
+            case ';':  type = TOKEN_NEWLINE; break;
+            case '\\': type = TOKEN_LAMBDA; break;
+            case '.':  type = TOKEN_DOT; break;
+            case '=':  type = TOKEN_EQUAL; break;
+            case ':':  type = TOKEN_COLON; break;
+            case '(':  type = TOKEN_OPAREN; break;
+            case ')':  type = TOKEN_CPAREN; break;
+            case '"':
+                while (source[l->pos] != '\0' && source[l->pos] != '\n' && source[l->pos] != '"') l->pos++;
+                if (source[l->pos] == '"') {
+                    l->pos++;
+                    type = TOKEN_STRING;
+                } else {
+                    type = TOKEN_INVALID;
+                }
+                break;
+            default:
+                if (lexer_is_name(c)) {
+                    while (lexer_is_name(source[l->pos])) l->pos++;
+                    type = TOKEN_NAME;
+                } else {
+                    type = TOKEN_INVALID;
+                }
+                break;
+        }
+
+        if (l->pos > LEXER_SOURCE_MAX) {
+            fprintf(stderr, "Error: Script too large\n");
+            free_tokens(array);
+            return error;
+        }
+
+        if (counter >= capacity) {
+            capacity *= 2;
+            Token* temp = (Token*)realloc(array, capacity * sizeof(Token));
+            if (temp == NULL) {
+                fprintf(stderr, "Error: Memory reallocation failed\n");
+                free_tokens(array);
+                return error;
+            }
+            array = temp;
+        }
+
+        Token* token = &array[counter++];
+        token->type = (uint8_t)type;
+        token->symbol = type == TOKEN_NAME ? name_table_intern(l->names, source + start, l->pos - start) : FUNCTION_NO_SYMBOL;
+        token->offset = (uint32_t)start;
+        token->length = (uint32_t)(l->pos - start);
+        token->line = (uint32_t)l->line;
+        token->column = (uint32_t)(start - l->line_start);
+
+        if (c == '\n') {
+            l->line++;
+            l->line_start = l->pos;
+        }
+    }
+
+    struct LexerLexTuple tuple;
+    tuple.array = array;
+    tuple.counter = counter;
+
+    return tuple;
+}
+
+/*
+   3. Half Parser
+
+   Grammar:
+    program      ::= statement*
+    statement    ::= comment | definition | builtin_call | import
+    comment      ::= "#" [^\n]* "\n"
+    import       ::= "import" '"' path '"' # see "10. Half Images"
+    definition   ::= identifier "=" expression
+    builtin_call ::= ":" identifier expression*
+    expression   ::= atom+ # application, left associative
+    atom         ::= identifier | lambda | builtin_call | "(" expression ")"
+    lambda       ::= "\" identifier "." expression
+    identifier   ::= [a-zA-Z_][a-zA-Z0-9_]*
+
+   Variables are bound here: the parser keeps the parameters of the enclosing
+   lambdas in `scope` and turns every bound identifier into a De Bruijn index.
+*/
+
+// `import "path"`, the module goes before the statement number `statement`
+typedef struct {
+    size_t statement;
+    char* path;
+} ParserImport;
+
+typedef struct {
+    Token* array;
+    size_t array_size, pos, functions;
+    const char* source; // the text of the tokens
+
+    uint32_t* scope; // symbols of the parameters of the enclosing lambdas, innermost last
+    size_t scope_count, scope_capacity;
+    NameTable* names; // shared with the lexer
+    InternTable* interned; // hash-cons the functions when not NULL
+    FunctionPool* pool;    // allocates the functions, may be NULL
+
+    ParserImport* imports;
+    size_t imports_count, imports_capacity;
+    size_t errors; // reported so far
+} Parser;
+
+Parser* new_parser(Token* array, size_t array_size, const char* source) {
+    Parser* p = malloc(sizeof(Parser));
+    if (p == NULL) return NULL;
+
+    p->array = array;
+    p->array_size = array_size;
+    p->source = source;
+    p->pos = 0;
+    p->functions = 0;
+    p->names = NULL;
+    p->interned = NULL;
+    p->pool = NULL;
+    p->imports = NULL;
+    p->imports_count = 0;
+    p->imports_capacity = 0;
+    p->errors = 0;
+
+    p->scope_count = 0;
+    p->scope_capacity = 16;
+    p->scope = (uint32_t*)malloc(p->scope_capacity * sizeof(uint32_t));
+    if (p->scope == NULL) {
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+// the NameTable is not freed, it is handed over with the parsed program
+static inline void free_imports(ParserImport* imports, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(imports[i].path);
+    }
+    free(imports);
+}
+
+static inline void free_parser(Parser* p) {
+    if (p) {
+        free(p->scope);
+        free_imports(p->imports, p->imports_count);
+        free(p);
+    }
+}
+
+void parser_error(Parser* p, const char* msg) {
+    p->errors++;
+    if (p->array_size == 0) {
+        printf("Parser error: %s\n", msg);
+        return;
+    }
+    Token* token = &p->array[p->pos < p->array_size ? p->pos : p->array_size - 1];
+    printf("Parser error at line %zu, column %zu: %s\n", (size_t)token->line+1, (size_t)token->column+1, msg);
+}
+
+bool parser_end(Parser* p) {
+    if (p->pos >= p->array_size) return true;
+    return false;
+}
+
+bool parser_except(Parser* p, int type) {
+    if (parser_end(p)) return false;
+    if (p->array[p->pos].type == type) return true;
+    return false;
+}
+
+void parser_unexpected(Parser* p, Token* token) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "unexpected symbol '%.*s'", (int)token->length, p->source + token->offset);
+    parser_error(p, msg);
+}
+
+bool parser_except_error(Parser* p, int type) {
+    if (parser_except(p, type)) return true;
+    if (parser_end(p)) {
+        parser_error(p, "unexpected end of file");
+        return false;
+    }
+    parser_unexpected(p, &p->array[p->pos]);
+    return false;
+}
+
+// true when the current token can start an atom of an application
+static inline bool parser_atom_start(Parser* p) {
+    return parser_except(p, TOKEN_NAME) ||
+           parser_except(p, TOKEN_LAMBDA) ||
+           parser_except(p, TOKEN_OPAREN) ||
+           parser_except(p, TOKEN_COLON);
+}
+
+static inline bool parser_push_scope(Parser* p, uint32_t symbol) {
+    if (p->scope_count >= p->scope_capacity) {
+        uint32_t* temp = (uint32_t*)realloc(p->scope, p->scope_capacity * 2 * sizeof(uint32_t));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        p->scope = temp;
+        p->scope_capacity *= 2;
+    }
+    p->scope[p->scope_count++] = symbol;
+    return true;
+}
+
+// De Bruijn index of `symbol`, or a free name when no enclosing lambda binds it
+static inline Function* parser_bind(Parser* p, uint32_t symbol) {
+    for (size_t i = p->scope_count; i > 0; i--) {
+        if (p->scope[i - 1] == symbol) {
+            return new_variable(p->interned, p->pool, p->scope_count - i);
+        }
+    }
+    return intern_function(p->interned, p->pool, FUNCTION_NAME, 0, symbol, NULL, 0);
+}
+
+Function* expression(Parser* p); // forward declaration - check bellow for 'expression'
+
+Function* builtin_call(Parser* p) {
+    p->pos++;
+
+    if (!parser_except(p, TOKEN_NAME)) {
+        parser_error(p, "Expected builtin name after :");
+        return NULL;
+    }
+
+    uint32_t builtin_symbol = p->array[p->pos].symbol;
+    p->pos++;
+
+    if (!parser_atom_start(p)) {
+        return intern_function(p->interned, p->pool, FUNCTION_BUILTIN, 0, builtin_symbol, NULL, 0);
+    }
+
+    Function* arg = expression(p);
+    if (arg == NULL) return NULL;
+
+    Function* body_array[1] = {arg};
+    return intern_function(p->interned, p->pool, FUNCTION_BUILTIN, 0, builtin_symbol, body_array, 1);
+}
+
+/*
+   The expressions nest through lambdas, builtin arguments and parentheses.
+   Instead of recursing, the parser keeps a stack of the constructs waiting
+   for an expression, each one with the application being read.
+*/
+
+typedef enum {
+    PARSER_APPLY,   // the atoms of an expression, applied left to right
+    PARSER_LAMBDA,  // \name. waiting for its body
+    PARSER_BUILTIN, // :name waiting for its argument
+    PARSER_PAREN,   // ( waiting for its expression and )
+} Parser_Work_Kind;
+
+typedef struct {
+    Parser_Work_Kind kind;
+    Function* result; // PARSER_APPLY: the application read so far, or NULL
+    uint32_t symbol;  // parameter or builtin name
+} ParserWork;
+
+Function* expression(Parser* p) {
+    size_t scope_count = p->scope_count;
+    Function* result = NULL;
+    bool failed = false;
+
+    ParserWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(ParserWork), local, WORK_STACK_LOCAL);
+    ParserWork first = {PARSER_APPLY, NULL, FUNCTION_NO_SYMBOL};
+    work_stack_push(&stack, &first);
+
+    while (!failed) {
+        ParserWork* top = (ParserWork*)work_stack_top(&stack);
+        Function* atom = NULL;
+
+        if (top->result != NULL && !parser_atom_start(p)) {
+            // the expression ends, it completes the construct below it
+            Function* value = top->result;
+            stack.count--;
+            if (stack.count == 0) {
+                result = value;
+                break;
+            }
+
+            ParserWork* parent = (ParserWork*)work_stack_pop(&stack);
+            if (parent->kind == PARSER_LAMBDA) {
+                p->scope_count--;
+                atom = new_lambda(p->interned, p->pool, parent->symbol, value);
+
+                // canonical booleans and numerals become native values
+                Function* native = church_value(p->interned, p->pool, atom);
+                if (native != NULL) {
+                    free_function(atom);
+                    atom = native;
+                }
+            } else if (parent->kind == PARSER_BUILTIN) {
+                Function* body_array[1] = {value};
+                atom = intern_function(p->interned, p->pool, FUNCTION_BUILTIN, 0, parent->symbol, body_array, 1);
+            } else if (!parser_except(p, TOKEN_CPAREN)) {
+                parser_error(p, "Expected )");
+                free_function(value);
+                failed = true;
+                break;
+            } else {
+                p->pos++;
+                atom = value;
+            }
+        } else if (parser_end(p)) {
+            parser_error(p, "unexpected end of file");
+            failed = true;
+            break;
+        } else {
+            Token* current = &p->array[p->pos];
+            ParserWork inner = {PARSER_APPLY, NULL, FUNCTION_NO_SYMBOL};
+            ParserWork construct = {PARSER_PAREN, NULL, FUNCTION_NO_SYMBOL};
+
+            switch (current->type) {
+                case TOKEN_NAME:
+                    p->pos++;
+                    atom = parser_bind(p, current->symbol);
+                    break;
+
+                case TOKEN_LAMBDA:
+                    p->pos++;
+                    if (!parser_except(p, TOKEN_NAME)) {
+                        parser_error(p, "Expected parameter name after \\");
+                        failed = true;
+                        break;
+                    }
+                    construct.kind = PARSER_LAMBDA;
+                    construct.symbol = p->array[p->pos].symbol;
+                    p->pos++;
+
+                    if (!parser_except(p, TOKEN_DOT)) {
+                        parser_error(p, "Expected . after parameter name");
+                        failed = true;
+                        break;
+                    }
+                    p->pos++;
+                    failed = !parser_push_scope(p, construct.symbol);
+                    break;
+
+                case TOKEN_COLON:
+                    p->pos++;
+                    if (!parser_except(p, TOKEN_NAME)) {
+                        parser_error(p, "Expected builtin name after :");
+                        failed = true;
+                        break;
+                    }
+                    construct.kind = PARSER_BUILTIN;
+                    construct.symbol = p->array[p->pos].symbol;
+                    p->pos++;
+
+                    if (!parser_atom_start(p)) {
+                        atom = intern_function(p->interned, p->pool, FUNCTION_BUILTIN, 0, construct.symbol, NULL, 0);
+                    }
+                    break;
+
+                case TOKEN_OPAREN:
+                    p->pos++;
+                    break;
+
+                default: {
+                    parser_unexpected(p, current);
+                    failed = true;
+                    break;
+                }
+            }
+
+            if (!failed && atom == NULL && current->type != TOKEN_NAME) {
+                // a construct starts, its expression comes next
+                failed = !work_stack_push(&stack, &construct) || !work_stack_push(&stack, &inner);
+                continue;
+            }
+        }
+
+        if (atom == NULL) {
+            failed = true;
+            break;
+        }
+
+        top = (ParserWork*)work_stack_top(&stack);
+        top->result = top->result == NULL ? atom : new_apply(p->interned, p->pool, top->result, atom);
+        failed = top->result == NULL;
+    }
+
+    if (failed) {
+        while (stack.count > 0) {
+            ParserWork* work = (ParserWork*)work_stack_pop(&stack);
+            free_function(work->result);
+        }
+        p->scope_count = scope_count;
+        result = NULL;
+    }
+
+    free_work_stack(&stack);
+    return result;
+}
+
+// Record the module of the TOKEN_STRING `path`, it is loaded by the runtime.
+static inline void parser_import(Parser* p, Token* path) {
+    if (p->imports_count >= p->imports_capacity) {
+        size_t capacity = p->imports_capacity > 0 ? p->imports_capacity * 2 : 4;
+        ParserImport* temp = (ParserImport*)realloc(p->imports, capacity * sizeof(ParserImport));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return;
+        }
+        p->imports = temp;
+        p->imports_capacity = capacity;
+    }
+
+    // without the quotes
+    char* text = (char*)malloc(path->length - 1);
+    if (text == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+    memcpy(text, p->source + path->offset + 1, path->length - 2);
+    text[path->length - 2] = '\0';
+
+    p->imports[p->imports_count].statement = p->functions;
+    p->imports[p->imports_count].path = text;
+    p->imports_count++;
+}
+
+void statement(Parser* p, Function** program) {
+    if (parser_end(p)) return;
+
+    Token* current = &p->array[p->pos];
+
+    switch(current->type) {
+        case TOKEN_NAME: {
+            uint32_t symbol = current->symbol;
+
+            // 'import' is only a keyword before a string, it stays a name otherwise
+            if (current->length == 6 && strncmp(p->source + current->offset, "import", 6) == 0 &&
+                p->pos + 1 < p->array_size && p->array[p->pos + 1].type == TOKEN_STRING) {
+                parser_import(p, &p->array[p->pos + 1]);
+                p->pos += 2;
+
+                if (parser_except(p, TOKEN_NEWLINE)) {
+                    p->pos++;
+                }
+                break;
+            }
+            p->pos++;
+
+            if (!parser_except(p, TOKEN_EQUAL)) {
+                parser_error(p, "Expected = after variable name");
+                return;
+            }
+            p->pos++;
+
+            Function* expr_result = expression(p);
+
+            if (expr_result == NULL) {
+                parser_error(p, "Failed to parse expression");
+                return;
+            }
+
+            Function* body_array[1] = {expr_result};
+            Function* named_func = new_function(p->pool, FUNCTION_DEFINE, 0, symbol, body_array, 1);
+
+            if (named_func != NULL) {
+                program[p->functions] = named_func;
+                p->functions++;
+            }
+
+            if (parser_except(p, TOKEN_NEWLINE)) {
+                p->pos++;
+            }
+            break;
+        }
+
+        case TOKEN_COLON: {
+            Function* builtin_func = builtin_call(p);
+
+            if (builtin_func == NULL) {
+                parser_error(p, "Failed to parse expression");
+                return;
+            }
+
+            program[p->functions] = builtin_func;
+            p->functions++;
+
+            if (parser_except(p, TOKEN_NEWLINE)) {
+                p->pos++;
+            }
+            break;
+        }
+
+        case TOKEN_NEWLINE: {
+            p->pos++;
+            break;
+        }
+
+        default: {
+            parser_unexpected(p, current);
+            p->pos++;
+            break;
+        }
+    }
+}
+
+struct ParserParseTuple {
+    Function** program; // we will execute this element by element
+    size_t functions;
+    NameTable* names;   // the symbols of the program
+    InternTable* interned; // owner of the hash-consed functions, may be NULL
+    FunctionPool* pool;    // owner of the other functions, may be NULL
+    ParserImport* imports; // the modules to load in the program, see runtime_load_imports
+    size_t imports_count;
+    size_t errors; // the parser errors reported, the program lacks the statements in error
+};
+
+struct ParserParseTuple parser_parse(Parser* p) {
+    size_t capacity = 30;
+    Function** program = (Function**)malloc(capacity * sizeof(Function*));
+    if (program == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        struct ParserParseTuple error = {NULL, 0, NULL, NULL, NULL, NULL, 0, 0};
+        return error;
+    }
+
+    p->functions = 0; // safe reset
+
+    while(!parser_end(p)) {
+        if (p->functions >= capacity) {
+            capacity *= 2;
+            Function** temp = (Function**)realloc(program, capacity * sizeof(Function*));
+            if (temp == NULL) {
+                fprintf(stderr, "Error: Memory reallocation failed\n");
+                free(program);
+                struct ParserParseTuple error = {NULL, 0, NULL, NULL, NULL, NULL, 0, 0};
+                return error;
+            }
+            program = temp;
+        }
+
+        statement(p, program);
+    }
+
+    struct ParserParseTuple tuple;
+    tuple.program = program;
+    tuple.functions = p->functions;
+    tuple.names = p->names;
+    tuple.interned = p->interned;
+    tuple.pool = p->pool;
+    tuple.imports = p->imports;
+    tuple.imports_count = p->imports_count;
+    tuple.errors = p->errors;
+    p->imports = NULL;
+    p->imports_count = 0;
+    return tuple;
+}
+
+/*
+    4. Half Runtime
+
+    It takes the AST and interprate it within its context.
+    The Runtime run arbitrary code when it encouter a builtin function
+    (do not forget that a builtin function in Half is just a C function)
+
+    A Runtime holds all the state of its program, its input and its output:
+    runtimes can run at the same time in different threads. The only nodes
+    they share are the immortal ones (the native booleans, the terms of the
+    machine) and the program of a batch or of a parallel run (see "11. Half
+    Batch"), which are never written.
+*/
+
+struct Runtime;
+
+typedef enum {
+    RUNTIME_REWRITE, // rewrite the term in place (reduce_function)
+    RUNTIME_MACHINE, // environment machine, see "5. Half Machine"
+    RUNTIME_NET,     // interaction net, see "6. Half Net"
+    RUNTIME_VM,      // bytecode, see "7. Half VM"
+} Runtime_Engine;
+
+// How far the arguments of a builtin are evaluated before the call
+typedef enum {
+    BUILTIN_STRICT, // normal form
+    BUILTIN_HEAD,   // until the head is a lambda or a native value, the VM and net engines pass the normal form
+} Builtin_Strictness;
+
+// A builtin owns its `arity` arguments and returns an owned function, which
+// may be one of them. The first argument is the one written after its name
+// (NULL when there is none), the others are the ones it is applied to: the
+// linker turns `:name a b` into `(:name a) b` when `arity` is 2. `user` is
+// the pointer given to runtime_add_builtin.
+struct Builtin {
+    uint32_t symbol; // the name, in the NameTable of the Runtime
+    size_t arity;
+    Builtin_Strictness strictness;
+    Function* (*func)(struct Runtime* runtime, void* user, Function** args);
+    void* user;
+};
+
+// the arguments of a builtin call, the arity is small
+#define BUILTIN_ARGS_MAX 8
+
+#define OUTPUT_BUFFER_SIZE 65536
+
+// The bytes written by :show and :showbyte stay in `buffer` until it is full
+// or the runtime is flushed, then they go to the sink `write` at once.
+typedef struct {
+    unsigned char* buffer;
+    size_t count, capacity;
+    unsigned char byte; // the bits of the next byte, from the most significant
+    int bit_pos;        // the number of these bits
+    void (*write)(void* user, const unsigned char* data, size_t size); // NULL keeps the bytes in `buffer`
+    void* user;
+    int fd; // of runtime_output_fd
+} Output;
+
+#define INPUT_BUFFER_SIZE 65536
+
+// The bytes read by :read and :readbyte, `buffer` is refilled from the
+// source `read` when they are all read.
+typedef struct {
+    unsigned char* buffer;
+    size_t capacity;
+    const unsigned char* data; // the bytes not read yet are data[pos..count), `buffer` or the memory of runtime_input_memory
+    size_t count, pos;
+    int bit_pos; // the bits of data[pos] already read, from the most significant
+    size_t (*read)(void* user, unsigned char* data, size_t size); // the bytes read, 0 at the end. NULL for no more bytes
+    void* user;
+    int fd; // of runtime_input_fd
+} Input;
+
+typedef struct Runtime {
+    Context* context;
+    Function** program;
+    size_t functions;
+    struct Bytecode* bytecode; // the program compiled for RUNTIME_VM
+    NameTable* names;
+    InternTable* interned;
+    FunctionPool* pool; // the functions that aren't interned, may be NULL
+    struct Builtin** builtins; // by symbol, NULL for the other names
+    size_t builtins_count;
+    size_t* links; // Context index of the definition of each symbol, see runtime_link
+    uint8_t* link_states; // Link_State of each symbol
+    size_t links_count;
+    size_t linked_definitions; // the definitions linked so far
+    struct HlcImage* images; // the .hlc files holding functions of the program, see "10. Half Images"
+    ParserImport* imports; // the modules not loaded yet, see runtime_load_imports
+    size_t imports_count;
+    const char* script; // the imports are relative to its directory, NULL for the current one
+    uint64_t* modules; // hash of the text of the modules loaded, each one is loaded once
+    size_t modules_count, modules_capacity;
+    Output output; // of :show, stdout by default
+    Input input;   // of :read, stdin by default
+    size_t exec_i;
+    Runtime_Engine engine;
+    size_t threads; // of runtime_run, one per processor when 0, see "12. Half Parallel"
+} Runtime;
+
+void free_bytecode(struct Bytecode* b); // forward declaration - check "7. Half VM"
+void free_hlc_images(struct HlcImage* images); // forward declaration - check "10. Half Images"
+bool runtime_load_imports(Runtime* runtime); // forward declaration - check "10. Half Images"
+bool runtime_splice_imports(Runtime* runtime, const char* from, struct ParserParseTuple* parsed); // forward declaration - check "10. Half Images"
+
+// \x.\y.x is 1 and \x.\y.y is 0, anything else is -1
+int church_bool_value(Function* f) {
+    if (f != NULL && f->kind == FUNCTION_BOOLEAN) return (int)f->index;
+    if (f == NULL || f->kind != FUNCTION_LAMBDA) return -1;
+
+    Function* inner = f->body[0];
+    if (inner == NULL || inner->kind != FUNCTION_LAMBDA) return -1;
+
+    Function* result = inner->body[0];
+    if (result == NULL || result->kind != FUNCTION_VARIABLE) return -1;
+
+    if (result->index == 1) return 1;
+    if (result->index == 0) return 0;
+    return -1;
+}
+
+// the value of a Church numeral below 256 (native or not), -1 otherwise
+static inline int church_byte_value(Function* f) {
+    if (f == NULL) return -1;
+    size_t n = church_numeral_value(f);
+    if (n != SIZE_MAX) return n < 256 ? (int)n : -1;
+    if (f->kind != FUNCTION_LAMBDA || f->body[0] == NULL || f->body[0]->kind != FUNCTION_LAMBDA) return -1;
+
+    // \f.\x.f (f (... x))
+    Function* body = f->body[0]->body[0];
+    int count = 0;
+    while (body != NULL && body->kind == FUNCTION_APPLY && count < 256 &&
+           body->body[0]->kind == FUNCTION_VARIABLE && body->body[0]->index == 1) {
+        body = body->body[1];
+        count++;
+    }
+    return body != NULL && body->kind == FUNCTION_VARIABLE && body->index == 0 && count < 256 ? count : -1;
+}
+
+// Output
+
+static inline void output_write_file(void* user, const unsigned char* data, size_t size) {
+    fwrite(data, 1, size, (FILE*)user);
+}
+
+#ifdef HALF_POSIX
+static inline void output_write_fd(void* user, const unsigned char* data, size_t size) {
+    int fd = ((Output*)user)->fd;
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) return;
+        data += written;
+        size -= (size_t)written;
+    }
+}
+#endif
+
+// give the buffer to the sink
+static inline void output_flush(Output* o) {
+    if (o->write == NULL || o->count == 0) return;
+    o->write(o->user, o->buffer, o->count);
+    o->count = 0;
+}
+
+static inline void output_byte(Output* o, unsigned char byte) {
+    if (o->count >= o->capacity) {
+        if (o->write != NULL) {
+            output_flush(o);
+        } else {
+            // kept in memory
+            unsigned char* temp = (unsigned char*)realloc(o->buffer, o->capacity * 2);
+            if (temp == NULL) {
+                fprintf(stderr, "Error: Memory reallocation failed\n");
+                return;
+            }
+            o->buffer = temp;
+            o->capacity *= 2;
+        }
+    }
+    o->buffer[o->count++] = byte;
+}
+
+static inline void output_bit(Output* o, int bit) {
+    o->byte |= (unsigned char)(bit << (7 - o->bit_pos));
+    o->bit_pos++;
+    if (o->bit_pos == 8) {
+        output_byte(o, o->byte);
+        o->byte = 0;
+        o->bit_pos = 0;
+    }
+}
+
+// the 8 bits of `value`, whether the bits before make whole bytes or not
+static inline void output_bits8(Output* o, unsigned char value) {
+    if (o->bit_pos == 0) {
+        output_byte(o, value);
+        return;
+    }
+    unsigned char byte = (unsigned char)(o->byte | (value >> o->bit_pos));
+    o->byte = (unsigned char)(value << (8 - o->bit_pos));
+    output_byte(o, byte);
+}
+
+// Complete the last byte with 0 bits and give the output to the sink.
+void runtime_flush(Runtime* runtime) {
+    Output* o = &runtime->output;
+    if (o->bit_pos > 0) {
+        output_byte(o, o->byte);
+        o->byte = 0;
+        o->bit_pos = 0;
+    }
+    output_flush(o);
+}
+
+// The output goes to `file`, stdout by default.
+void runtime_output_file(Runtime* runtime, FILE* file) {
+    output_flush(&runtime->output);
+    runtime->output.write = output_write_file;
+    runtime->output.user = file;
+}
+
+#ifdef HALF_POSIX
+// The output goes to the file descriptor `fd`, without stdio.
+void runtime_output_fd(Runtime* runtime, int fd) {
+    output_flush(&runtime->output);
+    runtime->output.write = output_write_fd;
+    runtime->output.user = &runtime->output;
+    runtime->output.fd = fd;
+}
+#endif
+
+// The output is given to `write` with `user`, a buffer at a time.
+void runtime_output_callback(Runtime* runtime, void (*write)(void* user, const unsigned char* data, size_t size), void* user) {
+    output_flush(&runtime->output);
+    runtime->output.write = write;
+    runtime->output.user = user;
+}
+
+// The output stays in memory, see runtime_output_data.
+void runtime_output_memory(Runtime* runtime) {
+    output_flush(&runtime->output);
+    runtime->output.write = NULL;
+    runtime->output.user = NULL;
+}
+
+// the output kept by runtime_output_memory, valid until the next output
+const unsigned char* runtime_output_data(Runtime* runtime, size_t* size) {
+    *size = runtime->output.count;
+    return runtime->output.buffer;
+}
+
+// :show builtin
+
+Function* show_builtin(Runtime* runtime, void* user, Function** args) {
+    (void)user;
+    Function* f = args[0];
+    int b;
+    InternTable* t = runtime->interned;
+    if (f != NULL && t != NULL && (f == t->church_true || f == t->church_false)) {
+        b = f == t->church_true ? 1 : 0;
+    } else {
+        b = church_bool_value(f);
+    }
+    if (b >= 0) {
+        output_bit(&runtime->output, b);
+    }
+    return f;
+}
+
+// :showbyte builtin, the 8 bits of a numeral below 256 at once
+
+Function* showbyte_builtin(Runtime* runtime, void* user, Function** args) {
+    (void)user;
+    Function* f = args[0];
+    int value = church_byte_value(f);
+    if (value >= 0) {
+        output_bits8(&runtime->output, (unsigned char)value);
+    }
+    return f;
+}
+
+// :ast builtin
+
+Function* ast_builtin(Runtime* runtime, void* user, Function** args) {
+    (void)user;
+    Function* f = args[0];
+    char* str = function_to_string(f, runtime->names);
+    if (str != NULL) {
+        fprintf(stderr, "%s\n", str);
+        free(str);
+    }
+    return f;
+}
+
+// Register the builtin `:name`, replacing the one it may have. Its calls are
+// bound when the program is linked, see runtime_link.
+bool runtime_add_builtin(Runtime* runtime, const char* name, size_t arity, Builtin_Strictness strictness,
+                         Function* (*func)(Runtime*, void*, Function**), void* user) {
+    if (arity == 0 || arity > BUILTIN_ARGS_MAX) {
+        fprintf(stderr, "Error: Builtin arity must be between 1 and %d\n", BUILTIN_ARGS_MAX);
+        return false;
+    }
+
+    uint32_t symbol = name_table_add(runtime->names, name);
+    if (symbol == FUNCTION_NO_SYMBOL) return false;
+
+    if (symbol >= runtime->builtins_count) {
+        size_t count = runtime->builtins_count * 2 > symbol ? runtime->builtins_count * 2 : (size_t)symbol + 16;
+        struct Builtin** temp = (struct Builtin**)realloc(runtime->builtins, count * sizeof(struct Builtin*));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        memset(temp + runtime->builtins_count, 0, (count - runtime->builtins_count) * sizeof(struct Builtin*));
+        runtime->builtins = temp;
+        runtime->builtins_count = count;
+    }
+
+    struct Builtin* bltn = runtime->builtins[symbol];
+    if (bltn == NULL) bltn = (struct Builtin*)malloc(sizeof(struct Builtin));
+    if (bltn == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+
+    bltn->symbol = symbol;
+    bltn->arity = arity;
+    bltn->strictness = strictness;
+    bltn->func = func;
+    bltn->user = user;
+    runtime->builtins[symbol] = bltn;
+    return true;
+}
+
+// Input
+
+static inline size_t input_read_file(void* user, unsigned char* data, size_t size) {
+    return fread(data, 1, size, (FILE*)user);
+}
+
+#ifdef HALF_POSIX
+// the bytes available, a filter doesn't wait for a whole buffer
+static inline size_t input_read_fd(void* user, unsigned char* data, size_t size) {
+    ssize_t count = read(((Input*)user)->fd, data, size);
+    return count > 0 ? (size_t)count : 0;
+}
+#endif
+
+// false at the end of the input
+static inline bool input_fill(Input* in) {
+    if (in->pos < in->count) return true;
+    if (in->read == NULL) return false;
+    in->count = in->read(in->user, in->buffer, in->capacity);
+    in->data = in->buffer;
+    in->pos = 0;
+    in->bit_pos = 0;
+    if (in->count == 0) {
+        in->read = NULL;
+        return false;
+    }
+    return true;
+}
+
+// the next bit, -1 at the end of the input
+static inline int input_bit(Input* in) {
+    if (!input_fill(in)) return -1;
+    int bit = (in->data[in->pos] >> (7 - in->bit_pos)) & 1;
+    in->bit_pos++;
+    if (in->bit_pos == 8) {
+        in->bit_pos = 0;
+        in->pos++;
+    }
+    return bit;
+}
+
+// the next 8 bits, -1 when the input ends before
+static inline int input_byte(Input* in) {
+    if (in->bit_pos == 0) {
+        if (!input_fill(in)) return -1;
+        return in->data[in->pos++];
+    }
+    int value = 0;
+    for (int i = 0; i < 8; i++) {
+        int bit = input_bit(in);
+        if (bit < 0) return -1;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+static inline void input_source(Input* in, size_t (*read)(void*, unsigned char*, size_t), void* user) {
+    in->data = in->buffer;
+    in->count = 0;
+    in->pos = 0;
+    in->bit_pos = 0;
+    in->read = read;
+    in->user = user;
+}
+
+// The input is read from `file`, stdin by default on the platforms without
+// file descriptors.
+void runtime_input_file(Runtime* runtime, FILE* file) {
+    input_source(&runtime->input, input_read_file, file);
+}
+
+#ifdef HALF_POSIX
+// The input is read from the file descriptor `fd` (0 by default), without
+// stdio.
+void runtime_input_fd(Runtime* runtime, int fd) {
+    input_source(&runtime->input, input_read_fd, &runtime->input);
+    runtime->input.fd = fd;
+}
+#endif
+
+// The input is given by `read` with `user`: it fills up to `size` bytes of
+// `data` and returns their number, 0 at the end.
+void runtime_input_callback(Runtime* runtime, size_t (*read)(void* user, unsigned char* data, size_t size), void* user) {
+    input_source(&runtime->input, read, user);
+}
+
+// The input is the `size` bytes of `data`, not copied: they are read while
+// the runtime runs.
+void runtime_input_memory(Runtime* runtime, const void* data, size_t size) {
+    input_source(&runtime->input, NULL, NULL);
+    runtime->input.data = (const unsigned char*)data;
+    runtime->input.count = size;
+}
+
+// :read builtin
+
+// the native booleans are shared, reading a bit allocates nothing
+Function* make_church_true(Runtime* runtime) {
+    (void)runtime;
+    return &church_booleans[1];
+}
+
+Function* make_church_false(Runtime* runtime) {
+    (void)runtime;
+    return &church_booleans[0];
+}
+
+Function* read_builtin(Runtime* runtime, void* user, Function** args) {
+    (void)user;
+    Function* f = args[0];
+    int bit = input_bit(&runtime->input);
+    if (bit < 0) {
+        return f;
+    }
+    free_function(f);
+    return bit ? make_church_true(runtime) : make_church_false(runtime);
+}
+
+// :readbyte builtin, the numeral of the next 8 bits
+
+Function* readbyte_builtin(Runtime* runtime, void* user, Function** args) {
+    (void)user;
+    Function* f = args[0];
+    int value = input_byte(&runtime->input);
+    if (value < 0) {
+        return f;
+    }
+    Function* numeral = new_numeral(runtime->interned, runtime->pool, (size_t)value);
+    if (numeral == NULL) return f;
+    free_function(f);
+    return numeral;
+}
+
+Runtime* new_runtime(struct ParserParseTuple parsed) {
+    Runtime* rtm = (Runtime*)malloc(sizeof(Runtime));
+    if (rtm == NULL) return NULL;
+
+    rtm->builtins = NULL;
+    rtm->builtins_count = 0;
+    rtm->context = new_context();
+    rtm->program = parsed.program;
+    rtm->functions = parsed.functions;
+    rtm->names = parsed.names != NULL ? parsed.names : new_name_table();
+    rtm->interned = parsed.interned;
+    rtm->pool = parsed.pool;
+    rtm->bytecode = NULL;
+    rtm->links = NULL;
+    rtm->link_states = NULL;
+    rtm->links_count = 0;
+    rtm->linked_definitions = 0;
+    rtm->images = NULL;
+    rtm->imports = parsed.imports;
+    rtm->imports_count = parsed.imports_count;
+    rtm->script = NULL;
+    rtm->modules = NULL;
+    rtm->modules_count = 0;
+    rtm->modules_capacity = 0;
+    rtm->exec_i = 0;
+    rtm->engine = RUNTIME_MACHINE;
+    rtm->threads = 1;
+
+    rtm->output.buffer = (unsigned char*)malloc(OUTPUT_BUFFER_SIZE);
+    rtm->output.count = 0;
+    rtm->output.capacity = OUTPUT_BUFFER_SIZE;
+    rtm->output.byte = 0;
+    rtm->output.bit_pos = 0;
+    rtm->output.write = output_write_file;
+    rtm->output.user = stdout;
+    rtm->output.fd = -1;
+
+    rtm->input.buffer = (unsigned char*)malloc(INPUT_BUFFER_SIZE);
+    rtm->input.capacity = INPUT_BUFFER_SIZE;
+#ifdef HALF_POSIX
+    input_source(&rtm->input, input_read_fd, &rtm->input);
+    rtm->input.fd = 0;
+#else
+    input_source(&rtm->input, input_read_file, stdin);
+    rtm->input.fd = -1;
+#endif
+
+    if (rtm->context == NULL || rtm->names == NULL || rtm->output.buffer == NULL || rtm->input.buffer == NULL) {
+        free(rtm->output.buffer);
+        free(rtm->input.buffer);
+        free_context(rtm->context);
+        free_name_table(rtm->names);
+        free(rtm->builtins);
+        free(rtm);
+        return NULL;
+    }
+
+    runtime_add_builtin(rtm, "show", 1, BUILTIN_STRICT, show_builtin, NULL);
+    runtime_add_builtin(rtm, "showbyte", 1, BUILTIN_STRICT, showbyte_builtin, NULL);
+    runtime_add_builtin(rtm, "read", 1, BUILTIN_STRICT, read_builtin, NULL);
+    runtime_add_builtin(rtm, "readbyte", 1, BUILTIN_STRICT, readbyte_builtin, NULL);
+    runtime_add_builtin(rtm, "ast", 1, BUILTIN_STRICT, ast_builtin, NULL);
+
+    return rtm;
+}
+
+void free_runtime(Runtime* rtm) {
+    if (rtm == NULL) return;
+
+    if (rtm->program != NULL) {
+        // the functions of the pool are released all at once below
+        for (size_t i = 0; rtm->pool == NULL && i < rtm->functions; i++) {
+            free_function(rtm->program[i]);
+        }
+        free(rtm->program);
+    }
+
+    if (rtm->context != NULL) {
+        free_context(rtm->context);
+    }
+
+    free_bytecode(rtm->bytecode);
+    free(rtm->links);
+    free(rtm->link_states);
+    free_name_table(rtm->names);
+    free_intern_table(rtm->interned);
+    free_function_pool(rtm->pool);
+    free_hlc_images(rtm->images);
+    free_imports(rtm->imports, rtm->imports_count);
+    free(rtm->modules);
+    output_flush(&rtm->output);
+    free(rtm->output.buffer);
+    free(rtm->input.buffer);
+
+    for (size_t i = 0; i < rtm->builtins_count; i++) {
+        free(rtm->builtins[i]);
+    }
+    free(rtm->builtins);
+
+    free(rtm);
+}
+
+static inline struct Builtin* runtime_find_builtin(Runtime* runtime, uint32_t symbol) {
+    return symbol < runtime->builtins_count ? runtime->builtins[symbol] : NULL;
+}
+
+// Context index of the definition of `symbol`, or the Context count when it
+// isn't defined (yet). The linked symbols skip the lookup.
+static inline size_t runtime_definition(Runtime* runtime, uint32_t symbol) {
+    Context* ctx = runtime->context;
+    if (symbol < runtime->links_count && runtime->links[symbol] != SIZE_MAX) {
+        return runtime->links[symbol] < ctx->count ? runtime->links[symbol] : ctx->count;
+    }
+    return context_find(ctx, symbol);
+}
+
+Function* reduce_function(Function *root, Runtime* runtime, size_t depth); // forward declaration
+
+static inline Function* reduce_head(Function *root, Runtime* runtime, size_t depth, size_t* fuel); // forward declaration
+
+// Call `builtin` with the `args` we own, evaluated as it asks.
+Function* eval_builtin(Runtime* runtime, struct Builtin* builtin, Function** args) {
+    for (size_t i = 0; i < builtin->arity; i++) {
+        if (args[i] == NULL) continue;
+        args[i] = builtin->strictness == BUILTIN_HEAD ? reduce_head(args[i], runtime, 0, NULL)
+                                                      : reduce_function(args[i], runtime, 0);
+    }
+
+    // the reduction modifies the functions in place, they can't be shared
+    Function* result = builtin->func(runtime, builtin->user, args);
+    return (result != NULL && result->interned && !function_is_native(result)) ? copy_function(runtime->pool, result) : result;
+}
+
+static inline void reduce_burn(size_t* fuel, size_t amount) {
+    *fuel = amount < *fuel ? *fuel - amount : 0;
+}
+
+// Reduce `root` until its head is a lambda, a variable or a stuck builtin.
+// Builtins only run outside of any lambda (`depth` 0): under a lambda their
+// argument may still refer to a parameter. When `fuel` isn't NULL, each
+// reduction burns the size of the term it builds and the reduction stops
+// when the fuel runs out.
+static inline Function* reduce_head(Function *root, Runtime* runtime, size_t depth, size_t* fuel) {
+    // slots of the applications of the spine, the innermost one on top
+    Function** local[WORK_STACK_LOCAL];
+    WorkStack spine;
+    work_stack_init(&spine, sizeof(Function**), local, WORK_STACK_LOCAL);
+
+    Function** slot = &root;
+    while (*slot != NULL && (fuel == NULL || *fuel > 0)) {
+        Function* head = *slot;
+        if (head->kind == FUNCTION_APPLY) {
+            if (!work_stack_push(&spine, &slot)) break;
+            slot = &head->body[0];
+        } else if (head->kind == FUNCTION_NAME) {
+            size_t k = runtime_definition(runtime, head->symbol);
+            Function* resolved = k < runtime->context->count ? runtime->context->functions[k] : NULL;
+            if (resolved == NULL) break;
+            free_function(head);
+            *slot = copy_function(runtime->pool, resolved);
+        } else if (head->kind == FUNCTION_BUILTIN) {
+            struct Builtin* builtin = runtime_find_builtin(runtime, head->symbol);
+            if (depth > 0 || builtin == NULL || spine.count + 1 < builtin->arity) break;
+
+            // the first argument is written after the name, the others are
+            // the arguments of the applications
+            Function* args[BUILTIN_ARGS_MAX];
+            args[0] = head->body_count > 0 ? head->body[0] : NULL;
+            head->body_count = 0;
+            free_function(head);
+            for (size_t i = 1; i < builtin->arity; i++) {
+                slot = *(Function***)work_stack_pop(&spine);
+                Function* apply = *slot;
+                args[i] = apply->body[1];
+                apply->body_count = 0;
+                free_function(apply);
+            }
+            *slot = eval_builtin(runtime, builtin, args);
+        } else if (head->kind == FUNCTION_LAMBDA && spine.count > 0) {
+            // beta reduction: (\x.body arg) -> body[x := arg]
+            slot = *(Function***)work_stack_pop(&spine);
+            Function* apply = *slot;
+            Function* arg = apply->body[1];
+            Function* body = substitute(runtime->pool, head->body[0], 0, arg);
+            head->body_count = 0;
+            free_function(head);
+            apply->body_count = 0;
+            free_function(apply);
+            *slot = body;
+            if (fuel != NULL) reduce_burn(fuel, function_size(body));
+        } else if (function_is_native(head) && spine.count > 0) {
+            if (fuel != NULL) reduce_burn(fuel, 1);
+            Function** inner = *(Function***)work_stack_top(&spine);
+            Function* apply = *inner;
+            size_t m = church_numeral_value(apply->body[1]), power;
+
+            if (head->kind == FUNCTION_BOOLEAN && spine.count > 1) {
+                // ((b x) y) -> x or y
+                work_stack_pop(&spine);
+                Function** outer = *(Function***)work_stack_pop(&spine);
+                Function* second = *outer;
+                Function* keep = head->index ? apply->body[1] : second->body[1];
+                free_function(head->index ? second->body[1] : apply->body[1]);
+                free_function(head);
+                apply->body_count = 0;
+                free_function(apply);
+                second->body_count = 0;
+                free_function(second);
+                *outer = keep;
+                slot = outer;
+            } else if (head->kind == FUNCTION_NUMERAL && m != SIZE_MAX && church_power(m, head->index, &power)) {
+                // (n m) -> m^n
+                work_stack_pop(&spine);
+                Function* value = new_numeral(NULL, runtime->pool, power);
+                if (value == NULL) break;
+                free_function(apply);
+                *inner = value;
+                slot = inner;
+            } else {
+                // applied to something else, the lambda term is needed
+                if (fuel != NULL && head->kind == FUNCTION_NUMERAL) reduce_burn(fuel, head->index);
+                if (fuel != NULL && *fuel == 0) break;
+                Function* term = church_expand(NULL, runtime->pool, head);
+                if (term == NULL) break;
+                free_function(head);
+                *slot = term;
+            }
+        } else {
+            break;
+        }
+    }
+
+    free_work_stack(&spine);
+    return root;
+}
+
+// normal order reduction to normal form, see reduce_head for `fuel`
+static inline Function* reduce_function_fuel(Function *root, Runtime* runtime, size_t depth, size_t* fuel) {
+    typedef struct {
+        Function** slot;
+        size_t depth;
+    } ReduceWork;
+
+    ReduceWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(ReduceWork), local, WORK_STACK_LOCAL);
+    ReduceWork first = {&root, depth};
+    work_stack_push(&stack, &first);
+
+    // the function is reduced before its argument, like :show expects
+    while (stack.count > 0 && (fuel == NULL || *fuel > 0)) {
+        ReduceWork work = *(ReduceWork*)work_stack_pop(&stack);
+        Function* f = reduce_head(*work.slot, runtime, work.depth, fuel);
+        *work.slot = f;
+        if (f == NULL) continue;
+
+        size_t inner = f->kind == FUNCTION_LAMBDA ? work.depth + 1 : work.depth;
+        bool ok = true;
+        for (size_t i = f->body_count; ok && i > 0; i--) {
+            ReduceWork child = {&f->body[i - 1], inner};
+            ok = work_stack_push(&stack, &child);
+        }
+    }
+
+    free_work_stack(&stack);
+    return root;
+}
+
+// normal order reduction to normal form
+Function* reduce_function(Function *root, Runtime* runtime, size_t depth) {
+    return reduce_function_fuel(root, runtime, depth, NULL);
+}
+
+/*
+   Linking runs once before the program: the definitions are added to the
+   Context in program order, so the Context index of each symbol's first
+   definition is known before anything runs. `runtime->links` keeps it by
+   symbol and the engines read it instead of searching the Context. A
+   streamed program (see runtime_run_stream) is linked a statement at a
+   time instead.
+
+   The names a statement uses without any definition before it and the
+   unknown builtins are reported here. They are left as they are, the
+   engines keep them in the normal forms.
+
+   The calls of the builtins taking more than one argument are split:
+   with 3 arguments `:name a b c` becomes `((:name a) b) c`, the builtin
+   takes the arguments of the applications. Only the last applications are
+   split, `:name (f x) y` passes `f x` and `y`.
+*/
+
+// `:name (a b)` with the `arity - 1` last applications under the builtin
+// split, which we own. The nodes are replaced when they are interned.
+static inline Function* runtime_link_call(Runtime* runtime, Function* call, size_t arity) {
+    Function* spine[BUILTIN_ARGS_MAX];
+    size_t count = 0;
+    for (Function* f = call->body[0]; f->kind == FUNCTION_APPLY && count + 1 < arity; f = f->body[0]) {
+        spine[count++] = f;
+    }
+    if (count == 0) return call;
+    Function* first = spine[count - 1]->body[0];
+
+    bool interned = call->interned;
+    for (size_t i = 0; i < count; i++) interned = interned || spine[i]->interned;
+
+    if (!interned) {
+        // the innermost application takes the call as function
+        call->body[0] = first;
+        spine[count - 1]->body[0] = call;
+        return spine[0];
+    }
+
+    Function* body_array[1] = {first};
+    Function* result = intern_function(runtime->interned, runtime->pool, FUNCTION_BUILTIN, 0, call->symbol, body_array, 1);
+    for (size_t i = count; result != NULL && i > 0; i--) {
+        result = new_apply(runtime->interned, runtime->pool, result, spine[i - 1]->body[1]);
+    }
+    return result != NULL ? result : call;
+}
+
+// what the link phase said about a symbol
+typedef enum {
+    LINK_SILENT,
+    LINK_PENDING,  // used by a definition, a later one may still define it
+    LINK_REPORTED, // reported once, never again
+} Link_State;
+
+// Grow the link tables up to the symbols of the NameTable.
+static inline bool runtime_link_grow(Runtime* runtime) {
+    size_t count = runtime->names->count;
+    if (runtime->links != NULL && count <= runtime->links_count) return true;
+
+    size_t old = runtime->links != NULL ? runtime->links_count + 1 : 0;
+    size_t* links = (size_t*)realloc(runtime->links, (count + 1) * sizeof(size_t));
+    if (links == NULL) return false;
+    runtime->links = links;
+    uint8_t* states = (uint8_t*)realloc(runtime->link_states, (count + 1) * sizeof(uint8_t));
+    if (states == NULL) return false;
+    runtime->link_states = states;
+
+    memset(links + old, 0xff, (count + 1 - old) * sizeof(size_t));
+    memset(states + old, LINK_SILENT, count + 1 - old);
+    runtime->links_count = count;
+    return true;
+}
+
+// Link the statements from `first` on, the ones added since the last call.
+// When `complete` no statement comes after them: a name a definition uses
+// is reported at once when nothing defines it, otherwise it waits for
+// runtime_link_end.
+bool runtime_link_from(Runtime* runtime, size_t first, bool complete) {
+    if (!runtime_link_grow(runtime)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+    size_t count = runtime->links_count;
+    size_t* links = runtime->links;
+    uint8_t* states = runtime->link_states;
+
+    size_t definitions = runtime->linked_definitions;
+    for (size_t i = first; i < runtime->functions; i++) {
+        Function* f = runtime->program[i];
+        if (f->kind == FUNCTION_DEFINE && f->symbol < count && links[f->symbol] == SIZE_MAX) {
+            links[f->symbol] = definitions;
+        }
+        if (f->kind == FUNCTION_DEFINE) definitions++;
+    }
+
+    // Each term is rebuilt from its leaves, a node whose children change is
+    // updated (or replaced when it is interned). A definition may use the
+    // ones after it, a statement only the ones before.
+    typedef struct {
+        Function* f;
+        bool built; // its children are on `values`
+    } LinkWork;
+
+    LinkWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(LinkWork), local, WORK_STACK_LOCAL);
+    Function* local_values[WORK_STACK_LOCAL];
+    WorkStack values;
+    work_stack_init(&values, sizeof(Function*), local_values, WORK_STACK_LOCAL);
+    bool ok = true;
+    definitions = runtime->linked_definitions;
+
+    for (size_t i = first; ok && i < runtime->functions; i++) {
+        Function* f = runtime->program[i];
+        bool define = f->kind == FUNCTION_DEFINE;
+        LinkWork root = {define ? f->body[0] : f, false};
+        ok = work_stack_push(&stack, &root);
+
+        while (ok && stack.count > 0) {
+            LinkWork work = *(LinkWork*)work_stack_pop(&stack);
+            Function* node = work.f;
+
+            if (!work.built && node->body_count > 0) {
+                LinkWork built = {node, true};
+                ok = work_stack_push(&stack, &built);
+                for (size_t k = node->body_count; ok && k > 0; k--) {
+                    LinkWork child = {node->body[k - 1], false};
+                    ok = work_stack_push(&stack, &child);
+                }
+                continue;
+            }
+
+            if (node->kind == FUNCTION_NAME && node->symbol < count && states[node->symbol] != LINK_REPORTED &&
+                (links[node->symbol] == SIZE_MAX || (!define && links[node->symbol] >= definitions))) {
+                if (define && !complete) {
+                    states[node->symbol] = LINK_PENDING;
+                } else {
+                    fprintf(stderr, "Error: Unbound name '%s'\n", function_symbol_name(runtime->names, node->symbol));
+                    states[node->symbol] = LINK_REPORTED;
+                }
+            }
+
+            if (work.built) {
+                Function* children[2];
+                bool changed = false;
+                for (size_t k = node->body_count; k > 0; k--) {
+                    children[k - 1] = *(Function**)work_stack_pop(&values);
+                    changed = changed || children[k - 1] != node->body[k - 1];
+                }
+                if (changed && node->interned) {
+                    node = intern_function(runtime->interned, runtime->pool, node->kind, node->index, node->symbol, children, node->body_count);
+                    ok = node != NULL;
+                } else {
+                    for (size_t k = 0; k < node->body_count; k++) node->body[k] = children[k];
+                }
+            }
+
+            if (ok && node->kind == FUNCTION_BUILTIN) {
+                struct Builtin* builtin = runtime_find_builtin(runtime, node->symbol);
+                if (builtin == NULL && node->symbol < count && states[node->symbol] != LINK_REPORTED) {
+                    fprintf(stderr, "Error: Unknown builtin ':%s'\n", function_symbol_name(runtime->names, node->symbol));
+                    states[node->symbol] = LINK_REPORTED;
+                }
+                if (builtin != NULL && builtin->arity > 1 && node->body_count > 0 && node->body[0]->kind == FUNCTION_APPLY) {
+                    node = runtime_link_call(runtime, node, builtin->arity);
+                }
+            }
+            ok = ok && work_stack_push(&values, &node);
+        }
+
+        if (ok) {
+            Function* linked = *(Function**)work_stack_pop(&values);
+            if (define) {
+                f->body[0] = linked;
+            } else {
+                runtime->program[i] = linked;
+            }
+        }
+        values.count = 0;
+        if (define) definitions++;
+    }
+    free_work_stack(&stack);
+    free_work_stack(&values);
+
+    runtime->linked_definitions = definitions;
+    return ok;
+}
+
+// Report the names used by definitions that nothing defined, once the last
+// statement is linked.
+void runtime_link_end(Runtime* runtime) {
+    for (size_t i = 0; runtime->link_states != NULL && i <= runtime->links_count; i++) {
+        if (runtime->link_states[i] == LINK_PENDING && runtime->links[i] == SIZE_MAX) {
+            fprintf(stderr, "Error: Unbound name '%s'\n", function_symbol_name(runtime->names, (uint32_t)i));
+            runtime->link_states[i] = LINK_REPORTED;
+        }
+    }
+}
+
+// Link the whole program, from scratch.
+bool runtime_link(Runtime* runtime) {
+    free(runtime->links);
+    free(runtime->link_states);
+    runtime->links = NULL;
+    runtime->link_states = NULL;
+    runtime->links_count = 0;
+    runtime->linked_definitions = 0;
+
+    bool ok = runtime_link_from(runtime, 0, true);
+    if (!ok) {
+        // the engines search the Context instead
+        free(runtime->links);
+        runtime->links = NULL;
+        runtime->links_count = 0;
+    }
+    return ok;
+}
+
+void machine_run(Runtime* runtime, Function* f); // forward declaration - check "5. Half Machine"
+void net_run(Runtime* runtime, Function* f); // forward declaration - check "6. Half Net"
+struct Bytecode* new_bytecode(Function** program, size_t functions); // forward declaration - check "7. Half VM"
+void vm_run_program(Runtime* runtime); // forward declaration - check "7. Half VM"
+void vm_run_statement(Runtime* runtime, Function* f); // forward declaration - check "7. Half VM"
+bool runtime_run_parallel(Runtime* runtime); // forward declaration - check "12. Half Parallel"
+
+// Run the statement `f` with the engines working on the terms, a definition
+// is added to the Context.
+static inline void runtime_run_statement(Runtime* runtime, Function* f) {
+    if (f->kind == FUNCTION_DEFINE) {
+        context_add(runtime->context, f->symbol, f->body[0]);
+    } else if (runtime->engine == RUNTIME_MACHINE) {
+        machine_run(runtime, f);
+    } else if (runtime->engine == RUNTIME_NET) {
+        net_run(runtime, f);
+    } else {
+        // the program is kept intact, reduction happens on a copy
+        free_function(reduce_function(copy_function(runtime->pool, f), runtime, 0));
+    }
+}
+
+// Run the program of `runtime`, its statements in order. With
+// runtime->threads other than 1, the statements whose only effect is their
+// output are reduced on worker threads (see "12. Half Parallel"): the
+// definitions and the statements reading the input or calling another
+// builtin always run on the calling thread, a script made mostly of them
+// gains nothing.
+void runtime_run(Runtime* runtime) {
+    if (runtime->imports != NULL) runtime_load_imports(runtime);
+    if (runtime->links == NULL && runtime->program != NULL) runtime_link(runtime);
+
+    if (runtime->threads != 1 && runtime_run_parallel(runtime)) {
+        runtime_flush(runtime);
+        return;
+    }
+
+    if (runtime->engine == RUNTIME_VM) {
+        if (runtime->bytecode == NULL) {
+            runtime->bytecode = new_bytecode(runtime->program, runtime->functions);
+            if (runtime->bytecode == NULL) {
+                fprintf(stderr, "Error: Bytecode compilation failed\n");
+                return;
+            }
+        }
+        vm_run_program(runtime);
+        runtime_flush(runtime);
+        return;
+    }
+
+    for (size_t i = 0; i < runtime->functions; i++) {
+        runtime->exec_i = i;
+        runtime_run_statement(runtime, runtime->program[i]);
+    }
+    runtime_flush(runtime);
+}
+
+const char* get_filename_ext(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if(!dot || dot == filename) return "";
+    return dot + 1;
+}
+
+// the arguments separated by spaces, NULL when there is none
+char* join_arguments(int count, char* args[]) {
+    if (count <= 0) return NULL;
+
+    size_t total_len = 0;
+    for (int i = 0; i < count; i++) {
+        total_len += strlen(args[i]) + 1; // space or '\0'
+    }
+
+    char* combined = malloc(total_len);
+    if (combined == NULL) return NULL;
+
+    size_t length = 0;
+    for (int i = 0; i < count; i++) {
+        size_t arg = strlen(args[i]);
+        memcpy(combined + length, args[i], arg);
+        length += arg;
+        combined[length++] = i < count - 1 ? ' ' : '\0';
+    }
+    return combined;
+}
+
+// the script at `path`, NULL when it can't be opened
+FILE* open_script(const char* path) {
+    if (strcmp(get_filename_ext(path), "half") != 0 && strcmp(get_filename_ext(path), "hl") != 0) {
+        fprintf(stderr, "Invalid file extension. Expected '.half' or '.hl'\n");
+        exit(1);
+    }
+
+    FILE* fptr = fopen(path, "r");
+    if (fptr == NULL) {
+        fprintf(stderr, "The file is not opened.\n");
+    }
+    return fptr;
+}
+
+const char* read_script(const char* path) {
+    FILE* fptr = open_script(path);
+    if (fptr == NULL) return NULL;
+
+    fseek(fptr, 0, SEEK_END);
+    long fsize = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+    char *string = malloc(fsize + 1);
+    fread(string, fsize, 1, fptr);
+    fclose(fptr);
+    string[fsize] = 0;
+
+    return string;
+}
+
+// Lex and parse `source` with the symbols of `names`, its first line is
+// numbered `line` in the errors.
+struct ParserParseTuple lex_parse(const char* source, NameTable* names, InternTable* interned, FunctionPool* pool, size_t line) {
+    struct ParserParseTuple error = {NULL, 0, names, interned, pool, NULL, 0, 0};
+    Lexer* l = new_lexer(source);
+    if (l == NULL) return error;
+    l->names = names;
+    l->line = line;
+    struct LexerLexTuple lout = lexer_lex(l);
+    free_lexer(l);
+
+    Parser* p = new_parser(lout.array, lout.counter, source);
+    if (p == NULL) {
+        free_tokens(lout.array);
+        return error;
+    }
+    p->names = names;
+    p->interned = interned;
+    p->pool = pool;
+    struct ParserParseTuple pout = parser_parse(p);
+    free_parser(p);
+    // the names of the tokens live on in the NameTable
+    free_tokens(lout.array);
+    return pout;
+}
+
+// `interned` enables hash-consing, the table is handed over with the program
+struct ParserParseTuple lex_parse_script(const char* source, InternTable* interned, FunctionPool* pool) {
+    return lex_parse(source, new_name_table(), interned, pool, 0);
+}
+
+/*
+   A script can also be streamed: runtime_run_stream reads it from a file a
+   line at a time, then parses, links and runs the statements of each line
+   as soon as it is complete. The statements that aren't definitions are
+   dropped once they have run, the script takes the memory of its longest
+   line and of its definitions whatever its size. The optimizer and
+   --emit-c need the whole program, they don't apply.
+
+   A name a definition uses is reported as unbound at the end of the script,
+   a later line may still define it.
+*/
+
+bool runtime_run_stream(Runtime* runtime, FILE* file) {
+    size_t capacity = 4096;
+    char* buffer = (char*)malloc(capacity);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+
+    bool ok = true;
+    size_t program_capacity = runtime->functions;
+    for (size_t line = 0; ok; line++) {
+        // the whole line, however long it is
+        size_t count = 0;
+        while (count == 0 || buffer[count - 1] != '\n') {
+            if (capacity - count < 2) {
+                char* temp = (char*)realloc(buffer, capacity * 2);
+                if (temp == NULL) {
+                    fprintf(stderr, "Error: Memory reallocation failed\n");
+                    ok = false;
+                    break;
+                }
+                buffer = temp;
+                capacity *= 2;
+            }
+            size_t room = capacity - count < INT_MAX ? capacity - count : INT_MAX;
+            if (fgets(buffer + count, (int)room, file) == NULL) break;
+            count += strlen(buffer + count);
+        }
+        if (!ok || count == 0) break;
+
+        struct ParserParseTuple parsed = lex_parse(buffer, runtime->names, runtime->interned, runtime->pool, line);
+        if (parsed.program == NULL) {
+            free_imports(parsed.imports, parsed.imports_count);
+            ok = false;
+            break;
+        }
+        // the modules the line imports run with it
+        if (parsed.imports != NULL) {
+            runtime_splice_imports(runtime, runtime->script, &parsed);
+        }
+
+        size_t first = runtime->functions;
+        if (first + parsed.functions > program_capacity) {
+            size_t grown = program_capacity * 2 > first + parsed.functions ? program_capacity * 2 : first + parsed.functions + 16;
+            Function** temp = (Function**)realloc(runtime->program, grown * sizeof(Function*));
+            if (temp == NULL) {
+                fprintf(stderr, "Error: Memory reallocation failed\n");
+                for (size_t i = 0; i < parsed.functions; i++) free_function(parsed.program[i]);
+                free(parsed.program);
+                ok = false;
+                break;
+            }
+            runtime->program = temp;
+            program_capacity = grown;
+        }
+        if (parsed.functions > 0) memcpy(runtime->program + first, parsed.program, parsed.functions * sizeof(Function*));
+        runtime->functions += parsed.functions;
+        free(parsed.program);
+
+        runtime_link_from(runtime, first, false);
+
+        // only the definitions stay
+        size_t kept = first;
+        for (size_t i = first; i < runtime->functions; i++) {
+            Function* f = runtime->program[i];
+            runtime->exec_i = i;
+            if (runtime->engine == RUNTIME_VM) {
+                vm_run_statement(runtime, f);
+            } else {
+                runtime_run_statement(runtime, f);
+            }
+
+            if (f->kind == FUNCTION_DEFINE) {
+                runtime->program[kept++] = f;
+            } else {
+                free_function(f);
+            }
+        }
+        runtime->functions = kept;
+        // the output of a line isn't kept for the lines after it
+        output_flush(&runtime->output);
+    }
+
+    runtime_link_end(runtime);
+    runtime_flush(runtime);
+    free(buffer);
+    return ok;
+}
+
+/*
+    5. Half Machine
+
+    A Krivine machine: instead of rewriting the term, the machine walks the
+    program with an environment holding the value of every bound variable.
+    A beta step moves the argument from the stack to the environment, which
+    costs O(1) whatever the size of the body.
+
+    Arguments are not evaluated, they are pushed on the stack as closures (a
+    term with the environment it was found in). A normal form is only built
+    back from the closures when a builtin or the caller needs one.
+
+    Evaluation is call-by-need: a closure is a thunk. The first time it is
+    forced an update frame is pushed, and once its weak head normal form is
+    reached the closure is overwritten with it, every other use of the same
+    argument (or of the same definition) then reads the cached lambda.
+
+    Closures and environments are reclaimed by a copying collector (see
+    machine_collect), so a long statement runs in the memory it can reach.
+*/
+
+typedef struct Env Env;
+
+// A term with the environment of its free variables. A closure without term
+// is a variable of the read back, bound `level` lambdas deep.
+typedef struct {
+    Function* term;
+    Env* env;
+    size_t level;
+} Closure;
+
+struct Env {
+    Closure* value;
+    Env* next;
+};
+
+#define MACHINE_BLOCK_SIZE 65536
+
+// closures and environments are allocated by blocks and freed with the machine
+typedef struct MachineBlock {
+    struct MachineBlock* next;
+    size_t used, size;
+} MachineBlock;
+
+static inline void* machine_block_alloc(MachineBlock** blocks, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    MachineBlock* block = *blocks;
+    if (block == NULL || block->used + size > block->size) {
+        size_t block_size = size > MACHINE_BLOCK_SIZE ? size : MACHINE_BLOCK_SIZE;
+        block = (MachineBlock*)malloc(sizeof(MachineBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return NULL;
+        }
+        block->next = *blocks;
+        block->used = 0;
+        block->size = block_size;
+        *blocks = block;
+    }
+
+    void* ptr = (unsigned char*)(block + 1) + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static inline void free_machine_blocks(MachineBlock* blocks) {
+    while (blocks != NULL) {
+        MachineBlock* next = blocks->next;
+        free(blocks);
+        blocks = next;
+    }
+}
+
+// An argument waiting for a lambda, or a thunk to update with the weak head
+// normal form of the term being evaluated
+typedef struct {
+    Closure* closure;
+    bool update;
+} Frame;
+
+/*
+   The read back is iterative too (see WorkStack): the pending steps are kept
+   on a work stack and the functions already read on a stack of values.
+*/
+
+typedef enum {
+    READ_TERM,    // read back a term
+    READ_LAMBDA,  // wrap the value on top in a lambda
+    READ_BUILTIN, // wrap the value on top in a builtin call
+    READ_ARGS,    // apply the value on top to the arguments left on the stack
+    READ_APPLY,   // apply the value below the top to the top
+    READ_FAN,     // net: restore the fans stack after reading a copy
+} Read_Kind;
+
+typedef struct {
+    Read_Kind kind;
+    Function* term; // also the lambda or the builtin being read
+    Env* env;
+    size_t depth;
+    size_t base, next; // READ_ARGS: the arguments not read yet
+} MachineRead;
+
+// the work stacks of the read backs in progress, the innermost first
+typedef struct MachineReads {
+    WorkStack* stack;
+    struct MachineReads* next;
+} MachineReads;
+
+#define MACHINE_COLLECT_MIN (64 * MACHINE_BLOCK_SIZE) // bytes
+
+typedef struct {
+    Runtime* runtime;
+    MachineBlock* blocks;
+
+    Frame* stack; // the next argument on top
+    size_t stack_count, stack_capacity;
+
+    Closure** globals; // thunks of the definitions, by Context index
+    size_t globals_count;
+
+    Function** owned; // functions returned by the builtins
+    size_t owned_count, owned_capacity;
+
+    MachineReads* reads;
+    InternTable* numerals; // the numerals computed by the machine
+    size_t allocated, collect_at; // bytes in the blocks, see machine_collect
+} Machine;
+
+Machine* new_machine(Runtime* runtime) {
+    Machine* m = (Machine*)malloc(sizeof(Machine));
+    if (m == NULL) return NULL;
+
+    m->runtime = runtime;
+    m->blocks = NULL;
+    m->stack_count = 0;
+    m->stack_capacity = 64;
+    m->stack = (Frame*)malloc(m->stack_capacity * sizeof(Frame));
+    m->owned_count = 0;
+    m->owned_capacity = 8;
+    m->owned = (Function**)malloc(m->owned_capacity * sizeof(Function*));
+    m->globals_count = runtime->context->count;
+    m->globals = (Closure**)calloc(m->globals_count + 1, sizeof(Closure*));
+    m->reads = NULL;
+    m->numerals = NULL;
+    m->allocated = 0;
+    m->collect_at = MACHINE_COLLECT_MIN;
+
+    if (m->stack == NULL || m->owned == NULL || m->globals == NULL) {
+        free(m->stack);
+        free(m->owned);
+        free(m->globals);
+        free(m);
+        return NULL;
+    }
+    return m;
+}
+
+void free_machine(Machine* m) {
+    if (m == NULL) return;
+
+    free_machine_blocks(m->blocks);
+    for (size_t i = 0; i < m->owned_count; i++) {
+        free_function(m->owned[i]);
+    }
+    free(m->owned);
+    free(m->stack);
+    free(m->globals);
+    free_intern_table(m->numerals);
+    free(m);
+}
+
+static inline void* machine_alloc(Machine* m, size_t size) {
+    m->allocated += size;
+    return machine_block_alloc(&m->blocks, size);
+}
+
+static inline Closure* machine_new_closure(Machine* m, Function* term, Env* env, size_t level) {
+    Closure* c = (Closure*)machine_alloc(m, sizeof(Closure));
+    if (c == NULL) return NULL;
+
+    c->term = term;
+    c->env = env;
+    c->level = level;
+    return c;
+}
+
+static inline Env* machine_new_env(Machine* m, Closure* value, Env* next) {
+    Env* e = (Env*)machine_alloc(m, sizeof(Env));
+    if (e == NULL) return NULL;
+
+    e->value = value;
+    e->next = next;
+    return e;
+}
+
+static inline bool machine_push(Machine* m, Closure* c, bool update) {
+    if (c == NULL) return false;
+
+    if (m->stack_count >= m->stack_capacity) {
+        Frame* temp = (Frame*)realloc(m->stack, m->stack_capacity * 2 * sizeof(Frame));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        m->stack = temp;
+        m->stack_capacity *= 2;
+    }
+
+    m->stack[m->stack_count].closure = c;
+    m->stack[m->stack_count].update = update;
+    m->stack_count++;
+    return true;
+}
+
+// Force the thunk `c`: its term is evaluated under an update frame, unless it
+// is already a lambda or a variable of the read back.
+static inline bool machine_force(Machine* m, Closure* c, Function** term, Env** env) {
+    bool value = c->term->kind == FUNCTION_LAMBDA || function_is_native(c->term);
+    if (!value && !machine_push(m, c, true)) return false;
+    *term = c->term;
+    *env = c->env;
+    return true;
+}
+
+// Remove the update frames above `base`, when the evaluation is stuck the
+// thunks keep their term and will be evaluated again by their next use.
+static inline void machine_drop_updates(Machine* m, size_t base) {
+    size_t count = base;
+    for (size_t i = base; i < m->stack_count; i++) {
+        if (!m->stack[i].update) m->stack[count++] = m->stack[i];
+    }
+    m->stack_count = count;
+}
+
+static inline bool machine_own(Machine* m, Function* f) {
+    if (m->owned_count >= m->owned_capacity) {
+        Function** temp = (Function**)realloc(m->owned, m->owned_capacity * 2 * sizeof(Function*));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            free_function(f);
+            return false;
+        }
+        m->owned = temp;
+        m->owned_capacity *= 2;
+    }
+
+    m->owned[m->owned_count++] = f;
+    m->allocated += function_size(f) * sizeof(Function);
+    return true;
+}
+
+/*
+   The collector copies the closures and environments the machine can still
+   reach to new blocks and frees the old ones, once the blocks hold twice
+   what was reached by the previous collection. The roots are the stack,
+   the definitions, the environment being run and the read backs in
+   progress. A moved closure has machine_moved as term and its copy as
+   environment, a moved environment has machine_moved_env as value and its
+   copy as next.
+
+   The builtin results are freed the same way when no closure, read back or
+   running term points into them anymore.
+*/
+
+static Function machine_moved = {.kind = FUNCTION_VARIABLE, .interned = true};
+static Closure machine_moved_env;
+
+typedef struct {
+    void* copy;
+    bool env; // an Env, otherwise a Closure
+} MachineMove;
+
+typedef struct {
+    Function* node;
+    size_t owner; // index in Machine.owned
+} MachineOwnedNode;
+
+typedef struct {
+    Machine* m;
+    WorkStack scan; // the copies pointing to the old blocks
+    MachineOwnedNode* nodes; // the nodes of the builtin results, by address
+    size_t nodes_count;
+    bool* live; // by index in Machine.owned
+    bool ok;
+} MachineCollector;
+
+static int machine_compare_nodes(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)((const MachineOwnedNode*)a)->node;
+    uintptr_t y = (uintptr_t)((const MachineOwnedNode*)b)->node;
+    return x < y ? -1 : x > y;
+}
+
+// the builtin result `term` points into is still used
+static inline void machine_keep_term(MachineCollector* c, Function* term) {
+    if (term == NULL || term->interned || c->nodes_count == 0) return;
+
+    MachineOwnedNode key = {term, 0};
+    MachineOwnedNode* found = (MachineOwnedNode*)bsearch(&key, c->nodes, c->nodes_count, sizeof(MachineOwnedNode), machine_compare_nodes);
+    if (found != NULL) c->live[found->owner] = true;
+}
+
+static inline Closure* machine_move_closure(MachineCollector* c, Closure* closure) {
+    if (closure == NULL) return NULL;
+    if (closure->term == &machine_moved) return (Closure*)closure->env;
+
+    Closure* copy = (Closure*)machine_alloc(c->m, sizeof(Closure));
+    MachineMove move = {copy, false};
+    if (copy == NULL || !work_stack_push(&c->scan, &move)) {
+        c->ok = false;
+        return closure;
+    }
+    *copy = *closure;
+    machine_keep_term(c, copy->term);
+    closure->term = &machine_moved;
+    closure->env = (Env*)copy;
+    return copy;
+}
+
+static inline Env* machine_move_env(MachineCollector* c, Env* env) {
+    if (env == NULL) return NULL;
+    if (env->value == &machine_moved_env) return env->next;
+
+    Env* copy = (Env*)machine_alloc(c->m, sizeof(Env));
+    MachineMove move = {copy, true};
+    if (copy == NULL || !work_stack_push(&c->scan, &move)) {
+        c->ok = false;
+        return env;
+    }
+    *copy = *env;
+    env->value = &machine_moved_env;
+    env->next = copy;
+    return copy;
+}
+
+// sort the nodes of the builtin results for machine_keep_term
+static inline bool machine_owned_nodes(MachineCollector* c) {
+    Machine* m = c->m;
+    size_t total = 0;
+    for (size_t i = 0; i < m->owned_count; i++) {
+        total += function_size(m->owned[i]);
+    }
+    c->nodes = (MachineOwnedNode*)malloc((total + 1) * sizeof(MachineOwnedNode));
+    c->live = (bool*)calloc(m->owned_count + 1, sizeof(bool));
+    if (c->nodes == NULL || c->live == NULL) return false;
+
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+    bool ok = true;
+    for (size_t i = 0; ok && i < m->owned_count; i++) {
+        ok = work_stack_push(&stack, &m->owned[i]);
+        while (ok && stack.count > 0) {
+            Function* f = *(Function**)work_stack_pop(&stack);
+            if (f->interned) continue;
+            MachineOwnedNode node = {f, i};
+            c->nodes[c->nodes_count++] = node;
+            for (size_t j = 0; ok && j < f->body_count; j++) {
+                if (f->body[j] != NULL) ok = work_stack_push(&stack, &f->body[j]);
+            }
+        }
+    }
+    free_work_stack(&stack);
+    qsort(c->nodes, c->nodes_count, sizeof(MachineOwnedNode), machine_compare_nodes);
+    return ok;
+}
+
+// Collect the blocks and the builtin results, `env` and `term` are what
+// machine_whnf is running.
+static inline bool machine_collect(Machine* m, Env** env, Function* term) {
+    MachineCollector c = {m, {0}, NULL, 0, NULL, true};
+    MachineMove local[WORK_STACK_LOCAL];
+    work_stack_init(&c.scan, sizeof(MachineMove), local, WORK_STACK_LOCAL);
+    if (!machine_owned_nodes(&c)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free(c.nodes);
+        free(c.live);
+        return false;
+    }
+
+    MachineBlock* from = m->blocks;
+    m->blocks = NULL;
+    m->allocated = 0;
+
+    *env = machine_move_env(&c, *env);
+    machine_keep_term(&c, term);
+    for (size_t i = 0; i < m->stack_count; i++) {
+        m->stack[i].closure = machine_move_closure(&c, m->stack[i].closure);
+    }
+    for (size_t i = 0; i < m->globals_count; i++) {
+        m->globals[i] = machine_move_closure(&c, m->globals[i]);
+    }
+    for (MachineReads* r = m->reads; r != NULL; r = r->next) {
+        for (size_t i = 0; i < r->stack->count; i++) {
+            MachineRead* read = (MachineRead*)(r->stack->items + i * r->stack->size);
+            read->env = machine_move_env(&c, read->env);
+            machine_keep_term(&c, read->term);
+        }
+    }
+
+    while (c.ok && c.scan.count > 0) {
+        MachineMove move = *(MachineMove*)work_stack_pop(&c.scan);
+        if (move.env) {
+            Env* e = (Env*)move.copy;
+            e->value = machine_move_closure(&c, e->value);
+            e->next = machine_move_env(&c, e->next);
+        } else {
+            Closure* closure = (Closure*)move.copy;
+            closure->env = machine_move_env(&c, closure->env);
+        }
+    }
+    free_work_stack(&c.scan);
+
+    if (!c.ok) {
+        // the old blocks are still pointed to, they are freed with the machine
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        MachineBlock** last = &m->blocks;
+        while (*last != NULL) last = &(*last)->next;
+        *last = from;
+        free(c.nodes);
+        free(c.live);
+        return false;
+    }
+    free_machine_blocks(from);
+
+    size_t count = 0;
+    for (size_t i = 0; i < m->owned_count; i++) {
+        if (c.live[i]) {
+            m->owned[count++] = m->owned[i];
+            m->allocated += function_size(m->owned[i]) * sizeof(Function);
+        } else {
+            free_function(m->owned[i]);
+        }
+    }
+    m->owned_count = count;
+    free(c.nodes);
+    free(c.live);
+
+    m->collect_at = 2 * m->allocated > MACHINE_COLLECT_MIN ? 2 * m->allocated : MACHINE_COLLECT_MIN;
+    return true;
+}
+
+Function* machine_normalize(Machine* m, Function* term, Env* env, size_t depth); // forward declaration
+
+/*
+   The native values (see church_value) run without their lambda term. The
+   application of a numeral is unrolled with these immortal terms, `f rest`
+   for each step and `n f x` for the steps left.
+*/
+
+static Function machine_vars[3] = {
+    {.kind = FUNCTION_VARIABLE, .index = 0, .interned = true},
+    {.kind = FUNCTION_VARIABLE, .index = 1, .interned = true},
+    {.kind = FUNCTION_VARIABLE, .index = 2, .interned = true},
+};
+static Function machine_step = {.kind = FUNCTION_APPLY, .interned = true, .body_count = 2, .body = {&machine_vars[1], &machine_vars[0]}}; // f rest
+static Function machine_numeral_f = {.kind = FUNCTION_APPLY, .interned = true, .body_count = 2, .body = {&machine_vars[2], &machine_vars[1]}};
+static Function machine_rest = {.kind = FUNCTION_APPLY, .interned = true, .body_count = 2, .body = {&machine_numeral_f, &machine_vars[0]}}; // n f x
+static Function machine_partial = {.kind = FUNCTION_LAMBDA, .index = FUNCTION_NO_NAME, .interned = true, .body_count = 1, .body = {&machine_rest}}; // \x.n f x
+static Function machine_k = {.kind = FUNCTION_LAMBDA, .index = FUNCTION_NO_NAME, .interned = true, .body_count = 1, .body = {&machine_vars[1]}}; // \y.x
+static Function machine_i = {.kind = FUNCTION_LAMBDA, .index = FUNCTION_NO_NAME, .interned = true, .body_count = 1, .body = {&machine_vars[0]}}; // \y.y
+
+#define MACHINE_UNROLL 64 // steps of a numeral unrolled at once
+
+// numerals made by the machine are shared by a table freed with it, see
+// machine_normalize
+static inline Function* machine_new_numeral(Machine* m, size_t n) {
+    if (m->numerals == NULL) m->numerals = new_intern_table();
+    if (m->numerals == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NULL;
+    }
+    return new_numeral(m->numerals, NULL, n);
+}
+
+// the native numeral already computed by `c`, or SIZE_MAX (nothing is forced)
+static inline size_t machine_numeral_value(Machine* m, Closure* c) {
+    Function* term = c->term;
+    Env* env = c->env;
+    while (term != NULL) {
+        if (term->kind == FUNCTION_VARIABLE) {
+            Env* e = env;
+            for (size_t i = 0; i < term->index && e != NULL; i++) {
+                e = e->next;
+            }
+            if (e == NULL) return SIZE_MAX;
+            term = e->value->term;
+            env = e->value->env;
+        } else if (term->kind == FUNCTION_NAME) {
+            size_t i = runtime_definition(m->runtime, term->symbol);
+            if (i >= m->globals_count) return SIZE_MAX;
+            Closure* global = m->globals[i];
+            term = global != NULL ? global->term : m->runtime->context->functions[i];
+            env = global != NULL ? global->env : NULL;
+        } else {
+            return church_numeral_value(term);
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Apply the native value `term` to the arguments above `base`: a boolean
+// selects one of its two arguments, a numeral applied to a numeral is the
+// native power and otherwise `f` is applied to the rest of the iteration.
+static inline bool machine_apply_native(Machine* m, Function** term, Env** env, size_t base) {
+    Function* native = *term;
+    Closure* first = m->stack[--m->stack_count].closure;
+    bool second = m->stack_count > base && !m->stack[m->stack_count - 1].update;
+
+    if (native->kind == FUNCTION_BOOLEAN) {
+        if (!second) {
+            *term = native->index ? &machine_k : &machine_i;
+            *env = native->index ? machine_new_env(m, first, NULL) : NULL;
+            return !native->index || *env != NULL;
+        }
+        Closure* other = m->stack[--m->stack_count].closure;
+        *term = &machine_vars[0];
+        *env = machine_new_env(m, native->index ? first : other, NULL);
+        return *env != NULL;
+    }
+
+    size_t n = native->index, power_base = machine_numeral_value(m, first), power;
+    if (power_base != SIZE_MAX && church_power(power_base, n, &power)) {
+        *term = machine_new_numeral(m, power);
+        *env = NULL;
+        return *term != NULL;
+    }
+
+    if (!second) {
+        Closure* self = machine_new_closure(m, native, NULL, 0);
+        Env* self_env = self != NULL ? machine_new_env(m, self, NULL) : NULL;
+        *term = &machine_partial;
+        *env = self_env != NULL ? machine_new_env(m, first, self_env) : NULL;
+        return *env != NULL;
+    }
+
+    Env* fenv = machine_new_env(m, first, NULL);
+    if (fenv == NULL) return false;
+
+    // f (f ... (rest f x)): the first steps are unrolled now, the numeral
+    // for the rest is only made when they are all used
+    Closure* value = m->stack[--m->stack_count].closure;
+    size_t steps = n < MACHINE_UNROLL ? n : MACHINE_UNROLL;
+    if (n > steps) {
+        Function* count = machine_new_numeral(m, n - steps);
+        Closure* rest = count != NULL ? machine_new_closure(m, count, NULL, 0) : NULL;
+        Env* rest_env = rest != NULL ? machine_new_env(m, rest, NULL) : NULL;
+        rest_env = rest_env != NULL ? machine_new_env(m, first, rest_env) : NULL;
+        rest_env = rest_env != NULL ? machine_new_env(m, value, rest_env) : NULL;
+        value = rest_env != NULL ? machine_new_closure(m, &machine_rest, rest_env, 0) : NULL;
+    }
+    for (size_t i = 1; value != NULL && i < steps; i++) {
+        Env* step_env = machine_new_env(m, value, fenv);
+        value = step_env != NULL ? machine_new_closure(m, &machine_step, step_env, 0) : NULL;
+    }
+
+    *term = &machine_step;
+    *env = value != NULL ? machine_new_env(m, value, fenv) : NULL;
+    return *env != NULL;
+}
+
+// Run the machine until the head of `term` is a lambda without argument or
+// cannot be reduced anymore. The head is returned as a closure and its
+// arguments are left on the stack above `base`. Like reduce_function, the
+// builtins only run outside of any lambda of the read back (`depth` 0).
+Closure* machine_whnf(Machine* m, Function* term, Env* env, size_t base, size_t depth); // forward declaration
+
+// The argument of a builtin pushed in the frame `frame`, evaluated as
+// `strictness` asks. A closed weak head normal form is passed as it is.
+static inline Function* machine_builtin_arg(Machine* m, size_t frame, Builtin_Strictness strictness) {
+    InternTable* t = m->runtime->interned;
+    FunctionPool* pool = m->runtime->pool;
+    if (strictness == BUILTIN_HEAD) {
+        size_t base = m->stack_count;
+        Closure* head = machine_whnf(m, m->stack[frame].closure->term, m->stack[frame].closure->env, base, 0);
+        if (head == NULL) return NULL;
+        if (m->stack_count == base && head->term != NULL && (head->env == NULL || function_is_native(head->term))) {
+            if (head->term->kind == FUNCTION_NUMERAL) return new_numeral(t, pool, head->term->index);
+            return head->term->interned ? head->term : copy_function(pool, head->term);
+        }
+        m->stack_count = base;
+    }
+    Closure* c = m->stack[frame].closure;
+    return machine_normalize(m, c->term, c->env, 0);
+}
+
+// Pop the arguments of `builtin` called by `term` in `env`, the first one
+// written in `term` and the others on top of the stack. They stay on the
+// stack while they are evaluated: the collector may move them.
+static inline bool machine_builtin_args(Machine* m, struct Builtin* builtin, Function* term, Env* env, Function** args) {
+    size_t first = m->stack_count - (builtin->arity - 1);
+    Closure* written = term->body_count > 0 ? machine_new_closure(m, term->body[0], env, 0) : NULL;
+    if (term->body_count > 0 && !machine_push(m, written, false)) return false;
+
+    bool ok = true;
+    size_t count = 0;
+    for (size_t i = 0; ok && i < builtin->arity; i++) {
+        if (i == 0 && term->body_count == 0) {
+            args[count++] = NULL;
+            continue;
+        }
+        // the written argument is on top, the others below it in order
+        size_t frame = i == 0 ? m->stack_count - 1 : first + (builtin->arity - 1 - i);
+        args[count] = machine_builtin_arg(m, frame, builtin->strictness);
+        ok = args[count++] != NULL;
+    }
+
+    m->stack_count = first;
+    if (!ok) {
+        for (size_t i = 0; i + 1 < count; i++) free_function(args[i]);
+    }
+    return ok;
+}
+
+Closure* machine_whnf(Machine* m, Function* term, Env* env, size_t base, size_t depth) {
+    for (;;) {
+        if (m->allocated >= m->collect_at && !machine_collect(m, &env, term)) return NULL;
+
+        switch (term->kind) {
+            case FUNCTION_APPLY: {
+                // a variable argument is passed as the closure it is bound
+                // to, so the argument does not keep the whole env alive (but
+                // the variables of the read back keep their own closure)
+                Function* arg = term->body[1];
+                Env* e = env;
+                for (size_t i = 0; arg->kind == FUNCTION_VARIABLE && i < arg->index && e != NULL; i++) {
+                    e = e->next;
+                }
+                bool bound = arg->kind == FUNCTION_VARIABLE && e != NULL && e->value->term != NULL;
+                Closure* c = bound ? e->value : machine_new_closure(m, arg, env, 0);
+                if (!machine_push(m, c, false)) return NULL;
+                term = term->body[0];
+                break;
+            }
+
+            case FUNCTION_LAMBDA: {
+                while (m->stack_count > base && m->stack[m->stack_count - 1].update) {
+                    Closure* thunk = m->stack[--m->stack_count].closure;
+                    thunk->term = term;
+                    thunk->env = env;
+                }
+                if (m->stack_count == base) return machine_new_closure(m, term, env, 0);
+
+                Env* bound = machine_new_env(m, m->stack[--m->stack_count].closure, env);
+                if (bound == NULL) return NULL;
+                env = bound;
+                term = term->body[0];
+                break;
+            }
+
+            case FUNCTION_VARIABLE: {
+                Env* e = env;
+                for (size_t i = 0; i < term->index && e != NULL; i++) {
+                    e = e->next;
+                }
+                if (e == NULL) {
+                    fprintf(stderr, "Error: Unbound variable in machine\n");
+                    return NULL;
+                }
+
+                Closure* c = e->value;
+                if (c->term == NULL) {
+                    machine_drop_updates(m, base);
+                    return c;
+                }
+                if (!machine_force(m, c, &term, &env)) return NULL;
+                break;
+            }
+
+            case FUNCTION_NAME: {
+                size_t i = runtime_definition(m->runtime, term->symbol);
+                if (i >= m->globals_count) {
+                    machine_drop_updates(m, base);
+                    return machine_new_closure(m, term, env, 0);
+                }
+
+                if (m->globals[i] == NULL) {
+                    m->globals[i] = machine_new_closure(m, m->runtime->context->functions[i], NULL, 0);
+                    if (m->globals[i] == NULL) return NULL;
+                }
+                if (!machine_force(m, m->globals[i], &term, &env)) return NULL;
+                break;
+            }
+
+            case FUNCTION_BOOLEAN:
+            case FUNCTION_NUMERAL:
+                while (m->stack_count > base && m->stack[m->stack_count - 1].update) {
+                    Closure* thunk = m->stack[--m->stack_count].closure;
+                    thunk->term = term;
+                    thunk->env = NULL;
+                }
+                if (m->stack_count == base) return machine_new_closure(m, term, NULL, 0);
+                if (!machine_apply_native(m, &term, &env, base)) return NULL;
+                break;
+
+            case FUNCTION_BUILTIN: {
+                struct Builtin* builtin = runtime_find_builtin(m->runtime, term->symbol);
+                size_t first = m->stack_count, count = 1;
+                for (; builtin != NULL && first > base && count < builtin->arity; first--) {
+                    if (!m->stack[first - 1].update) count++;
+                }
+                if (depth > 0 || builtin == NULL || count < builtin->arity) {
+                    machine_drop_updates(m, base);
+                    return machine_new_closure(m, term, env, 0);
+                }
+
+                // the thunks between the arguments aren't updated, their
+                // value is a partial call
+                machine_drop_updates(m, first);
+                Function* args[BUILTIN_ARGS_MAX];
+                if (!machine_builtin_args(m, builtin, term, env, args)) return NULL;
+
+                Function* result = builtin->func(m->runtime, builtin->user, args);
+                if (result == NULL || (!result->interned && !machine_own(m, result))) return NULL;
+                term = result;
+                env = NULL;
+                break;
+            }
+
+            default:
+                fprintf(stderr, "Error: Unexpected function in machine\n");
+                return NULL;
+        }
+    }
+}
+
+// combine the values for READ_LAMBDA, READ_BUILTIN and READ_APPLY
+static inline bool read_combine(InternTable* t, FunctionPool* pool, WorkStack* values, Read_Kind kind, size_t slot, uint32_t symbol) {
+    Function* top = *(Function**)work_stack_pop(values);
+    Function* result;
+    if (kind == READ_LAMBDA) {
+        result = new_lambda(t, pool, slot, top);
+    } else if (kind == READ_BUILTIN) {
+        Function* body_array[1] = {top};
+        result = intern_function(t, pool, FUNCTION_BUILTIN, 0, symbol, body_array, 1);
+    } else {
+        Function* fn = *(Function**)work_stack_pop(values);
+        result = new_apply(t, pool, fn, top);
+    }
+    return result != NULL && work_stack_push(values, &result);
+}
+
+static inline void read_free_values(WorkStack* values) {
+    while (values->count > 0) {
+        free_function(*(Function**)work_stack_pop(values));
+    }
+    free_work_stack(values);
+}
+
+// read back the normal form of `term` in `env`, under `depth` lambdas
+Function* machine_normalize(Machine* m, Function* term, Env* env, size_t depth) {
+    InternTable* t = m->runtime->interned;
+    FunctionPool* pool = m->runtime->pool;
+    size_t first_base = m->stack_count;
+    bool ok = true;
+
+    MachineRead local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(MachineRead), local, WORK_STACK_LOCAL);
+    Function* local_values[WORK_STACK_LOCAL];
+    WorkStack values;
+    work_stack_init(&values, sizeof(Function*), local_values, WORK_STACK_LOCAL);
+
+    MachineRead first = {READ_TERM, term, env, depth, 0, 0};
+    work_stack_push(&stack, &first);
+    MachineReads reads = {&stack, m->reads};
+    m->reads = &reads;
+
+    while (ok && stack.count > 0) {
+        MachineRead work = *(MachineRead*)work_stack_pop(&stack);
+
+        if (work.kind == READ_ARGS) {
+            // the first argument is on top of the stack
+            if (work.next == work.base) {
+                m->stack_count = work.base;
+                continue;
+            }
+            Closure* c = m->stack[work.next - 1].closure;
+            MachineRead rest = {READ_ARGS, NULL, NULL, work.depth, work.base, work.next - 1};
+            MachineRead apply = {READ_APPLY, NULL, NULL, work.depth, 0, 0};
+            MachineRead arg = {READ_TERM, c->term, c->env, work.depth, 0, 0};
+            ok = work_stack_push(&stack, &rest) && work_stack_push(&stack, &apply) && work_stack_push(&stack, &arg);
+            continue;
+        }
+        if (work.kind != READ_TERM) {
+            ok = read_combine(t, pool, &values, work.kind, work.kind == READ_LAMBDA ? work.term->index : 0, work.term != NULL ? work.term->symbol : FUNCTION_NO_SYMBOL);
+            continue;
+        }
+
+        size_t base = m->stack_count;
+        Closure* head = machine_whnf(m, work.term, work.env, base, work.depth);
+        if (head == NULL) {
+            ok = false;
+            break;
+        }
+        if (m->stack_count > base) {
+            MachineRead args = {READ_ARGS, NULL, NULL, work.depth, base, m->stack_count};
+            ok = work_stack_push(&stack, &args);
+        }
+
+        Function* result = NULL;
+        if (head->term == NULL) {
+            result = new_variable(t, pool, work.depth - 1 - head->level);
+        } else if (head->term->kind == FUNCTION_LAMBDA) {
+            Env* inner = machine_new_env(m, machine_new_closure(m, NULL, NULL, work.depth), head->env);
+            MachineRead lambda = {READ_LAMBDA, head->term, NULL, work.depth, 0, 0};
+            MachineRead body = {READ_TERM, head->term->body[0], inner, work.depth + 1, 0, 0};
+            ok = ok && inner != NULL && work_stack_push(&stack, &lambda) && work_stack_push(&stack, &body);
+            continue;
+        } else if (head->term->kind == FUNCTION_BUILTIN && head->term->body_count > 0) {
+            MachineRead builtin = {READ_BUILTIN, head->term, NULL, work.depth, 0, 0};
+            MachineRead arg = {READ_TERM, head->term->body[0], head->env, work.depth, 0, 0};
+            ok = ok && work_stack_push(&stack, &builtin) && work_stack_push(&stack, &arg);
+            continue;
+        } else if (head->term->kind == FUNCTION_NUMERAL) {
+            // the numerals of the machine blocks don't outlive it
+            result = new_numeral(t, pool, head->term->index);
+        } else {
+            result = head->term->interned ? head->term : copy_function(pool, head->term);
+        }
+        ok = ok && result != NULL && work_stack_push(&values, &result);
+    }
+
+    m->reads = reads.next;
+    free_work_stack(&stack);
+    m->stack_count = first_base;
+    if (!ok) {
+        read_free_values(&values);
+        return NULL;
+    }
+
+    Function* result = *(Function**)work_stack_pop(&values);
+    free_work_stack(&values);
+    return result;
+}
+
+void machine_run(Runtime* runtime, Function* f) {
+    Machine* m = new_machine(runtime);
+    if (m == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+
+    machine_whnf(m, f, NULL, 0, 0);
+    free_machine(m);
+}
+
+/*
+    6. Half Net
+
+    Interaction net engine (Lafont's interaction combinators, reduced like
+    HVM). The term is compiled into a graph of agents with one principal port
+    and up to two auxiliary ports:
+     - LAM: principal = the lambda, aux1 = its variable, aux2 = its body
+     - APP: principal = the function, aux1 = the argument, aux2 = the result
+     - DUP: principal = the shared value, aux1 and aux2 = its two copies
+     - ERA: an unused value
+     - REF: a definition, expanded when its value is needed
+     - BLT: a builtin call, principal = the result, aux1 = the argument
+     - FREE: a free name
+    Only pairs of agents connected by their principal ports are rewritten,
+    each rule is local and a shared value is only copied as far as the copies
+    actually differ. This avoids the duplicated work of the other engines on
+    higher-order programs (optimal reduction).
+
+    Duplicators have labels: two DUPs with the same label annihilate, others
+    commute. Every DUP of a compiled term gets a fresh label and definitions
+    get new labels each time they are expanded. Like HVM there is no oracle:
+    a function that duplicates its argument and is applied to a copy of
+    itself (outside of elementary affine logic, like (\x.x x) (\y.y y y))
+    may loop or read back a wrong term, the other engines handle any term.
+
+    The reduction is lazy: it starts from the root and only rewrites the
+    pairs its weak head normal form depends on, then the normal form is read
+    back into a Function.
+*/
+
+typedef enum {
+    NET_ROOT,
+    NET_LAM,
+    NET_APP,
+    NET_DUP,
+    NET_ERA,
+    NET_REF,
+    NET_BLT,
+    NET_FREE,
+} Net_Kind;
+
+#define NET_PORT(node, slot) (((node) << 2) | (slot))
+#define NET_NODE(port) ((port) >> 2)
+#define NET_SLOT(port) ((port) & 3)
+#define NET_NONE ((size_t)-1)
+
+typedef struct {
+    Net_Kind kind;
+    bool stuck;     // a builtin call that can't run
+    size_t label;   // DUP: its label, LAM: debug name slot, REF: Context index
+    Function* term; // BLT and FREE: the builtin call or the free name
+    size_t ports[3];
+} NetNode;
+
+typedef struct Net {
+    Runtime* runtime;
+
+    NetNode* nodes; // nodes[0] is the root
+    size_t count, capacity;
+    size_t free_list; // freed nodes, chained by ports[0]
+    size_t labels;
+
+    size_t* stack; // ports waiting for a weak head normal form
+    size_t stack_count, stack_capacity;
+
+    size_t* binders; // LAM nodes entered by the read back
+    size_t binders_count, binders_capacity, binders_base;
+
+    size_t* fans; // DUP copies taken by the read back, as NET_PORT(label, slot)
+    size_t fans_count, fans_capacity, fans_base;
+
+    struct Net** templates; // compiled definitions, by Context index
+    size_t templates_count;
+} Net;
+
+Net* new_net(Runtime* runtime, bool templates) {
+    Net* n = (Net*)malloc(sizeof(Net));
+    if (n == NULL) return NULL;
+
+    n->runtime = runtime;
+    n->count = 1;
+    n->capacity = 256;
+    n->free_list = NET_NONE;
+    n->labels = 0;
+    n->stack_count = 0;
+    n->stack_capacity = 64;
+    n->binders_count = n->binders_base = 0;
+    n->binders_capacity = 64;
+    n->fans_count = n->fans_base = 0;
+    n->fans_capacity = 64;
+    n->templates_count = templates ? runtime->context->count : 0;
+
+    n->nodes = (NetNode*)malloc(n->capacity * sizeof(NetNode));
+    n->stack = (size_t*)malloc(n->stack_capacity * sizeof(size_t));
+    n->binders = (size_t*)malloc(n->binders_capacity * sizeof(size_t));
+    n->fans = (size_t*)malloc(n->fans_capacity * sizeof(size_t));
+    n->templates = (struct Net**)calloc(n->templates_count + 1, sizeof(struct Net*));
+
+    if (n->nodes == NULL || n->stack == NULL || n->binders == NULL || n->fans == NULL || n->templates == NULL) {
+        free(n->nodes);
+        free(n->stack);
+        free(n->binders);
+        free(n->fans);
+        free(n->templates);
+        free(n);
+        return NULL;
+    }
+
+    n->nodes[0].kind = NET_ROOT;
+    n->nodes[0].stuck = false;
+    n->nodes[0].label = 0;
+    n->nodes[0].term = NULL;
+    n->nodes[0].ports[0] = NET_PORT(0, 0);
+    return n;
+}
+
+void free_net(Net* n) {
+    if (n == NULL) return;
+    for (size_t i = 0; i < n->templates_count; i++) {
+        free_net(n->templates[i]);
+    }
+    free(n->templates);
+    free(n->nodes);
+    free(n->stack);
+    free(n->binders);
+    free(n->fans);
+    free(n);
+}
+
+static inline size_t net_new_node(Net* n, Net_Kind kind, size_t label, Function* term) {
+    size_t i;
+    if (n->free_list != NET_NONE) {
+        i = n->free_list;
+        n->free_list = n->nodes[i].ports[0];
+    } else {
+        if (n->count >= n->capacity) {
+            NetNode* temp = (NetNode*)realloc(n->nodes, n->capacity * 2 * sizeof(NetNode));
+            if (temp == NULL) {
+                fprintf(stderr, "Error: Memory reallocation failed\n");
+                return NET_NONE;
+            }
+            n->nodes = temp;
+            n->capacity *= 2;
+        }
+        i = n->count++;
+    }
+
+    n->nodes[i].kind = kind;
+    n->nodes[i].stuck = false;
+    n->nodes[i].label = label;
+    n->nodes[i].term = term;
+    n->nodes[i].ports[0] = n->nodes[i].ports[1] = n->nodes[i].ports[2] = NET_NONE;
+    return i;
+}
+
+static inline void net_free_node(Net* n, size_t i) {
+    n->nodes[i].kind = NET_ERA;
+    n->nodes[i].ports[0] = n->free_list;
+    n->free_list = i;
+}
+
+static inline void net_link(Net* n, size_t a, size_t b) {
+    n->nodes[NET_NODE(a)].ports[NET_SLOT(a)] = b;
+    n->nodes[NET_NODE(b)].ports[NET_SLOT(b)] = a;
+}
+
+static inline size_t net_peer(Net* n, size_t port) {
+    return n->nodes[NET_NODE(port)].ports[NET_SLOT(port)];
+}
+
+static inline bool net_stack_push(size_t** array, size_t* count, size_t* capacity, size_t value) {
+    if (*count >= *capacity) {
+        size_t* temp = (size_t*)realloc(*array, *capacity * 2 * sizeof(size_t));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        *array = temp;
+        *capacity *= 2;
+    }
+    (*array)[(*count)++] = value;
+    return true;
+}
+
+// a term to visit under `depth` lambdas
+typedef struct {
+    Function* f;
+    size_t depth;
+} NetVisit;
+
+// a port waiting for the variable of a lambda, chained to the lambda's
+// previous use
+typedef struct {
+    size_t port, next;
+} NetUse;
+
+// Connect the variable of `lam` to the ports of its uses, starting from the
+// use `head`. A variable used several times is shared by a balanced tree of
+// DUPs: a copy is reached through a logarithmic number of them (a chain
+// would make the read back of each use walk all the uses before it).
+static inline bool net_bind(Net* n, size_t lam, WorkStack* uses, size_t head, WorkStack* ports) {
+    ports->count = 0;
+    for (size_t i = head; i != NET_NONE; i = ((NetUse*)uses->items)[i].next) {
+        if (!work_stack_push(ports, &((NetUse*)uses->items)[i].port)) return false;
+    }
+    if (ports->count == 0) {
+        size_t era = net_new_node(n, NET_ERA, 0, NULL);
+        if (era == NET_NONE) return false;
+        net_link(n, NET_PORT(lam, 1), NET_PORT(era, 0));
+        return true;
+    }
+
+    // each round joins the ports two by two with a DUP, until one is left
+    size_t* p = (size_t*)ports->items;
+    for (size_t count = ports->count; count > 1; count = (count + 1) / 2) {
+        for (size_t i = 0; i < count; i += 2) {
+            if (i + 1 == count) {
+                p[i / 2] = p[i];
+                break;
+            }
+            size_t dup = net_new_node(n, NET_DUP, n->labels++, NULL);
+            if (dup == NET_NONE) return false;
+            net_link(n, NET_PORT(dup, 1), p[i]);
+            net_link(n, NET_PORT(dup, 2), p[i + 1]);
+            p[i / 2] = NET_PORT(dup, 0);
+        }
+    }
+    net_link(n, NET_PORT(lam, 1), p[0]);
+    return true;
+}
+
+// Compile `f` and link the port giving its value to `target`. `scope` holds,
+// for each enclosing lambda, the last use of its variable seen so far. The
+// terms are compiled depth first so a lambda's entry in `scope` stays valid
+// while its body is compiled, its variable is bound once the body is done.
+static inline bool net_compile_scoped(Net* n, Function* f, size_t* scope, size_t target) {
+    typedef struct {
+        Function* f; // NULL: bind the variable of the LAM `target`
+        size_t depth, target;
+    } CompileWork;
+
+    bool ok = true;
+    CompileWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(CompileWork), local, WORK_STACK_LOCAL);
+    CompileWork first = {f, 0, target};
+    work_stack_push(&stack, &first);
+    Function* local_expansions[WORK_STACK_LOCAL];
+    WorkStack expansions;
+    work_stack_init(&expansions, sizeof(Function*), local_expansions, WORK_STACK_LOCAL);
+    NetUse local_uses[WORK_STACK_LOCAL];
+    WorkStack uses;
+    work_stack_init(&uses, sizeof(NetUse), local_uses, WORK_STACK_LOCAL);
+    size_t local_ports[WORK_STACK_LOCAL];
+    WorkStack ports;
+    work_stack_init(&ports, sizeof(size_t), local_ports, WORK_STACK_LOCAL);
+
+    while (ok && stack.count > 0) {
+        CompileWork work = *(CompileWork*)work_stack_pop(&stack);
+        f = work.f;
+        size_t depth = work.depth;
+        size_t port = NET_NONE;
+
+        if (f == NULL) {
+            ok = net_bind(n, work.target, &uses, scope[depth], &ports);
+            continue;
+        }
+
+        if (function_is_native(f)) {
+            // the net has no native values, their lambda term is compiled
+            // instead and kept until the end of the compilation
+            Function* term = church_expand(NULL, n->runtime->pool, f);
+            ok = term != NULL && work_stack_push(&expansions, &term);
+            if (!ok) {
+                free_function(term);
+                break;
+            }
+            work.f = term;
+            ok = work_stack_push(&stack, &work);
+            continue;
+        }
+
+        switch (f->kind) {
+            case FUNCTION_VARIABLE: {
+                // linked once the variable's lambda is done (see net_bind)
+                size_t* last = &scope[depth - 1 - f->index];
+                NetUse use = {work.target, *last};
+                ok = work_stack_push(&uses, &use);
+                *last = uses.count - 1;
+                continue;
+            }
+
+            case FUNCTION_LAMBDA: {
+                size_t lam = net_new_node(n, NET_LAM, f->index, NULL);
+                if (lam == NET_NONE) break;
+
+                scope[depth] = NET_NONE;
+                CompileWork bind = {NULL, depth, lam};
+                CompileWork body = {f->body[0], depth + 1, NET_PORT(lam, 2)};
+                if (work_stack_push(&stack, &bind) && work_stack_push(&stack, &body)) port = NET_PORT(lam, 0);
+                break;
+            }
+
+            case FUNCTION_APPLY: {
+                size_t app = net_new_node(n, NET_APP, 0, NULL);
+                if (app == NET_NONE) break;
+
+                CompileWork arg = {f->body[1], depth, NET_PORT(app, 1)};
+                CompileWork fn = {f->body[0], depth, NET_PORT(app, 0)};
+                if (work_stack_push(&stack, &arg) && work_stack_push(&stack, &fn)) port = NET_PORT(app, 2);
+                break;
+            }
+
+            case FUNCTION_NAME: {
+                size_t i = runtime_definition(n->runtime, f->symbol);
+                size_t node = i < n->runtime->context->count
+                    ? net_new_node(n, NET_REF, i, NULL)
+                    : net_new_node(n, NET_FREE, 0, f);
+                if (node != NET_NONE) port = NET_PORT(node, 0);
+                break;
+            }
+
+            case FUNCTION_BUILTIN: {
+                size_t blt = net_new_node(n, NET_BLT, 0, f);
+                if (blt == NET_NONE) break;
+
+                if (f->body_count > 0) {
+                    CompileWork arg = {f->body[0], depth, NET_PORT(blt, 1)};
+                    if (!work_stack_push(&stack, &arg)) break;
+                } else {
+                    size_t era = net_new_node(n, NET_ERA, 0, NULL);
+                    if (era == NET_NONE) break;
+                    net_link(n, NET_PORT(blt, 1), NET_PORT(era, 0));
+                }
+                port = NET_PORT(blt, 0);
+                break;
+            }
+
+            default:
+                fprintf(stderr, "Error: Unexpected function in net\n");
+                break;
+        }
+
+        ok = port != NET_NONE;
+        if (ok) net_link(n, work.target, port);
+    }
+
+    free_work_stack(&stack);
+    free_work_stack(&uses);
+    free_work_stack(&ports);
+    read_free_values(&expansions);
+    return ok;
+}
+
+static inline size_t net_lambda_depth(Function* f) {
+    NetVisit local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(NetVisit), local, WORK_STACK_LOCAL);
+    NetVisit first = {f, 0};
+    work_stack_push(&stack, &first);
+
+    size_t max = 0;
+    while (stack.count > 0) {
+        NetVisit visit = *(NetVisit*)work_stack_pop(&stack);
+        size_t depth = visit.f->kind == FUNCTION_LAMBDA ? visit.depth + 1 : visit.depth;
+        if (function_is_native(visit.f)) depth += 2; // see net_compile_scoped
+        if (depth > max) max = depth;
+        for (size_t i = 0; i < visit.f->body_count; i++) {
+            NetVisit child = {visit.f->body[i], depth};
+            work_stack_push(&stack, &child);
+        }
+    }
+    free_work_stack(&stack);
+    return max;
+}
+
+// compile the closed function `f` and link its value to `target`
+bool net_compile(Net* n, Function* f, size_t target) {
+    size_t* scope = (size_t*)malloc((net_lambda_depth(f) + 1) * sizeof(size_t));
+    if (scope == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+
+    bool ok = net_compile_scoped(n, f, scope, target);
+    free(scope);
+    return ok;
+}
+
+// Copy the compiled definition `i` into `n` with fresh DUP labels and
+// return the port giving its value.
+static inline size_t net_instantiate(Net* n, size_t i) {
+    if (n->templates[i] == NULL) {
+        Net* t = new_net(n->runtime, false);
+        if (t == NULL) return NET_NONE;
+        n->templates[i] = t;
+
+        if (!net_compile(t, n->runtime->context->functions[i], NET_PORT(0, 0))) return NET_NONE;
+    }
+
+    Net* t = n->templates[i];
+    size_t* map = (size_t*)malloc(t->count * sizeof(size_t));
+    if (map == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return NET_NONE;
+    }
+
+    for (size_t j = 1; j < t->count; j++) {
+        NetNode* node = &t->nodes[j];
+        size_t label = node->kind == NET_DUP ? node->label + n->labels : node->label;
+        map[j] = net_new_node(n, node->kind, label, node->term);
+        if (map[j] == NET_NONE) {
+            free(map);
+            return NET_NONE;
+        }
+    }
+
+    for (size_t j = 1; j < t->count; j++) {
+        for (size_t k = 0; k < 3; k++) {
+            size_t port = t->nodes[j].ports[k];
+            if (port != NET_NONE && NET_NODE(port) != 0) {
+                n->nodes[map[j]].ports[k] = NET_PORT(map[NET_NODE(port)], NET_SLOT(port));
+            }
+        }
+    }
+
+    size_t value = t->nodes[0].ports[0];
+    size_t result = NET_PORT(map[NET_NODE(value)], NET_SLOT(value));
+    n->labels += t->labels;
+    free(map);
+    return result;
+}
+
+// `a` and `b` meet on their principal ports and are different agents: each
+// one is copied through the other, `a` is then freed.
+static inline bool net_commute(Net* n, size_t a, size_t b) {
+    size_t a_copies[2], b_copies[2];
+    for (size_t i = 0; i < 2; i++) {
+        a_copies[i] = net_new_node(n, n->nodes[a].kind, n->nodes[a].label, NULL);
+        b_copies[i] = net_new_node(n, n->nodes[b].kind, n->nodes[b].label, NULL);
+        if (a_copies[i] == NET_NONE || b_copies[i] == NET_NONE) return false;
+    }
+
+    // like net_annihilate, the peers are read again after each link
+    net_link(n, NET_PORT(a_copies[0], 0), n->nodes[b].ports[1]);
+    net_link(n, NET_PORT(a_copies[1], 0), n->nodes[b].ports[2]);
+    net_link(n, NET_PORT(b_copies[0], 0), n->nodes[a].ports[1]);
+    net_link(n, NET_PORT(b_copies[1], 0), n->nodes[a].ports[2]);
+    for (size_t i = 0; i < 2; i++) {
+        for (size_t j = 0; j < 2; j++) {
+            net_link(n, NET_PORT(a_copies[i], j + 1), NET_PORT(b_copies[j], i + 1));
+        }
+    }
+
+    net_free_node(n, a);
+    net_free_node(n, b);
+    return true;
+}
+
+// `a` and `b` meet on their principal ports and are the same agent: their
+// auxiliary ports are connected together
+static inline void net_annihilate(Net* n, size_t a, size_t b) {
+    // the peers are read again after each link, a port may be linked to its
+    // own node (\x.x)
+    net_link(n, n->nodes[a].ports[1], n->nodes[b].ports[1]);
+    net_link(n, n->nodes[a].ports[2], n->nodes[b].ports[2]);
+    net_free_node(n, a);
+    net_free_node(n, b);
+}
+
+// the DUP `dup` copies the leaf agent `leaf` (REF or FREE)
+static inline bool net_copy(Net* n, size_t dup, size_t leaf) {
+    for (size_t k = 1; k <= 2; k++) {
+        size_t copy = net_new_node(n, n->nodes[leaf].kind, n->nodes[leaf].label, n->nodes[leaf].term);
+        if (copy == NET_NONE) return false;
+        net_link(n, NET_PORT(copy, 0), n->nodes[dup].ports[k]);
+    }
+    net_free_node(n, dup);
+    net_free_node(n, leaf);
+    return true;
+}
+
+Function* net_readback(Net* n, size_t host, size_t depth); // forward declaration
+
+// the value connected to the port `host` of a builtin call, closed and in
+// normal form
+static inline Function* net_builtin_arg(Net* n, size_t host) {
+    size_t binders_base = n->binders_base, fans_base = n->fans_base;
+    n->binders_base = n->binders_count;
+    n->fans_base = n->fans_count;
+    Function* arg = net_readback(n, host, 0);
+    n->binders_base = binders_base;
+    n->fans_base = fans_base;
+    return arg;
+}
+
+// Run the builtin call `blt`, whose value is waited for by `*host`. Its
+// other arguments are those of the APP agents on the stack (above `base`),
+// the outermost one is replaced by the result and `*host` moves to the port
+// waiting for it. `*partial` is set when there are not enough arguments.
+// Like the machine, the arguments are read back closed and in normal form.
+// The call is left stuck when the builtin is unknown or an argument can't
+// be read back.
+static inline bool net_builtin(Net* n, size_t blt, size_t* host, size_t base, bool* partial) {
+    struct Builtin* builtin = runtime_find_builtin(n->runtime, n->nodes[blt].term->symbol);
+    *partial = false;
+    if (builtin == NULL) {
+        n->nodes[blt].stuck = true;
+        return true;
+    }
+
+    // the APP agents of the call, the innermost first, they were entered
+    // from the ports on the stack
+    size_t apps[BUILTIN_ARGS_MAX];
+    size_t target = *host;
+    for (size_t k = 1; k < builtin->arity; k++) {
+        size_t app = NET_NODE(target);
+        if ((k > 1 && (n->stack_count < base + k - 1 || n->stack[n->stack_count - (k - 1)] != target)) ||
+            NET_SLOT(target) != 0 || n->nodes[app].kind != NET_APP) {
+            *partial = true;
+            return true;
+        }
+        apps[k] = app;
+        target = n->nodes[app].ports[2];
+    }
+
+    Function* args[BUILTIN_ARGS_MAX];
+    bool ok = true;
+    // read before the read back, which may free the node
+    bool erased = n->nodes[NET_NODE(n->nodes[blt].ports[1])].kind == NET_ERA;
+    args[0] = erased ? NULL : net_builtin_arg(n, NET_PORT(blt, 1));
+    ok = erased || args[0] != NULL;
+    size_t count = 1;
+    for (; ok && count < builtin->arity; count++) {
+        args[count] = net_builtin_arg(n, NET_PORT(apps[count], 1));
+        ok = args[count] != NULL;
+    }
+    if (!ok) {
+        for (size_t i = 0; i + 1 < count; i++) free_function(args[i]);
+        n->nodes[blt].stuck = true;
+        return true;
+    }
+
+    Function* result = builtin->func(n->runtime, builtin->user, args);
+    if (result == NULL) return false;
+    ok = net_compile(n, result, target);
+    free_function(result);
+    if (!ok) return false;
+
+    // the arguments are erased, a DUP they share may still be used
+    for (size_t k = 0; k < builtin->arity; k++) {
+        size_t node = k == 0 ? blt : apps[k];
+        size_t era = net_new_node(n, NET_ERA, 0, NULL);
+        if (era == NET_NONE) return false;
+        net_link(n, NET_PORT(era, 0), n->nodes[node].ports[1]);
+        net_free_node(n, node);
+    }
+    n->stack_count -= builtin->arity - 1;
+    *host = target;
+    return true;
+}
+
+// Reduce the value connected to the port `host` to weak head normal form:
+// a lambda, a superposition or a neutral term. The APP and DUP agents whose
+// principal port waits for a value are kept on the stack. Builtins only run
+// outside of any lambda of the read back (`depth` 0).
+bool net_whnf(Net* n, size_t host, size_t depth) {
+    size_t base = n->stack_count;
+    for (;;) {
+        size_t port = n->nodes[NET_NODE(host)].ports[NET_SLOT(host)];
+        size_t node = NET_NODE(port);
+        size_t waiting = NET_SLOT(host) == 0 ? NET_NODE(host) : 0;
+        Net_Kind waiting_kind = n->nodes[waiting].kind;
+        bool active = waiting != 0 && (waiting_kind == NET_APP || waiting_kind == NET_DUP);
+        bool interacted = false;
+
+        if (NET_SLOT(port) != 0) {
+            Net_Kind kind = n->nodes[node].kind;
+            if (kind == NET_APP || kind == NET_DUP) {
+                // the value of an application or a copy, reduce its input
+                if (!net_stack_push(&n->stack, &n->stack_count, &n->stack_capacity, host)) return false;
+                host = NET_PORT(node, 0);
+                continue;
+            }
+            // a variable
+            n->stack_count = base;
+            return true;
+        }
+
+        switch (n->nodes[node].kind) {
+            case NET_LAM:
+            case NET_DUP:
+                if (!active) {
+                    n->stack_count = base;
+                    return true;
+                }
+                if (waiting_kind == NET_APP && n->nodes[node].kind == NET_LAM) {
+                    // beta reduction, the argument is connected to the
+                    // variable and the result to the body
+                    net_link(n, n->nodes[waiting].ports[1], n->nodes[node].ports[1]);
+                    net_link(n, n->nodes[waiting].ports[2], n->nodes[node].ports[2]);
+                    net_free_node(n, waiting);
+                    net_free_node(n, node);
+                } else if (waiting_kind == NET_DUP && n->nodes[node].kind == NET_DUP &&
+                           n->nodes[waiting].label == n->nodes[node].label) {
+                    net_annihilate(n, waiting, node);
+                } else if (!net_commute(n, waiting, node)) {
+                    return false;
+                }
+                interacted = true;
+                break;
+
+            case NET_REF:
+                if (active && waiting_kind == NET_DUP) {
+                    if (!net_copy(n, waiting, node)) return false;
+                    interacted = true;
+                } else {
+                    size_t value = net_instantiate(n, n->nodes[node].label);
+                    if (value == NET_NONE) return false;
+                    net_link(n, host, value);
+                    net_free_node(n, node);
+                }
+                break;
+
+            case NET_FREE:
+                if (!active || waiting_kind != NET_DUP) {
+                    n->stack_count = base;
+                    return true;
+                }
+                if (!net_copy(n, waiting, node)) return false;
+                interacted = true;
+                break;
+
+            case NET_BLT:
+                if (depth > 0 || n->nodes[node].stuck) {
+                    n->stack_count = base;
+                    return true;
+                }
+                bool partial;
+                if (!net_builtin(n, node, &host, base, &partial)) return false;
+                if (partial) {
+                    n->stack_count = base;
+                    return true;
+                }
+                break;
+
+            default:
+                fprintf(stderr, "Error: Unexpected agent in net\n");
+                return false;
+        }
+
+        if (interacted) {
+            // the waiting agent is gone, the port that waited for its value
+            // now waits for the result of the interaction
+            if (n->stack_count == base) return true;
+            host = n->stack[--n->stack_count];
+        }
+    }
+}
+
+// read back the normal form of the value connected to `host`, under `depth`
+// lambdas
+Function* net_readback(Net* n, size_t host, size_t depth) {
+    typedef struct {
+        Read_Kind kind;
+        size_t host, depth;
+        size_t label;        // READ_LAMBDA: the name slot
+        uint32_t symbol;     // READ_BUILTIN: the builtin
+        size_t fan, index;   // READ_FAN: the entry of the fans stack to restore
+        bool reduced;        // READ_TERM: the value is in weak head normal form
+    } NetRead;
+
+    InternTable* t = n->runtime->interned;
+    FunctionPool* pool = n->runtime->pool;
+    size_t binders_count = n->binders_count;
+    size_t fans_count = n->fans_count;
+    bool ok = true;
+
+    NetRead local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(NetRead), local, WORK_STACK_LOCAL);
+    Function* local_values[WORK_STACK_LOCAL];
+    WorkStack values;
+    work_stack_init(&values, sizeof(Function*), local_values, WORK_STACK_LOCAL);
+
+    NetRead first = {READ_TERM, host, depth, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+    work_stack_push(&stack, &first);
+
+    while (ok && stack.count > 0) {
+        NetRead work = *(NetRead*)work_stack_pop(&stack);
+
+        if (work.kind == READ_FAN) {
+            // the fans stack as it was before the copy was read
+            n->fans_count = work.index;
+            if (work.fan != NET_NONE) n->fans[work.index - 1] = work.fan;
+            continue;
+        }
+        if (work.kind != READ_TERM) {
+            if (work.kind == READ_LAMBDA) n->binders_count--;
+            ok = read_combine(t, pool, &values, work.kind, work.label, work.symbol);
+            continue;
+        }
+
+        if (!work.reduced && !net_whnf(n, work.host, work.depth)) {
+            ok = false;
+            break;
+        }
+
+        size_t port = n->nodes[NET_NODE(work.host)].ports[NET_SLOT(work.host)];
+        size_t node = NET_NODE(port);
+        NetNode* agent = &n->nodes[node];
+        Function* result = NULL;
+
+        switch (agent->kind) {
+            case NET_LAM:
+                if (NET_SLOT(port) == 1) {
+                    for (size_t i = n->binders_count; i > n->binders_base; i--) {
+                        if (n->binders[i - 1] == node) {
+                            result = new_variable(t, pool, n->binders_count - i);
+                            break;
+                        }
+                    }
+                    if (result == NULL) fprintf(stderr, "Error: Unbound variable in net\n");
+                } else {
+                    NetRead lambda = {READ_LAMBDA, 0, work.depth, agent->label, FUNCTION_NO_SYMBOL, 0, 0, false};
+                    NetRead body = {READ_TERM, NET_PORT(node, 2), work.depth + 1, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+                    ok = net_stack_push(&n->binders, &n->binders_count, &n->binders_capacity, node) &&
+                         work_stack_push(&stack, &lambda) && work_stack_push(&stack, &body);
+                    continue;
+                }
+                break;
+
+            case NET_APP: {
+                // entered from its result, net_whnf reduced its function
+                bool reduced = NET_SLOT(port) == 2;
+                NetRead apply = {READ_APPLY, 0, work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+                NetRead arg = {READ_TERM, NET_PORT(node, 1), work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+                NetRead fn = {READ_TERM, NET_PORT(node, 0), work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, reduced};
+                ok = work_stack_push(&stack, &apply) && work_stack_push(&stack, &arg) && work_stack_push(&stack, &fn);
+                continue;
+            }
+
+            case NET_DUP: {
+                size_t label = agent->label;
+                if (NET_SLOT(port) != 0) {
+                    // a copy of a neutral term, both copies read the same
+                    // except for the superpositions of the same label, like
+                    // an APP net_whnf reduced its value
+                    NetRead restore = {READ_FAN, 0, work.depth, 0, FUNCTION_NO_SYMBOL, NET_NONE, n->fans_count, false};
+                    NetRead value = {READ_TERM, NET_PORT(node, 0), work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, true};
+                    ok = net_stack_push(&n->fans, &n->fans_count, &n->fans_capacity, NET_PORT(label, NET_SLOT(port))) &&
+                         work_stack_push(&stack, &restore) && work_stack_push(&stack, &value);
+                    continue;
+                }
+
+                bool found = false;
+                for (size_t i = n->fans_count; i > n->fans_base; i--) {
+                    size_t fan = n->fans[i - 1];
+                    if (fan != NET_NONE && NET_NODE(fan) == label) {
+                        n->fans[i - 1] = NET_NONE;
+                        NetRead restore = {READ_FAN, 0, work.depth, 0, FUNCTION_NO_SYMBOL, fan, n->fans_count, false};
+                        NetRead value = {READ_TERM, NET_PORT(node, NET_SLOT(fan)), work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+                        ok = work_stack_push(&stack, &restore) && work_stack_push(&stack, &value);
+                        found = true;
+                        break;
+                    }
+                }
+                if (found) continue;
+                fprintf(stderr, "Error: Unexpected superposition in net\n");
+                break;
+            }
+
+            case NET_FREE:
+                result = agent->term->interned ? agent->term : copy_function(pool, agent->term);
+                break;
+
+            case NET_BLT: {
+                Function* call = agent->term;
+                if (call->body_count == 0) {
+                    result = call->interned ? call : copy_function(pool, call);
+                    break;
+                }
+                NetRead builtin = {READ_BUILTIN, 0, work.depth, 0, call->symbol, 0, 0, false};
+                NetRead arg = {READ_TERM, NET_PORT(node, 1), work.depth, 0, FUNCTION_NO_SYMBOL, 0, 0, false};
+                ok = work_stack_push(&stack, &builtin) && work_stack_push(&stack, &arg);
+                continue;
+            }
+
+            default:
+                fprintf(stderr, "Error: Unexpected agent in net\n");
+                break;
+        }
+        ok = result != NULL && work_stack_push(&values, &result);
+    }
+
+    // on failure, put back the fans hidden by the copies being read
+    while (stack.count > 0) {
+        NetRead* work = (NetRead*)work_stack_pop(&stack);
+        if (work->kind == READ_FAN && work->fan != NET_NONE) n->fans[work->index - 1] = work->fan;
+    }
+    free_work_stack(&stack);
+    n->binders_count = binders_count;
+    n->fans_count = fans_count;
+    if (!ok) {
+        read_free_values(&values);
+        return NULL;
+    }
+
+    Function* result = *(Function**)work_stack_pop(&values);
+    free_work_stack(&values);
+    return result;
+}
+
+void net_run(Runtime* runtime, Function* f) {
+    Net* n = new_net(runtime, true);
+    if (n == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+
+    if (net_compile(n, f, NET_PORT(0, 0))) {
+        net_whnf(n, NET_PORT(0, 0), 0);
+    }
+    free_net(n);
+}
+
+/*
+    7. Half VM
+
+    The program is compiled to bytecode once, before it runs. The code of a
+    term is its spine: a GRAB for each lambda, a PUSH for each argument (the
+    code of the argument is placed after), and the instruction giving its
+    head:
+     - GRAB slot: bind the argument on top of the stack, or return the lambda
+     - PUSH pc: push the code at `pc` with the current environment
+     - ACCESS i: enter the variable i (De Bruijn index)
+     - GLOBAL name: enter a definition, or stop on a free name
+     - BUILTIN name pc: call a builtin on the code at `pc` (or VM_NONE)
+
+    The VM is the machine of "5. Half Machine" (same call-by-need update
+    frames, same read back, same copying collector) running on this code
+    instead of walking the Functions. Instructions are dispatched with computed gotos when the
+    compiler supports them (define HALF_NO_COMPUTED_GOTO to use a switch).
+*/
+
+#if defined(__GNUC__) && !defined(HALF_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO
+#endif
+
+typedef enum {
+    VM_GRAB,
+    VM_PUSH,
+    VM_ACCESS,
+    VM_GLOBAL,
+    VM_BUILTIN,
+} VM_Opcode;
+
+#define VM_NONE UINT32_MAX
+
+struct VM;
+struct VMEnv;
+struct VMClosure;
+
+typedef struct Bytecode {
+    uint32_t* code;
+    size_t count, capacity;
+
+    // symbols of the names used by the GLOBAL and BUILTIN instructions
+    uint32_t* names;
+    size_t names_count, names_capacity;
+    uint32_t* slots; // index in `names` of each symbol, or VM_NONE
+    size_t slots_capacity;
+
+    uint32_t* entries;     // code of each statement, by program index
+    uint32_t* defines;     // name of each statement defining one, or VM_NONE
+    size_t statements, statements_capacity;
+    uint32_t* definitions; // code of each definition, by Context index
+    size_t definitions_count;
+
+    // replaces vm_whnf for the code compiled to C, see "8. Half C"
+    struct VMClosure* (*native)(struct VM* vm, uint32_t pc, struct VMEnv* env, size_t base, size_t depth);
+} Bytecode;
+
+static inline bool bytecode_emit(Bytecode* b, uint32_t word) {
+    if (b->count >= b->capacity) {
+        uint32_t* temp = (uint32_t*)realloc(b->code, b->capacity * 2 * sizeof(uint32_t));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        b->code = temp;
+        b->capacity *= 2;
+    }
+    b->code[b->count++] = word;
+    return true;
+}
+
+static inline uint32_t bytecode_name(Bytecode* b, uint32_t symbol) {
+    if (symbol < b->slots_capacity && b->slots[symbol] != VM_NONE) return b->slots[symbol];
+
+    if (symbol >= b->slots_capacity) {
+        size_t capacity = b->slots_capacity * 2 > symbol ? b->slots_capacity * 2 : (size_t)symbol + 16;
+        uint32_t* temp = (uint32_t*)realloc(b->slots, capacity * sizeof(uint32_t));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return VM_NONE;
+        }
+        for (size_t i = b->slots_capacity; i < capacity; i++) temp[i] = VM_NONE;
+        b->slots = temp;
+        b->slots_capacity = capacity;
+    }
+
+    if (b->names_count >= b->names_capacity) {
+        uint32_t* temp = (uint32_t*)realloc(b->names, b->names_capacity * 2 * sizeof(uint32_t));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return VM_NONE;
+        }
+        b->names = temp;
+        b->names_capacity *= 2;
+    }
+    b->names[b->names_count] = symbol;
+    b->slots[symbol] = (uint32_t)b->names_count;
+    return (uint32_t)b->names_count++;
+}
+
+// Compile the term `f`, returns the address of its code or VM_NONE.
+uint32_t bytecode_compile(Bytecode* b, Function* f) {
+    // a term to compile after the current spine, with the operand to patch
+    // with its address (SIZE_MAX for the entry)
+    typedef struct {
+        Function* f;
+        size_t patch;
+    } CompileWork;
+
+    uint32_t entry = VM_NONE;
+    bool ok = true;
+
+    CompileWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(CompileWork), local, WORK_STACK_LOCAL);
+    CompileWork first = {f, SIZE_MAX};
+    work_stack_push(&stack, &first);
+
+    while (ok && stack.count > 0) {
+        CompileWork work = *(CompileWork*)work_stack_pop(&stack);
+        if (work.patch == SIZE_MAX) {
+            entry = (uint32_t)b->count;
+        } else {
+            b->code[work.patch] = (uint32_t)b->count;
+        }
+
+        for (f = work.f; ok && f != NULL;) {
+            Function* next = NULL;
+            switch (f->kind) {
+                case FUNCTION_LAMBDA:
+                    ok = bytecode_emit(b, VM_GRAB) &&
+                         bytecode_emit(b, f->index == FUNCTION_NO_NAME ? VM_NONE : (uint32_t)f->index);
+                    next = f->body[0];
+                    break;
+
+                case FUNCTION_APPLY:
+                    // ((g a) c): c is pushed first, the first argument ends on top
+                    for (next = f; ok && next->kind == FUNCTION_APPLY; next = next->body[0]) {
+                        ok = bytecode_emit(b, VM_PUSH) && bytecode_emit(b, VM_NONE);
+                        CompileWork arg = {next->body[1], b->count - 1};
+                        ok = ok && work_stack_push(&stack, &arg);
+                    }
+                    break;
+
+                case FUNCTION_VARIABLE:
+                    ok = bytecode_emit(b, VM_ACCESS) && bytecode_emit(b, (uint32_t)f->index);
+                    break;
+
+                case FUNCTION_NAME: {
+                    uint32_t name = bytecode_name(b, f->symbol);
+                    ok = name != VM_NONE && bytecode_emit(b, VM_GLOBAL) && bytecode_emit(b, name);
+                    break;
+                }
+
+                case FUNCTION_BUILTIN: {
+                    uint32_t name = bytecode_name(b, f->symbol);
+                    ok = name != VM_NONE && bytecode_emit(b, VM_BUILTIN) && bytecode_emit(b, name) &&
+                         bytecode_emit(b, VM_NONE);
+                    if (ok && f->body_count > 0) {
+                        CompileWork arg = {f->body[0], b->count - 1};
+                        ok = work_stack_push(&stack, &arg);
+                    }
+                    break;
+                }
+
+                case FUNCTION_BOOLEAN:
+                case FUNCTION_NUMERAL:
+                    // the lambda term of the native value, the code of each
+                    // argument `f^k x` right after its PUSH and ACCESS 1
+                    ok = bytecode_emit(b, VM_GRAB) && bytecode_emit(b, VM_NONE) &&
+                         bytecode_emit(b, VM_GRAB) && bytecode_emit(b, VM_NONE);
+                    for (size_t i = 0; ok && f->kind == FUNCTION_NUMERAL && i < f->index; i++) {
+                        ok = bytecode_emit(b, VM_PUSH) && bytecode_emit(b, (uint32_t)b->count + 3) &&
+                             bytecode_emit(b, VM_ACCESS) && bytecode_emit(b, 1);
+                    }
+                    ok = ok && bytecode_emit(b, VM_ACCESS) &&
+                         bytecode_emit(b, f->kind == FUNCTION_BOOLEAN ? (uint32_t)f->index : 0);
+                    break;
+
+                default:
+                    fprintf(stderr, "Error: Unexpected function in bytecode\n");
+                    ok = false;
+                    break;
+            }
+            f = next;
+        }
+    }
+
+    free_work_stack(&stack);
+    return ok ? entry : VM_NONE;
+}
+
+void free_bytecode(Bytecode* b) {
+    if (b == NULL) return;
+    free(b->code);
+    free(b->names);
+    free(b->slots);
+    free(b->entries);
+    free(b->defines);
+    free(b->definitions);
+    free(b);
+}
+
+// Compile one more statement of the program.
+static inline bool bytecode_add_statement(Bytecode* b, Function* f) {
+    if (b->statements >= b->statements_capacity) {
+        size_t capacity = b->statements_capacity * 2;
+        uint32_t* entries = (uint32_t*)realloc(b->entries, capacity * sizeof(uint32_t));
+        if (entries != NULL) b->entries = entries;
+        uint32_t* defines = (uint32_t*)realloc(b->defines, capacity * sizeof(uint32_t));
+        if (defines != NULL) b->defines = defines;
+        uint32_t* definitions = (uint32_t*)realloc(b->definitions, capacity * sizeof(uint32_t));
+        if (definitions != NULL) b->definitions = definitions;
+        if (entries == NULL || defines == NULL || definitions == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        b->statements_capacity = capacity;
+    }
+
+    size_t i = b->statements;
+    if (f->kind == FUNCTION_DEFINE) {
+        // every definition is added to the Context, in program order
+        b->defines[i] = bytecode_name(b, f->symbol);
+        b->entries[i] = bytecode_compile(b, f->body[0]);
+        if (b->defines[i] == VM_NONE || b->entries[i] == VM_NONE) return false;
+        b->definitions[b->definitions_count++] = b->entries[i];
+    } else {
+        b->defines[i] = VM_NONE;
+        b->entries[i] = bytecode_compile(b, f);
+        if (b->entries[i] == VM_NONE) return false;
+    }
+    b->statements++;
+    return true;
+}
+
+// Drop the code and the names added after `count` and `names_count`.
+static inline void bytecode_truncate(Bytecode* b, size_t count, size_t names_count) {
+    for (size_t i = names_count; i < b->names_count; i++) {
+        b->slots[b->names[i]] = VM_NONE;
+    }
+    b->count = count;
+    b->names_count = names_count;
+}
+
+Bytecode* new_bytecode(Function** program, size_t functions) {
+    Bytecode* b = (Bytecode*)malloc(sizeof(Bytecode));
+    if (b == NULL) return NULL;
+
+    b->count = b->names_count = b->definitions_count = 0;
+    b->statements = 0;
+    b->statements_capacity = functions + 1;
+    b->native = NULL;
+    b->capacity = 1024;
+    b->names_capacity = 16;
+    b->slots = NULL;
+    b->slots_capacity = 0;
+    b->code = (uint32_t*)malloc(b->capacity * sizeof(uint32_t));
+    b->names = (uint32_t*)malloc(b->names_capacity * sizeof(uint32_t));
+    b->entries = (uint32_t*)malloc(b->statements_capacity * sizeof(uint32_t));
+    b->defines = (uint32_t*)malloc(b->statements_capacity * sizeof(uint32_t));
+    b->definitions = (uint32_t*)malloc(b->statements_capacity * sizeof(uint32_t));
+
+    if (b->code == NULL || b->names == NULL || b->entries == NULL || b->defines == NULL || b->definitions == NULL) {
+        free_bytecode(b);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < functions; i++) {
+        if (!bytecode_add_statement(b, program[i])) {
+            free_bytecode(b);
+            return NULL;
+        }
+    }
+    return b;
+}
+
+typedef struct VMEnv VMEnv;
+
+// Code with the environment of its free variables. A closure without code
+// is a variable of the read back, bound `level` lambdas deep.
+typedef struct VMClosure {
+    uint32_t pc;
+    VMEnv* env;
+    size_t level;
+} VMClosure;
+
+struct VMEnv {
+    VMClosure* value;
+    VMEnv* next;
+};
+
+typedef struct {
+    VMClosure* closure;
+    bool update;
+} VMFrame;
+
+// see MachineRead
+typedef struct {
+    Read_Kind kind;
+    uint32_t pc; // also the lambda or the builtin being read
+    VMEnv* env;
+    size_t depth;
+    size_t base, next; // READ_ARGS: the arguments not read yet
+} VMRead;
+
+// where the code and the names of a builtin result start
+typedef struct {
+    size_t code, names;
+} VMResult;
+
+typedef struct VM {
+    Runtime* runtime;
+    Bytecode* bytecode;
+    size_t code_count, names_count; // the bytecode of the program
+
+    MachineBlock* blocks;
+
+    VMFrame* stack; // the next argument on top
+    size_t stack_count, stack_capacity;
+
+    VMClosure** globals; // thunks of the definitions, by Context index
+    size_t globals_count;
+
+    VMResult* results; // the builtin results compiled after the program
+    size_t results_count, results_capacity;
+
+    MachineReads* reads; // of VMRead
+    size_t allocated, collect_at; // bytes in the blocks, see vm_collect
+} VM;
+
+VM* new_vm(Runtime* runtime) {
+    VM* vm = (VM*)malloc(sizeof(VM));
+    if (vm == NULL) return NULL;
+
+    Bytecode* b = runtime->bytecode;
+    vm->runtime = runtime;
+    vm->bytecode = b;
+    vm->code_count = b->count;
+    vm->names_count = b->names_count;
+    vm->blocks = NULL;
+    vm->stack_count = 0;
+    vm->stack_capacity = 64;
+    vm->stack = (VMFrame*)malloc(vm->stack_capacity * sizeof(VMFrame));
+    vm->results_count = 0;
+    vm->results_capacity = 8;
+    vm->results = (VMResult*)malloc(vm->results_capacity * sizeof(VMResult));
+    vm->globals_count = runtime->context->count;
+    vm->globals = (VMClosure**)calloc(vm->globals_count + 1, sizeof(VMClosure*));
+    vm->reads = NULL;
+    vm->allocated = 0;
+    vm->collect_at = MACHINE_COLLECT_MIN;
+
+    if (vm->stack == NULL || vm->results == NULL || vm->globals == NULL) {
+        free(vm->stack);
+        free(vm->results);
+        free(vm->globals);
+        free(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+void free_vm(VM* vm) {
+    if (vm == NULL) return;
+
+    // the code of the builtin results is dropped with them
+    bytecode_truncate(vm->bytecode, vm->code_count, vm->names_count);
+
+    free_machine_blocks(vm->blocks);
+    free(vm->results);
+    free(vm->stack);
+    free(vm->globals);
+    free(vm);
+}
+
+static inline void* vm_alloc(VM* vm, size_t size) {
+    vm->allocated += size;
+    return machine_block_alloc(&vm->blocks, size);
+}
+
+static inline VMClosure* vm_new_closure(VM* vm, uint32_t pc, VMEnv* env, size_t level) {
+    VMClosure* c = (VMClosure*)vm_alloc(vm, sizeof(VMClosure));
+    if (c == NULL) return NULL;
+
+    c->pc = pc;
+    c->env = env;
+    c->level = level;
+    return c;
+}
+
+static inline VMEnv* vm_new_env(VM* vm, VMClosure* value, VMEnv* next) {
+    VMEnv* e = (VMEnv*)vm_alloc(vm, sizeof(VMEnv));
+    if (e == NULL) return NULL;
+
+    e->value = value;
+    e->next = next;
+    return e;
+}
+
+static inline bool vm_push(VM* vm, VMClosure* c, bool update) {
+    if (c == NULL) return false;
+
+    if (vm->stack_count >= vm->stack_capacity) {
+        VMFrame* temp = (VMFrame*)realloc(vm->stack, vm->stack_capacity * 2 * sizeof(VMFrame));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        vm->stack = temp;
+        vm->stack_capacity *= 2;
+    }
+
+    vm->stack[vm->stack_count].closure = c;
+    vm->stack[vm->stack_count].update = update;
+    vm->stack_count++;
+    return true;
+}
+
+// see machine_drop_updates
+static inline void vm_drop_updates(VM* vm, size_t base) {
+    size_t count = base;
+    for (size_t i = base; i < vm->stack_count; i++) {
+        if (!vm->stack[i].update) vm->stack[count++] = vm->stack[i];
+    }
+    vm->stack_count = count;
+}
+
+// the code of a builtin result starts here
+static inline bool vm_add_result(VM* vm) {
+    if (vm->results_count >= vm->results_capacity) {
+        VMResult* temp = (VMResult*)realloc(vm->results, vm->results_capacity * 2 * sizeof(VMResult));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        vm->results = temp;
+        vm->results_capacity *= 2;
+    }
+
+    VMResult result = {vm->bytecode->count, vm->bytecode->names_count};
+    vm->results[vm->results_count++] = result;
+    return true;
+}
+
+/*
+   The collector of the machine (see machine_collect) on the closures and
+   environments of the VM. The roots are the stack, the definitions, the
+   environment being run and the read backs in progress. A moved closure
+   has VM_MOVED as code and its copy as environment, a moved environment has
+   vm_moved_env as value and its copy as next.
+
+   The code of the builtin results is dropped from the last one no closure,
+   read back or running code points into anymore. A result is compiled at
+   the end of the code and only jumps inside of itself.
+*/
+
+#define VM_MOVED (VM_NONE - 1)
+
+static VMClosure vm_moved_env;
+
+typedef struct {
+    VM* vm;
+    WorkStack scan; // MachineMove, the copies pointing to the old blocks
+    size_t end; // the code still used ends before
+    bool ok;
+} VMCollector;
+
+static inline void vm_keep_code(VMCollector* c, uint32_t pc) {
+    if (pc != VM_NONE && pc >= c->end) c->end = (size_t)pc + 1;
+}
+
+static inline VMClosure* vm_move_closure(VMCollector* c, VMClosure* closure) {
+    if (closure == NULL) return NULL;
+    if (closure->pc == VM_MOVED) return (VMClosure*)closure->env;
+
+    VMClosure* copy = (VMClosure*)vm_alloc(c->vm, sizeof(VMClosure));
+    MachineMove move = {copy, false};
+    if (copy == NULL || !work_stack_push(&c->scan, &move)) {
+        c->ok = false;
+        return closure;
+    }
+    *copy = *closure;
+    vm_keep_code(c, copy->pc);
+    closure->pc = VM_MOVED;
+    closure->env = (VMEnv*)copy;
+    return copy;
+}
+
+static inline VMEnv* vm_move_env(VMCollector* c, VMEnv* env) {
+    if (env == NULL) return NULL;
+    if (env->value == &vm_moved_env) return env->next;
+
+    VMEnv* copy = (VMEnv*)vm_alloc(c->vm, sizeof(VMEnv));
+    MachineMove move = {copy, true};
+    if (copy == NULL || !work_stack_push(&c->scan, &move)) {
+        c->ok = false;
+        return env;
+    }
+    *copy = *env;
+    env->value = &vm_moved_env;
+    env->next = copy;
+    return copy;
+}
+
+// Collect the blocks and the code of the builtin results, `pc` and `env` are
+// what vm_whnf is running.
+static inline bool vm_collect(VM* vm, uint32_t pc, VMEnv** env) {
+    VMCollector c = {vm, {0}, vm->code_count, true};
+    MachineMove local[WORK_STACK_LOCAL];
+    work_stack_init(&c.scan, sizeof(MachineMove), local, WORK_STACK_LOCAL);
+
+    MachineBlock* from = vm->blocks;
+    vm->blocks = NULL;
+    vm->allocated = 0;
+
+    *env = vm_move_env(&c, *env);
+    vm_keep_code(&c, pc);
+    for (size_t i = 0; i < vm->stack_count; i++) {
+        vm->stack[i].closure = vm_move_closure(&c, vm->stack[i].closure);
+    }
+    for (size_t i = 0; i < vm->globals_count; i++) {
+        vm->globals[i] = vm_move_closure(&c, vm->globals[i]);
+    }
+    for (MachineReads* r = vm->reads; r != NULL; r = r->next) {
+        for (size_t i = 0; i < r->stack->count; i++) {
+            VMRead* read = (VMRead*)(r->stack->items + i * r->stack->size);
+            read->env = vm_move_env(&c, read->env);
+            if (read->kind == READ_TERM || read->kind == READ_LAMBDA || read->kind == READ_BUILTIN) {
+                vm_keep_code(&c, read->pc);
+            }
+        }
+    }
+
+    while (c.ok && c.scan.count > 0) {
+        MachineMove move = *(MachineMove*)work_stack_pop(&c.scan);
+        if (move.env) {
+            VMEnv* e = (VMEnv*)move.copy;
+            e->value = vm_move_closure(&c, e->value);
+            e->next = vm_move_env(&c, e->next);
         } else {
-            free(token);
+            VMClosure* closure = (VMClosure*)move.copy;
+            closure->env = vm_move_env(&c, closure->env);
+        }
+    }
+    free_work_stack(&c.scan);
+
+    if (!c.ok) {
+        // the old blocks are still pointed to, they are freed with the VM
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        MachineBlock** last = &vm->blocks;
+        while (*last != NULL) last = &(*last)->next;
+        *last = from;
+        return false;
+    }
+    free_machine_blocks(from);
+
+    // the results after the last one still used
+    size_t kept = vm->results_count;
+    while (kept > 0 && vm->results[kept - 1].code >= c.end) kept--;
+    if (kept < vm->results_count) {
+        bytecode_truncate(vm->bytecode, vm->results[kept].code, vm->results[kept].names);
+        vm->results_count = kept;
+    }
+
+    vm->collect_at = 2 * vm->allocated > MACHINE_COLLECT_MIN ? 2 * vm->allocated : MACHINE_COLLECT_MIN;
+    return true;
+}
+
+Function* vm_normalize(VM* vm, uint32_t pc, VMEnv* env, size_t depth); // forward declaration
+
+// The instructions, shared by vm_whnf and the code compiled to C. They
+// return true when the weak head normal form is reached: `*result` is then
+// the head, or NULL on error.
+
+static inline bool vm_grab(VM* vm, uint32_t pc, VMEnv** env, size_t base, VMClosure** result) {
+    if (vm->allocated >= vm->collect_at && !vm_collect(vm, pc, env)) {
+        *result = NULL;
+        return true;
+    }
+
+    while (vm->stack_count > base && vm->stack[vm->stack_count - 1].update) {
+        VMClosure* thunk = vm->stack[--vm->stack_count].closure;
+        thunk->pc = pc;
+        thunk->env = *env;
+    }
+    if (vm->stack_count == base) {
+        *result = vm_new_closure(vm, pc, *env, 0);
+        return true;
+    }
+
+    *env = vm_new_env(vm, vm->stack[--vm->stack_count].closure, *env);
+    *result = NULL;
+    return *env == NULL;
+}
+
+// PUSH at `pc`: push the code `arg` with the environment, once the
+// collector had its turn. A variable is passed as the closure it is bound
+// to, see the applications of machine_whnf.
+static inline bool vm_push_arg(VM* vm, uint32_t pc, uint32_t arg, VMEnv** env) {
+    if (vm->allocated >= vm->collect_at && !vm_collect(vm, pc, env)) return false;
+
+    const uint32_t* code = vm->bytecode->code;
+    VMEnv* e = *env;
+    for (uint32_t i = 0; code[arg] == VM_ACCESS && i < code[arg + 1] && e != NULL; i++) {
+        e = e->next;
+    }
+    bool bound = code[arg] == VM_ACCESS && e != NULL && e->value->pc != VM_NONE;
+    return vm_push(vm, bound ? e->value : vm_new_closure(vm, arg, *env, 0), false);
+}
+
+// force the thunk `c`, see machine_force
+static inline bool vm_enter(VM* vm, VMClosure* c, uint32_t* pc, VMEnv** env, size_t base, VMClosure** result) {
+    if (c->pc == VM_NONE) {
+        vm_drop_updates(vm, base);
+        *result = c;
+        return true;
+    }
+    if (vm->bytecode->code[c->pc] != VM_GRAB && !vm_push(vm, c, true)) {
+        *result = NULL;
+        return true;
+    }
+    *pc = c->pc;
+    *env = c->env;
+    return false;
+}
+
+static inline bool vm_access(VM* vm, uint32_t index, uint32_t* pc, VMEnv** env, size_t base, VMClosure** result) {
+    VMEnv* e = *env;
+    for (; index > 0 && e != NULL; index--) {
+        e = e->next;
+    }
+    if (e == NULL) {
+        fprintf(stderr, "Error: Unbound variable in VM\n");
+        *result = NULL;
+        return true;
+    }
+    return vm_enter(vm, e->value, pc, env, base, result);
+}
+
+static inline bool vm_global(VM* vm, uint32_t name, uint32_t* pc, VMEnv** env, size_t base, VMClosure** result) {
+    // the names added by the builtin results are free
+    size_t i = name < vm->names_count ? runtime_definition(vm->runtime, vm->bytecode->names[name]) : vm->globals_count;
+    if (i >= vm->globals_count) {
+        vm_drop_updates(vm, base);
+        *result = vm_new_closure(vm, *pc, *env, 0);
+        return true;
+    }
+
+    if (vm->globals[i] == NULL) {
+        vm->globals[i] = vm_new_closure(vm, vm->bytecode->definitions[i], NULL, 0);
+        if (vm->globals[i] == NULL) {
+            *result = NULL;
+            return true;
         }
     }
+    return vm_enter(vm, vm->globals[i], pc, env, base, result);
+}
 
-    struct LexerLexTuple tuple;
-    tuple.array = array;
-    tuple.counter = counter;
+static inline bool vm_builtin(VM* vm, struct Builtin* builtin, uint32_t* pc, VMEnv** env, size_t base, size_t depth, VMClosure** result) {
+    *result = NULL;
+    size_t first = vm->stack_count, count = 1;
+    for (; builtin != NULL && first > base && count < builtin->arity; first--) {
+        if (!vm->stack[first - 1].update) count++;
+    }
+    if (depth > 0 || builtin == NULL || count < builtin->arity) {
+        vm_drop_updates(vm, base);
+        *result = vm_new_closure(vm, *pc, *env, 0);
+        return true;
+    }
 
-    return tuple;
+    // see the builtins of machine_whnf, the arguments are in normal form
+    vm_drop_updates(vm, first);
+    Function* args[BUILTIN_ARGS_MAX];
+    uint32_t arg_pc = vm->bytecode->code[*pc + 2];
+    bool ok = true;
+    count = 0;
+    for (size_t i = 0; ok && i < builtin->arity; i++) {
+        VMClosure* c = i > 0 ? vm->stack[vm->stack_count - i].closure : NULL;
+        args[count] = i > 0 ? vm_normalize(vm, c->pc, c->env, 0)
+                            : (arg_pc != VM_NONE ? vm_normalize(vm, arg_pc, *env, 0) : NULL);
+        ok = args[count++] != NULL || (i == 0 && arg_pc == VM_NONE);
+    }
+    if (!ok) {
+        for (size_t i = 0; i + 1 < count; i++) free_function(args[i]);
+        return true;
+    }
+    vm->stack_count -= builtin->arity - 1;
+
+    Function* f = builtin->func(vm->runtime, builtin->user, args);
+    if (f == NULL) return true;
+
+    // the result is compiled after the program, see vm_collect
+    *pc = vm_add_result(vm) ? bytecode_compile(vm->bytecode, f) : VM_NONE;
+    free_function(f);
+    *env = NULL;
+    return *pc == VM_NONE;
 }
 
-static inline void free_tokens(Token** tokens, size_t count) {
-    if (tokens == NULL) return;
-    for (size_t i = 0; i < count; i++) {
-        if (tokens[i] != NULL) {
-            free((void*)tokens[i]->value);
-            free(tokens[i]);
-        }
+// see machine_whnf
+VMClosure* vm_whnf(VM* vm, uint32_t pc, VMEnv* env, size_t base, size_t depth) {
+    const uint32_t* code = vm->bytecode->code;
+    VMClosure* c;
+
+#ifdef VM_COMPUTED_GOTO
+    static void* dispatch[] = {&&op_grab, &&op_push, &&op_access, &&op_global, &&op_builtin};
+#define VM_NEXT() goto *dispatch[code[pc]]
+#else
+#define VM_NEXT() goto op_dispatch
+op_dispatch:
+    switch ((VM_Opcode)code[pc]) {
+        case VM_GRAB: goto op_grab;
+        case VM_PUSH: goto op_push;
+        case VM_ACCESS: goto op_access;
+        case VM_GLOBAL: goto op_global;
+        case VM_BUILTIN: goto op_builtin;
     }
-    free(tokens);
-}
+    fprintf(stderr, "Error: Unexpected instruction in VM\n");
+    return NULL;
+#endif
 
-/*
-   3. Half Parser
+    VM_NEXT();
 
-   Grammar:
-    program      ::= statement*
-    statement    ::= comment | definition | builtin_call
-    comment      ::= "#" [^\n]* "\n"
-    definition   ::= identifier "=" expression
-    builtin_call ::= ":" identifier expression*
-    expression   ::= identifier | lambda | application | "(" expression ")"
-    lambda       ::= "\" identifier "." expression
-    application  ::= expression expression
-    identifier   ::= [a-zA-Z_][a-zA-Z0-9_]*
-*/
+op_grab:
+    if (vm_grab(vm, pc, &env, base, &c)) return c;
+    pc += 2;
+    VM_NEXT();
 
-typedef struct {
-    Token** array;
-    size_t array_size, pos, functions;
-} Parser;
+op_push:
+    if (!vm_push_arg(vm, pc, code[pc + 1], &env)) return NULL;
+    pc += 2;
+    VM_NEXT();
 
-Parser* new_parser(Token** array, size_t array_size) {
-    Parser* p = malloc(sizeof(Parser));
-    if (p == NULL) return NULL;
+op_access:
+    if (vm_access(vm, code[pc + 1], &pc, &env, base, &c)) return c;
+    VM_NEXT();
 
-    p->array = array;
-    p->array_size = array_size;
-    p->pos = 0;
-    p->functions = 0;
-    return p;
+op_global:
+    if (vm_global(vm, code[pc + 1], &pc, &env, base, &c)) return c;
+    VM_NEXT();
+
+op_builtin:
+    if (vm_builtin(vm, runtime_find_builtin(vm->runtime, vm->bytecode->names[code[pc + 1]]), &pc, &env, base, depth, &c)) return c;
+    code = vm->bytecode->code;
+    VM_NEXT();
+
+#undef VM_NEXT
 }
 
-void parser_error(Parser* p, const char* msg) {
-    printf("Parser error at line %zu, row %zu: %s\n", p->array[p->pos]->line+1, p->array[p->pos]->row+1, msg);
+// run one instruction, for the code added after the native code
+static inline bool vm_step(VM* vm, uint32_t* pc, VMEnv** env, size_t base, size_t depth, VMClosure** result) {
+    const uint32_t* code = vm->bytecode->code;
+    switch ((VM_Opcode)code[*pc]) {
+        case VM_GRAB:
+            if (vm_grab(vm, *pc, env, base, result)) return true;
+            *pc += 2;
+            return false;
+
+        case VM_PUSH:
+            if (!vm_push_arg(vm, *pc, code[*pc + 1], env)) {
+                *result = NULL;
+                return true;
+            }
+            *pc += 2;
+            return false;
+
+        case VM_ACCESS:
+            return vm_access(vm, code[*pc + 1], pc, env, base, result);
+
+        case VM_GLOBAL:
+            return vm_global(vm, code[*pc + 1], pc, env, base, result);
+
+        case VM_BUILTIN:
+            return vm_builtin(vm, runtime_find_builtin(vm->runtime, vm->bytecode->names[code[*pc + 1]]), pc, env, base, depth, result);
+    }
+    fprintf(stderr, "Error: Unexpected instruction in VM\n");
+    *result = NULL;
+    return true;
 }
 
-bool parser_except(Parser* p, int type) {
-    if (p->array[p->pos]->type == type) return true;
-    return false;
+static inline VMClosure* vm_eval(VM* vm, uint32_t pc, VMEnv* env, size_t base, size_t depth) {
+    if (vm->bytecode->native != NULL) return vm->bytecode->native(vm, pc, env, base, depth);
+    return vm_whnf(vm, pc, env, base, depth);
 }
 
-bool parser_except_error(Parser* p, int type) {
-    if (parser_except(p, type)) return true;
-    char msg[128];
-    snprintf(msg, sizeof(msg), "unexpected symbol '%s'", p->array[p->pos]->value);
-    parser_error(p, msg);
-    return false;
+// see machine_normalize
+Function* vm_normalize(VM* vm, uint32_t pc, VMEnv* env, size_t depth) {
+    InternTable* t = vm->runtime->interned;
+    FunctionPool* pool = vm->runtime->pool;
+    size_t first_base = vm->stack_count;
+    bool ok = true;
+
+    VMRead local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(VMRead), local, WORK_STACK_LOCAL);
+    Function* local_values[WORK_STACK_LOCAL];
+    WorkStack values;
+    work_stack_init(&values, sizeof(Function*), local_values, WORK_STACK_LOCAL);
+
+    VMRead first = {READ_TERM, pc, env, depth, 0, 0};
+    work_stack_push(&stack, &first);
+    MachineReads reads = {&stack, vm->reads};
+    vm->reads = &reads;
+
+    while (ok && stack.count > 0) {
+        VMRead work = *(VMRead*)work_stack_pop(&stack);
+        const uint32_t* code = vm->bytecode->code;
+
+        if (work.kind == READ_ARGS) {
+            // the first argument is on top of the stack
+            if (work.next == work.base) {
+                vm->stack_count = work.base;
+                continue;
+            }
+            VMClosure* c = vm->stack[work.next - 1].closure;
+            VMRead rest = {READ_ARGS, 0, NULL, work.depth, work.base, work.next - 1};
+            VMRead apply = {READ_APPLY, 0, NULL, work.depth, 0, 0};
+            VMRead arg = {READ_TERM, c->pc, c->env, work.depth, 0, 0};
+            ok = work_stack_push(&stack, &rest) && work_stack_push(&stack, &apply) && work_stack_push(&stack, &arg);
+            continue;
+        }
+        if (work.kind == READ_LAMBDA) {
+            uint32_t slot = code[work.pc + 1];
+            ok = read_combine(t, pool, &values, READ_LAMBDA, slot == VM_NONE ? FUNCTION_NO_NAME : slot, FUNCTION_NO_SYMBOL);
+            continue;
+        }
+        if (work.kind != READ_TERM) {
+            ok = read_combine(t, pool, &values, work.kind, 0, work.kind == READ_BUILTIN ? vm->bytecode->names[code[work.pc + 1]] : FUNCTION_NO_SYMBOL);
+            continue;
+        }
+
+        size_t base = vm->stack_count;
+        VMClosure* head = vm_eval(vm, work.pc, work.env, base, work.depth);
+        if (head == NULL) {
+            ok = false;
+            break;
+        }
+        if (vm->stack_count > base) {
+            VMRead args = {READ_ARGS, 0, NULL, work.depth, base, vm->stack_count};
+            ok = work_stack_push(&stack, &args);
+        }
+
+        code = vm->bytecode->code;
+        Function* result = NULL;
+        if (head->pc == VM_NONE) {
+            result = new_variable(t, pool, work.depth - 1 - head->level);
+        } else if (code[head->pc] == VM_GRAB) {
+            VMEnv* inner = vm_new_env(vm, vm_new_closure(vm, VM_NONE, NULL, work.depth), head->env);
+            VMRead lambda = {READ_LAMBDA, head->pc, NULL, work.depth, 0, 0};
+            VMRead body = {READ_TERM, head->pc + 2, inner, work.depth + 1, 0, 0};
+            ok = ok && inner != NULL && work_stack_push(&stack, &lambda) && work_stack_push(&stack, &body);
+            continue;
+        } else if (code[head->pc] == VM_GLOBAL) {
+            result = intern_function(t, pool, FUNCTION_NAME, 0, vm->bytecode->names[code[head->pc + 1]], NULL, 0);
+        } else if (code[head->pc + 2] == VM_NONE) {
+            result = intern_function(t, pool, FUNCTION_BUILTIN, 0, vm->bytecode->names[code[head->pc + 1]], NULL, 0);
+        } else {
+            VMRead builtin = {READ_BUILTIN, head->pc, NULL, work.depth, 0, 0};
+            VMRead arg = {READ_TERM, code[head->pc + 2], head->env, work.depth, 0, 0};
+            ok = ok && work_stack_push(&stack, &builtin) && work_stack_push(&stack, &arg);
+            continue;
+        }
+        ok = ok && result != NULL && work_stack_push(&values, &result);
+    }
+
+    vm->reads = reads.next;
+    free_work_stack(&stack);
+    vm->stack_count = first_base;
+    if (!ok) {
+        read_free_values(&values);
+        return NULL;
+    }
+
+    Function* result = *(Function**)work_stack_pop(&values);
+    free_work_stack(&values);
+    return result;
 }
 
-bool parser_end(Parser* p) {
-    if (p->pos >= p->array_size) return true;
-    return false;
+void vm_run(Runtime* runtime, size_t statement) {
+    VM* vm = new_vm(runtime);
+    if (vm == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+
+    vm_eval(vm, runtime->bytecode->entries[statement], NULL, 0, 0);
+    free_vm(vm);
 }
 
-Function* expression(Parser* p, Function** program); // forward declaration - check bellow for 'expression'
+// Compile and run one more statement of a streamed program, the code of a
+// statement that isn't a definition is dropped once it has run.
+void vm_run_statement(Runtime* runtime, Function* f) {
+    if (runtime->bytecode == NULL) runtime->bytecode = new_bytecode(NULL, 0);
+    Bytecode* b = runtime->bytecode;
+    if (b == NULL) {
+        fprintf(stderr, "Error: Bytecode compilation failed\n");
+        return;
+    }
+
+    size_t count = b->count, names_count = b->names_count;
+    if (!bytecode_add_statement(b, f)) {
+        fprintf(stderr, "Error: Bytecode compilation failed\n");
+        bytecode_truncate(b, count, names_count);
+        return;
+    }
+    if (f->kind == FUNCTION_DEFINE) {
+        context_add(runtime->context, f->symbol, NULL);
+    } else {
+        vm_run(runtime, b->statements - 1);
+        b->statements--;
+        bytecode_truncate(b, count, names_count);
+    }
+}
 
-Function* lambda(Parser* p, Function** program) {
-    static size_t lambda_id = 0;
-    size_t my_id = lambda_id++;
+// run the program from its bytecode, `runtime->program` isn't used
+void vm_run_program(Runtime* runtime) {
+    Bytecode* b = runtime->bytecode;
+    for (size_t i = 0; i < b->statements; i++) {
+        runtime->exec_i = i;
+        if (b->defines[i] != VM_NONE) {
+            context_add(runtime->context, b->names[b->defines[i]], NULL);
+        } else {
+            vm_run(runtime, i);
+        }
+    }
+}
 
-    p->pos++;
+/*
+    8. Half C
+
+    `half --emit-c script.hl > script.c` translates the bytecode of a script
+    into C, the result is built against this header:
+        cc -O2 -I path/to/half script.c -o script
+    and runs without lexing, parsing or compiling the script.
+
+    Each instruction becomes a labelled C statement with constant operands,
+    the lambdas fall through to their body and the builtins registered by
+    new_runtime are called directly. Everything is in a single function:
+    the machine enters code by jumps, a C function per definition would grow
+    the C stack with each call. The code added at run time by the builtin
+    results is run by vm_step.
+*/
 
-    if (p->array[p->pos]->type != TOKEN_NAME) {
-        parser_error(p, "Expected parameter name after \\");
+typedef struct {
+    const uint32_t* code;
+    size_t count;
+    const char* const* names;
+    size_t names_count;
+    const uint32_t* entries;
+    const uint32_t* defines;
+    size_t statements;
+    const char* const* lambda_names; // the NameTable of the script, from symbol 1
+    size_t lambda_names_count;
+    VMClosure* (*native)(VM* vm, uint32_t pc, VMEnv* env, size_t base, size_t depth);
+} BytecodeImage;
+
+// The names of the image are interned in `names`.
+Bytecode* new_bytecode_image(const BytecodeImage* image, NameTable* names) {
+    Bytecode* b = (Bytecode*)malloc(sizeof(Bytecode));
+    if (b == NULL) return NULL;
+
+    b->count = image->count;
+    b->capacity = image->count > 512 ? image->count * 2 : 1024;
+    b->names_count = 0;
+    b->names_capacity = image->names_count > 8 ? image->names_count * 2 : 16;
+    b->slots = NULL;
+    b->slots_capacity = 0;
+    b->statements = image->statements;
+    b->statements_capacity = image->statements + 1;
+    b->definitions_count = 0;
+    b->native = image->native;
+    b->code = (uint32_t*)malloc(b->capacity * sizeof(uint32_t));
+    b->names = (uint32_t*)malloc(b->names_capacity * sizeof(uint32_t));
+    b->entries = (uint32_t*)malloc((b->statements + 1) * sizeof(uint32_t));
+    b->defines = (uint32_t*)malloc((b->statements + 1) * sizeof(uint32_t));
+    b->definitions = (uint32_t*)malloc((b->statements + 1) * sizeof(uint32_t));
+
+    if (b->code == NULL || b->names == NULL || b->entries == NULL || b->defines == NULL || b->definitions == NULL) {
+        free_bytecode(b);
         return NULL;
     }
 
-    char* param_name = (char*)p->array[p->pos]->value;
-    p->pos++;
+    memcpy(b->code, image->code, b->count * sizeof(uint32_t));
+    for (size_t i = 0; i < image->names_count; i++) {
+        uint32_t symbol = name_table_add(names, image->names[i]);
+        if (symbol == FUNCTION_NO_SYMBOL || bytecode_name(b, symbol) != i) {
+            free_bytecode(b);
+            return NULL;
+        }
+    }
+    memcpy(b->entries, image->entries, b->statements * sizeof(uint32_t));
+    memcpy(b->defines, image->defines, b->statements * sizeof(uint32_t));
+    for (size_t i = 0; i < b->statements; i++) {
+        if (b->defines[i] != VM_NONE) b->definitions[b->definitions_count++] = b->entries[i];
+    }
+    return b;
+}
 
-    if (p->array[p->pos]->type != TOKEN_DOT) {
-        parser_error(p, "Expected . after parameter name");
-        return NULL;
+// main of the generated programs, the arguments are the input of :read
+int run_bytecode_image(const BytecodeImage* image, int argc, char* argv[]) {
+    // added in order, the names get back the symbols of the script
+    NameTable* names = new_name_table();
+    for (size_t i = 0; names != NULL && i < image->lambda_names_count; i++) {
+        name_table_add(names, image->lambda_names[i]);
     }
-    p->pos++;
 
-    Function* body = expression(p, program);
+    struct ParserParseTuple parsed = {NULL, 0, names, NULL, new_function_pool(NULL, NULL, NULL), NULL, 0, 0};
+    Runtime* rtm = new_runtime(parsed);
+    if (rtm == NULL) return 1;
 
-    if (body == NULL) {
-        return NULL;
+    rtm->engine = RUNTIME_VM;
+    rtm->bytecode = new_bytecode_image(image, rtm->names);
+    if (rtm->bytecode == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_runtime(rtm);
+        return 1;
     }
 
-    Function* body_array[1] = {body};
-    Function* lambda_func = new_function(my_id, param_name, body_array, 1);
+    char* input = join_arguments(argc - 1, argv + 1);
+    if (input != NULL) runtime_input_memory(rtm, input, strlen(input));
 
-    return lambda_func;
+    runtime_run(rtm);
+    free_runtime(rtm);
+    free(input);
+    return 0;
 }
 
-Function* expression(Parser* p, Function** program) {
-    if (parser_end(p)) {
-        return NULL;
+static inline void emit_c_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        unsigned char ch = (unsigned char)*s;
+        if (ch == '"' || ch == '\\') {
+            fprintf(out, "\\%c", ch);
+        } else if (ch < 32 || ch >= 127) {
+            fprintf(out, "\\%03o", ch);
+        } else {
+            fputc(ch, out);
+        }
     }
+    fputc('"', out);
+}
 
-    Token* current = p->array[p->pos];
+static inline void emit_c_array(FILE* out, const char* declaration, const uint32_t* values, size_t count) {
+    fprintf(out, "static const uint32_t %s[] = {", declaration);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, i % 16 == 0 ? "\n    " : " ");
+        if (values[i] == VM_NONE) {
+            fprintf(out, "VM_NONE,");
+        } else {
+            fprintf(out, "%u,", (unsigned)values[i]);
+        }
+    }
+    // an empty initializer isn't valid C
+    fprintf(out, count == 0 ? "0};\n\n" : "\n};\n\n");
+}
 
-    switch(current->type) {
-        case TOKEN_NAME: {
-            char* var_name = (char*)current->value;
-            p->pos++;
+static inline void emit_c_strings(FILE* out, const char* declaration, const char* const* values, size_t count) {
+    fprintf(out, "static const char* const %s[] = {\n", declaration);
+    for (size_t i = 0; i < count; i++) {
+        fprintf(out, "    ");
+        emit_c_string(out, values[i]);
+        fprintf(out, ",\n");
+    }
+    fprintf(out, count == 0 ? "    NULL\n};\n\n" : "};\n\n");
+}
 
-            if (!parser_end(p) &&
-                (p->array[p->pos]->type == TOKEN_NAME ||
-                 p->array[p->pos]->type == TOKEN_LAMBDA ||
-                 p->array[p->pos]->type == TOKEN_OPAREN)) {
+// the builtins of new_runtime, called without looking them up
+static const char* const emit_c_builtins[] = {"show", "showbyte", "read", "readbyte", "ast"};
 
-                Function* fn = new_function(p->functions, var_name, NULL, 0);
-                Function* arg = expression(p, program);
+void bytecode_emit_c(Bytecode* b, NameTable* names, FILE* out) {
+    const uint32_t* code = b->code;
+
+    fprintf(out, "// generated by half --emit-c\n");
+    fprintf(out, "#include \"libhalf.h\"\n\n");
+
+    emit_c_array(out, "half_code", code, b->count);
+    size_t lambda_names = names != NULL ? names->count - 1 : 0;
+    size_t strings_count = b->names_count > lambda_names ? b->names_count : lambda_names;
+    const char** strings = (const char**)malloc((strings_count + 1) * sizeof(const char*));
+    if (strings == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return;
+    }
+    for (size_t i = 0; i < b->names_count; i++) {
+        strings[i] = function_symbol_name(names, b->names[i]);
+    }
+    emit_c_strings(out, "half_names", strings, b->names_count);
+    emit_c_array(out, "half_entries", b->entries, b->statements);
+    emit_c_array(out, "half_defines", b->defines, b->statements);
+    for (size_t i = 0; i < lambda_names; i++) {
+        strings[i] = name_table_get(names, i + 1);
+    }
+    emit_c_strings(out, "half_lambda_names", strings, lambda_names);
+    free(strings);
 
-                if (arg == NULL) return NULL;
+    for (size_t i = 0; i < sizeof(emit_c_builtins) / sizeof(emit_c_builtins[0]); i++) {
+        bool used = false;
+        for (size_t pc = 0; pc < b->count; pc += code[pc] == VM_BUILTIN ? 3 : 2) {
+            if (code[pc] == VM_BUILTIN && strcmp(function_symbol_name(names, b->names[code[pc + 1]]), emit_c_builtins[i]) == 0) used = true;
+        }
+        if (used) {
+            fprintf(out, "static struct Builtin half_builtin_%s = {FUNCTION_NO_SYMBOL, 1, BUILTIN_STRICT, %s_builtin, NULL};\n",
+                    emit_c_builtins[i], emit_c_builtins[i]);
+        }
+    }
 
-                Function* app_body[2] = {fn, arg};
-                Function* app = new_function(p->functions, NULL, app_body, 2);
-                return app;
+    fprintf(out, "\nstatic VMClosure* half_native(VM* vm, uint32_t pc, VMEnv* env, size_t base, size_t depth) {\n");
+    fprintf(out, "    VMClosure* c;\n");
+    fprintf(out, "    (void)depth;\n\n");
+    fprintf(out, "dispatch:\n");
+    fprintf(out, "    switch (pc) {\n");
+    for (size_t pc = 0; pc < b->count; pc += code[pc] == VM_BUILTIN ? 3 : 2) {
+        fprintf(out, "        case %zu: goto L%zu;\n", pc, pc);
+    }
+    fprintf(out, "        default:\n");
+    fprintf(out, "            if (vm_step(vm, &pc, &env, base, depth, &c)) return c;\n");
+    fprintf(out, "            goto dispatch;\n");
+    fprintf(out, "    }\n");
+
+    size_t definition = 0;
+    for (size_t pc = 0; pc < b->count; pc += code[pc] == VM_BUILTIN ? 3 : 2) {
+        for (size_t i = 0; i < b->statements; i++) {
+            if (b->entries[i] != pc) continue;
+            if (b->defines[i] != VM_NONE) {
+                fprintf(out, "\n    // %s, definition %zu\n", function_symbol_name(names, b->names[b->defines[i]]), definition++);
             } else {
-                return new_function(p->functions, var_name, NULL, 0);
+                fprintf(out, "\n    // statement %zu\n", i);
             }
         }
 
-        case TOKEN_LAMBDA:
-            return lambda(p, program);
+        fprintf(out, "L%zu:\n", pc);
+        switch ((VM_Opcode)code[pc]) {
+            case VM_GRAB:
+                fprintf(out, "    if (vm_grab(vm, %zu, &env, base, &c)) return c;\n", pc);
+                break;
+
+            case VM_PUSH:
+                fprintf(out, "    if (!vm_push_arg(vm, %zu, %u, &env)) return NULL;\n", pc, (unsigned)code[pc + 1]);
+                break;
 
-        case TOKEN_OPAREN: {
-            p->pos++;
-            Function* expr = expression(p, program);
+            case VM_ACCESS:
+                fprintf(out, "    if (vm_access(vm, %u, &pc, &env, base, &c)) return c;\n", (unsigned)code[pc + 1]);
+                fprintf(out, "    goto dispatch;\n");
+                break;
 
-            if (p->array[p->pos]->type != TOKEN_CPAREN) {
-                parser_error(p, "Expected )");
-                return NULL;
+            case VM_GLOBAL:
+                fprintf(out, "    pc = %zu;\n", pc);
+                fprintf(out, "    if (vm_global(vm, %u, &pc, &env, base, &c)) return c;\n", (unsigned)code[pc + 1]);
+                fprintf(out, "    goto dispatch;\n");
+                break;
+
+            case VM_BUILTIN: {
+                const char* name = function_symbol_name(names, b->names[code[pc + 1]]);
+                fprintf(out, "    pc = %zu;\n", pc);
+                bool direct = false;
+                for (size_t i = 0; i < sizeof(emit_c_builtins) / sizeof(emit_c_builtins[0]); i++) {
+                    if (strcmp(emit_c_builtins[i], name) == 0) {
+                        fprintf(out, "    if (vm_builtin(vm, &half_builtin_%s, &pc, &env, base, depth, &c)) return c;\n", name);
+                        direct = true;
+                    }
+                }
+                if (!direct) {
+                    fprintf(out, "    if (vm_builtin(vm, runtime_find_builtin(vm->runtime, vm->bytecode->names[%u]), &pc, &env, base, depth, &c)) return c;\n", (unsigned)code[pc + 1]);
+                }
+                fprintf(out, "    goto dispatch;\n");
+                break;
             }
-            p->pos++;
+        }
+    }
+    fprintf(out, "}\n\n");
+
+    fprintf(out, "static const BytecodeImage half_image = {\n");
+    fprintf(out, "    half_code, sizeof(half_code) / sizeof(half_code[0]) - %d,\n", b->count == 0);
+    fprintf(out, "    half_names, %zu,\n", b->names_count);
+    fprintf(out, "    half_entries, half_defines, %zu,\n", b->statements);
+    fprintf(out, "    half_lambda_names, %zu,\n", lambda_names);
+    fprintf(out, "    half_native,\n");
+    fprintf(out, "};\n\n");
+
+    fprintf(out, "int main(int argc, char* argv[]) {\n");
+    fprintf(out, "    return run_bytecode_image(&half_image, argc, argv);\n");
+    fprintf(out, "}\n");
+}
 
-            // Vérifier si c'est une application (nouvelle partie)
-            if (!parser_end(p) &&
-                (p->array[p->pos]->type == TOKEN_NAME ||
-                p->array[p->pos]->type == TOKEN_LAMBDA ||
-                p->array[p->pos]->type == TOKEN_OPAREN ||
-                p->array[p->pos]->type == TOKEN_COLON)) {
+/*
+    9. Half Optimizer
+
+    runtime_optimize rewrites the program once it is parsed (`--optimize`),
+    before any engine runs it:
+     - a closed definition without builtin is reduced to its normal form,
+       after replacing the names it uses by their own normal form;
+     - the small normal forms replace their name where it is used;
+     - the definitions no statement can reach are dropped.
+    Half is pure, so this only moves the work done by every use of a
+    definition to the load. A name refers to the first definition of it, and
+    only from a statement after this definition: other uses are left alone.
+    A definition keeps its body when its reduction runs out of fuel (see
+    reduce_head) or when its normal form grows too much, like a term losing
+    its sharing.
+*/
 
-                Function* arg = expression(p, program);
-                if (arg == NULL) return expr;
+#define OPTIMIZE_FUEL (1 << 20)  // per definition
+#define OPTIMIZE_GROWTH 4        // normal form size / definition size
+#define OPTIMIZE_INLINE_SIZE 16  // nodes
+
+typedef struct {
+    Context* defs;     // the DEFINE of the first definition of each name
+    size_t* positions; // its program index, by defs index
+    size_t* sizes;     // size of its normal form
+    bool* values;      // its body is a closed normal form
+    bool* live;        // a statement can reach it
+    FunctionPool* pool; // of the Runtime, for the copies
+} Optimizer;
+
+// defs index of the definition `name` refers to from the program index
+// `position`, or SIZE_MAX
+static inline size_t optimize_resolve(Optimizer* o, uint32_t symbol, size_t position) {
+    size_t k = context_find(o->defs, symbol);
+    return (k < o->defs->count && o->positions[k] < position) ? k : SIZE_MAX;
+}
 
-                Function* app_body[2] = {expr, arg};
-                Function* app = new_function(p->functions, NULL, app_body, 2);
-                return app;
+// Whether `f` at `position` is closed once its names are replaced by their
+// normal form: it has no builtin and only uses values. `inlines` counts the
+// names of small values.
+static inline bool optimize_scan(Optimizer* o, Function* f, size_t position, size_t* inlines) {
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+    work_stack_push(&stack, &f);
+
+    bool closed = true;
+    *inlines = 0;
+    while (stack.count > 0) {
+        f = *(Function**)work_stack_pop(&stack);
+        if (f->kind == FUNCTION_BUILTIN) closed = false;
+        if (f->kind == FUNCTION_NAME) {
+            size_t k = optimize_resolve(o, f->symbol, position);
+            if (k == SIZE_MAX || !o->values[k]) {
+                closed = false;
+            } else if (o->sizes[k] <= OPTIMIZE_INLINE_SIZE) {
+                (*inlines)++;
             }
+        }
+        for (size_t i = 0; i < f->body_count; i++) {
+            if (f->body[i] != NULL && !work_stack_push(&stack, &f->body[i])) closed = false;
+        }
+    }
+    free_work_stack(&stack);
+    return closed;
+}
 
-            return expr;
+// Replace in the tree `*root`, which we own, the names of values by a copy
+// of their normal form (only the small ones unless `all`).
+static inline bool optimize_inline(Optimizer* o, Function** root, size_t position, bool all) {
+    Function** local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function**), local, WORK_STACK_LOCAL);
+    work_stack_push(&stack, &root);
+
+    bool ok = true;
+    while (ok && stack.count > 0) {
+        Function** slot = *(Function***)work_stack_pop(&stack);
+        Function* f = *slot;
+        if (f->kind == FUNCTION_NAME) {
+            size_t k = optimize_resolve(o, f->symbol, position);
+            if (k == SIZE_MAX || !o->values[k] || (!all && o->sizes[k] > OPTIMIZE_INLINE_SIZE)) continue;
+
+            Function* value = copy_function(o->pool, o->defs->functions[k]->body[0]);
+            ok = value != NULL;
+            if (ok) {
+                free_function(f);
+                *slot = value;
+            }
+            continue;
         }
+        for (size_t i = 0; ok && i < f->body_count; i++) {
+            Function** child = &f->body[i];
+            if (*child != NULL) ok = work_stack_push(&stack, &child);
+        }
+    }
+    free_work_stack(&stack);
+    return ok;
+}
 
-        case TOKEN_COLON: {
-            p->pos++;
+// replace the Church values of the tree `*root`, which we own, by native ones
+static inline void optimize_tag(FunctionPool* pool, Function** root) {
+    Function** local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function**), local, WORK_STACK_LOCAL);
+    work_stack_push(&stack, &root);
+
+    while (stack.count > 0) {
+        Function** slot = *(Function***)work_stack_pop(&stack);
+        Function* native = church_value(NULL, pool, *slot);
+        if (native != NULL) {
+            free_function(*slot);
+            *slot = native;
+            continue;
+        }
+        for (size_t i = 0; i < (*slot)->body_count; i++) {
+            Function** child = &(*slot)->body[i];
+            if (*child != NULL && !work_stack_push(&stack, &child)) break;
+        }
+    }
+    free_work_stack(&stack);
+}
 
-            if (p->array[p->pos]->type != TOKEN_NAME) {
-                parser_error(p, "Expected builtin name after :");
-                return NULL;
+// Hash-cons the tree `f`, which we own, into `t` (nothing to do without
+// table). `f` is consumed, NULL on failure.
+static inline Function* intern_tree(InternTable* t, Function* f) {
+    if (t == NULL || f == NULL || f->interned) return f;
+
+    typedef struct {
+        Function* f;
+        bool children; // the children are interned, on top of the values
+    } InternWork;
+
+    InternWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(InternWork), local, WORK_STACK_LOCAL);
+    Function* local_values[WORK_STACK_LOCAL];
+    WorkStack values;
+    work_stack_init(&values, sizeof(Function*), local_values, WORK_STACK_LOCAL);
+    InternWork first = {f, false};
+    work_stack_push(&stack, &first);
+
+    bool ok = true;
+    while (ok && stack.count > 0) {
+        InternWork work = *(InternWork*)work_stack_pop(&stack);
+        f = work.f;
+        if (f->interned) {
+            ok = work_stack_push(&values, &f);
+            continue;
+        }
+        if (!work.children) {
+            work.children = true;
+            ok = work_stack_push(&stack, &work);
+            for (size_t i = f->body_count; ok && i > 0; i--) {
+                InternWork child = {f->body[i - 1], false};
+                ok = work_stack_push(&stack, &child);
             }
+            continue;
+        }
 
-            char* builtin_name = (char*)p->array[p->pos]->value;
-            p->pos++;
+        Function* body_array[2] = {NULL, NULL};
+        for (size_t i = f->body_count; i > 0; i--) {
+            body_array[i - 1] = *(Function**)work_stack_pop(&values);
+        }
+        Function* result = intern_function(t, NULL, f->kind, f->index, f->symbol, body_array, f->body_count);
+        f->body_count = 0;
+        free_function(f);
+        ok = result != NULL && work_stack_push(&values, &result);
+    }
 
-            Function* arg = NULL;
-            if (!parser_end(p) &&
-                p->array[p->pos]->type != TOKEN_NEWLINE &&
-                p->array[p->pos]->type != TOKEN_CPAREN) {
-                arg = expression(p, program);
-            }
+    // on failure the nodes left are freed, their interned children stay
+    while (stack.count > 0) {
+        InternWork work = *(InternWork*)work_stack_pop(&stack);
+        if (work.children) work.f->body_count = 0;
+        free_function(work.f);
+    }
+    free_work_stack(&stack);
+    f = ok ? *(Function**)work_stack_pop(&values) : NULL;
+    free_work_stack(&values);
+    return f;
+}
 
-            Function* builtin_func;
-            if (arg != NULL) {
-                Function* body_array[1] = {arg};
-                builtin_func = new_function(p->functions, builtin_name, body_array, 1);
-            } else {
-                builtin_func = new_function(p->functions, builtin_name, NULL, 0);
+// Normalize the definition `k` when it is closed, and otherwise inline the
+// small values it uses.
+static inline void optimize_definition(Optimizer* o, Runtime* rtm, size_t k) {
+    size_t position = o->positions[k];
+    Function* define = o->defs->functions[k];
+    size_t inlines;
+    bool closed = optimize_scan(o, define->body[0], position, &inlines);
+
+    if (closed) {
+        Function* term = copy_function(rtm->pool, define->body[0]);
+        size_t fuel = OPTIMIZE_FUEL;
+        if (term != NULL && optimize_inline(o, &term, position, true)) {
+            size_t size = function_size(term);
+            term = reduce_function_fuel(term, rtm, 0, &fuel);
+            optimize_tag(rtm->pool, &term);
+            size_t result = function_size(term);
+            if (fuel > 0 && result <= size * OPTIMIZE_GROWTH) {
+                term = intern_tree(rtm->interned, term);
+                if (term != NULL) {
+                    free_function(define->body[0]);
+                    define->body[0] = term;
+                    o->values[k] = true;
+                    o->sizes[k] = result;
+                    return;
+                }
             }
-            builtin_func->builtin = true;
-
-            return builtin_func;
         }
+        free_function(term);
+    }
 
-        default: {
-            char msg[128];
-            snprintf(msg, sizeof(msg), "unexpected symbol '%s'", current->value);
-            parser_error(p, msg);
-            return NULL;
+    if (inlines > 0) {
+        Function* term = copy_function(rtm->pool, define->body[0]);
+        if (term != NULL && optimize_inline(o, &term, position, false)) {
+            term = intern_tree(rtm->interned, term);
+            if (term != NULL) {
+                free_function(define->body[0]);
+                define->body[0] = term;
+            }
+            return;
         }
+        free_function(term);
     }
 }
 
-void statement(Parser* p, Function** program) {
-    if (parser_end(p)) return;
-
-    Token* current = p->array[p->pos];
+// the statement `i` with the small values it uses inlined
+static inline void optimize_statement(Optimizer* o, Runtime* rtm, size_t i) {
+    size_t inlines;
+    optimize_scan(o, rtm->program[i], i, &inlines);
+    if (inlines == 0) return;
 
-    switch(current->type) {
-        case TOKEN_NAME: {
-            char* var_name = (char*)current->value;
-            p->pos++;
+    Function* term = copy_function(rtm->pool, rtm->program[i]);
+    if (term != NULL && optimize_inline(o, &term, i, false)) {
+        term = intern_tree(rtm->interned, term);
+        if (term != NULL) {
+            free_function(rtm->program[i]);
+            rtm->program[i] = term;
+        }
+        return;
+    }
+    free_function(term);
+}
 
-            if (!parser_except(p, TOKEN_EQUAL)) {
-                parser_error(p, "Expected = after variable name");
-                return;
-            }
-            p->pos++;
+// mark the definitions reachable from the statements
+static inline bool optimize_mark(Optimizer* o, Runtime* rtm) {
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
 
-            Function* expr_result = expression(p, program);
+    bool ok = true;
+    memset(o->live, 0, o->defs->count * sizeof(bool));
+    for (size_t i = 0; ok && i < rtm->functions; i++) {
+        if (rtm->program[i]->kind != FUNCTION_DEFINE) ok = work_stack_push(&stack, &rtm->program[i]);
+    }
 
-            if (expr_result == NULL) {
-                parser_error(p, "Failed to parse expression");
-                return;
+    while (ok && stack.count > 0) {
+        Function* f = *(Function**)work_stack_pop(&stack);
+        if (f->kind == FUNCTION_NAME) {
+            size_t k = context_find(o->defs, f->symbol);
+            if (k < o->defs->count && !o->live[k]) {
+                o->live[k] = true;
+                ok = work_stack_push(&stack, &o->defs->functions[k]->body[0]);
             }
+            continue;
+        }
+        for (size_t i = 0; ok && i < f->body_count; i++) {
+            if (f->body[i] != NULL) ok = work_stack_push(&stack, &f->body[i]);
+        }
+    }
+    free_work_stack(&stack);
+    return ok;
+}
 
-            Function* named_func = new_function(
-                p->functions,
-                var_name,
-                expr_result->body_count > 0 ? expr_result->body : NULL,
-                expr_result->body_count
-            );
+// Optimize the program of `rtm` before it runs, see "9. Half Optimizer".
+// Returns false when it ran out of memory, the program is still valid.
+bool runtime_optimize(Runtime* rtm) {
+    size_t n = rtm->functions > 0 ? rtm->functions : 1;
+    Optimizer o;
+    o.defs = new_context();
+    o.positions = (size_t*)malloc(n * sizeof(size_t));
+    o.sizes = (size_t*)malloc(n * sizeof(size_t));
+    o.values = (bool*)calloc(n, sizeof(bool));
+    o.live = (bool*)calloc(n, sizeof(bool));
+    o.pool = rtm->pool;
+
+    bool ok = o.defs != NULL && o.positions != NULL && o.sizes != NULL && o.values != NULL && o.live != NULL;
+    for (size_t i = 0; ok && i < rtm->functions; i++) {
+        Function* f = rtm->program[i];
+        if (f->kind == FUNCTION_DEFINE && context_find(o.defs, f->symbol) == o.defs->count) {
+            o.positions[o.defs->count] = i;
+            context_add(o.defs, f->symbol, f);
+        }
+    }
 
-            if (named_func != NULL) {
-                program[p->functions] = named_func;
-                p->functions++;
-            }
+    // the dead definitions aren't worth reducing
+    bool marked = ok && optimize_mark(&o, rtm);
+    for (size_t i = 0; ok && i < rtm->functions; i++) {
+        Function* f = rtm->program[i];
+        if (f->kind != FUNCTION_DEFINE) {
+            optimize_statement(&o, rtm, i);
+            continue;
+        }
+        size_t k = context_find(o.defs, f->symbol);
+        if (o.positions[k] == i && (!marked || o.live[k])) optimize_definition(&o, rtm, k);
+    }
 
-            if (!parser_end(p) && parser_except(p, TOKEN_NEWLINE)) {
-                p->pos++;
+    // the inlined definitions may be dead now, the later definitions of a
+    // name are never used
+    if (ok && optimize_mark(&o, rtm)) {
+        size_t count = 0;
+        for (size_t i = 0; i < rtm->functions; i++) {
+            Function* f = rtm->program[i];
+            if (f->kind == FUNCTION_DEFINE) {
+                size_t k = context_find(o.defs, f->symbol);
+                if (o.positions[k] != i || !o.live[k]) {
+                    free_function(f);
+                    continue;
+                }
             }
-            break;
+            rtm->program[count++] = f;
         }
+        rtm->functions = count;
+    }
 
-        case TOKEN_COLON: {
-            p->pos++;
+    if (!ok) fprintf(stderr, "Error: Memory allocation failed\n");
+    if (o.defs != NULL) free_context(o.defs);
+    free(o.positions);
+    free(o.sizes);
+    free(o.values);
+    free(o.live);
+    return ok;
+}
 
-            if (p->array[p->pos]->type != TOKEN_NAME) {
-                parser_error(p, "Expected builtin name after :");
-                return;
-            }
+/*
+    10. Half Images
+
+    `half --compile script.hl -o script.hlc` saves the program once it is
+    parsed and linked, and `half script.hlc` runs it without lexing, parsing
+    nor linking it again.
+
+    The nodes are stored as an array of Function with the layout of this
+    build, numbered children first: a child is the number of its node plus
+    one (0 for none), always below the number of its parent. Loading maps
+    the file in memory (or reads it in a single buffer when HALF_NO_MMAP is
+    defined) and turns the numbers into pointers in place, there is no
+    allocation per node. The nodes are marked interned: they belong to the
+    image, the engines never modify nor free them. A node shared in the
+    program (with --hash-cons) stays shared. The image only has the names
+    its nodes use, they get the symbols of the runtime loading it.
+
+    `import "path"` loads the module at `path`, relative to the directory of
+    the file importing it, in place of the statement. A module is known by
+    the hash of its text and loaded once in a program. Its image is saved in
+    the cache directory under this hash ($HALF_CACHE, or ~/.cache/half when
+    it isn't set, no cache when it is empty): the next runs map the image
+    instead of parsing the module again, until its text changes. An image
+    failing the checks of runtime_map_hlc is ignored, the module is parsed
+    and the image written again. The image of a module keeps its imports,
+    they are loaded like the ones of a script.
+
+    After the HlcHeader:
+        Function nodes[nodes]
+        uint32_t statements[statements] // node of each statement
+        uint32_t imports[imports]       // statement before which each module goes
+        char names[names_size]          // the names of the symbols 1..names, each ends with '\0'
+        char paths[paths_size]          // the path of each import, each ends with '\0'
+*/
 
-            char* builtin_name = (char*)p->array[p->pos]->value;
-            p->pos++;
+#define HLC_MAGIC 0x32434c48u // "HLC2"
+#define HLC_ENDIAN 0x01020304u
 
-            Function* expr_result = expression(p, program);
+typedef struct {
+    uint32_t magic, endian;
+    uint32_t function_size, pointer_size; // an image is only read by a build with the same layout
+    uint64_t nodes, statements, names, names_size, imports, paths_size;
+} HlcHeader;
+
+// a file mapped in memory, its nodes are used by the program
+typedef struct HlcImage {
+    void* data;
+    size_t size;
+    struct HlcImage* next;
+} HlcImage;
+
+// number of each node of the program, by address
+typedef struct {
+    Function** keys;
+    uint32_t* values;
+    size_t count, capacity; // always a power of 2
+} HlcNumbers;
+
+static inline size_t hlc_numbers_slot(HlcNumbers* n, Function* f) {
+    size_t h = (size_t)(((uintptr_t)f >> 4) * 11400714819323198485ULL) & (n->capacity - 1);
+    while (n->keys[h] != NULL && n->keys[h] != f) h = (h + 1) & (n->capacity - 1);
+    return h;
+}
 
-            if (expr_result == NULL) {
-                parser_error(p, "Failed to parse expression");
-                return;
-            }
+static inline bool hlc_numbers_add(HlcNumbers* n, Function* f, uint32_t value) {
+    if ((n->count + 1) * 10 > n->capacity * 7) {
+        HlcNumbers grown = {NULL, NULL, 0, n->capacity * 2};
+        grown.keys = (Function**)calloc(grown.capacity, sizeof(Function*));
+        grown.values = (uint32_t*)malloc(grown.capacity * sizeof(uint32_t));
+        if (grown.keys == NULL || grown.values == NULL) {
+            free(grown.keys);
+            free(grown.values);
+            return false;
+        }
+        for (size_t i = 0; i < n->capacity; i++) {
+            if (n->keys[i] == NULL) continue;
+            size_t h = hlc_numbers_slot(&grown, n->keys[i]);
+            grown.keys[h] = n->keys[i];
+            grown.values[h] = n->values[i];
+        }
+        grown.count = n->count;
+        free(n->keys);
+        free(n->values);
+        *n = grown;
+    }
+    size_t h = hlc_numbers_slot(n, f);
+    n->keys[h] = f;
+    n->values[h] = value;
+    n->count++;
+    return true;
+}
+
+// the number of `f` plus one, 0 when it has none yet
+static inline uint32_t hlc_number(HlcNumbers* n, Function* f) {
+    size_t h = hlc_numbers_slot(n, f);
+    return n->keys[h] != NULL ? n->values[h] + 1 : 0;
+}
+
+// the symbol of the image for `symbol` of `names`, numbered on first use
+static inline uint32_t hlc_symbol(uint32_t* symbols, uint32_t* used, size_t* used_count, size_t symbol) {
+    if (symbols[symbol] == 0) {
+        used[*used_count] = (uint32_t)symbol;
+        symbols[symbol] = (uint32_t)++*used_count;
+    }
+    return symbols[symbol];
+}
 
-            Function* body_array[1] = {expr_result};
-            Function* builtin_func = new_function(
-                p->functions,
-                builtin_name,
-                body_array,
-                1
-            );
-
-            if (builtin_func != NULL) {
-                builtin_func->builtin = true;
-                program[p->functions] = builtin_func;
-                p->functions++;
+// Save the statements of `program` (with the symbols of `names`) and the
+// modules they import to `out`.
+static inline bool hlc_write(FILE* out, Function** program, size_t count, NameTable* names, ParserImport* imports, size_t imports_count) {
+    HlcNumbers numbers = {NULL, NULL, 0, 1024};
+    numbers.keys = (Function**)calloc(numbers.capacity, sizeof(Function*));
+    numbers.values = (uint32_t*)malloc(numbers.capacity * sizeof(uint32_t));
+    size_t order_capacity = 1024, nodes = 0;
+    Function** order = (Function**)malloc(order_capacity * sizeof(Function*));
+    uint32_t* symbols = (uint32_t*)calloc(names->count, sizeof(uint32_t));
+    uint32_t* used = (uint32_t*)malloc(names->count * sizeof(uint32_t));
+    size_t used_count = 0;
+
+    typedef struct {
+        Function* f;
+        bool expanded; // its children are numbered
+    } HlcWork;
+
+    HlcWork local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(HlcWork), local, WORK_STACK_LOCAL);
+    bool ok = numbers.keys != NULL && numbers.values != NULL && order != NULL && symbols != NULL && used != NULL;
+
+    // number the nodes children first, a shared node once
+    for (size_t i = 0; ok && i < count; i++) {
+        HlcWork root = {program[i], false};
+        ok = work_stack_push(&stack, &root);
+        while (ok && stack.count > 0) {
+            HlcWork work = *(HlcWork*)work_stack_pop(&stack);
+            if (hlc_number(&numbers, work.f) != 0) continue;
+
+            if (!work.expanded) {
+                HlcWork expanded = {work.f, true};
+                ok = work_stack_push(&stack, &expanded);
+                for (size_t k = work.f->body_count; ok && k > 0; k--) {
+                    HlcWork child = {work.f->body[k - 1], false};
+                    if (child.f != NULL) ok = work_stack_push(&stack, &child);
+                }
+                continue;
             }
 
-            if (!parser_end(p) && parser_except(p, TOKEN_NEWLINE)) {
-                p->pos++;
+            if (nodes >= order_capacity) {
+                Function** temp = (Function**)realloc(order, order_capacity * 2 * sizeof(Function*));
+                if (temp == NULL) {
+                    ok = false;
+                    break;
+                }
+                order = temp;
+                order_capacity *= 2;
             }
-            break;
+            ok = nodes < UINT32_MAX - 1 && hlc_numbers_add(&numbers, work.f, (uint32_t)nodes);
+            order[nodes++] = work.f;
         }
-
-        case TOKEN_NEWLINE: {
-            p->pos++;
-            break;
+    }
+    free_work_stack(&stack);
+
+    HlcHeader header = {HLC_MAGIC, HLC_ENDIAN, (uint32_t)sizeof(Function), (uint32_t)sizeof(void*),
+                        nodes, count, 0, 0, imports_count, 0};
+    ok = ok && fwrite(&header, sizeof(header), 1, out) == 1;
+    for (size_t i = 0; ok && i < nodes; i++) {
+        Function* f = order[i];
+        Function record;
+        memset(&record, 0, sizeof(record));
+        record.kind = f->kind;
+        record.interned = true;
+        record.body_count = f->body_count;
+        record.symbol = f->symbol != FUNCTION_NO_SYMBOL && f->symbol < names->count ? hlc_symbol(symbols, used, &used_count, f->symbol) : FUNCTION_NO_SYMBOL;
+        record.index = f->index;
+        if (f->kind == FUNCTION_LAMBDA) {
+            // the parameter names are symbols too
+            bool named = f->index != FUNCTION_NO_NAME && f->index != FUNCTION_NO_SYMBOL && f->index < names->count;
+            record.index = named ? hlc_symbol(symbols, used, &used_count, f->index) : FUNCTION_NO_NAME;
         }
-
-        default: {
-            char msg[128];
-            snprintf(msg, sizeof(msg), "unexpected symbol '%s'", current->value);
-            parser_error(p, msg);
-            p->pos++;
-            break;
+        for (size_t k = 0; k < f->body_count; k++) {
+            uint32_t child = f->body[k] != NULL ? hlc_number(&numbers, f->body[k]) : 0;
+            record.body[k] = (Function*)(uintptr_t)child;
         }
+        ok = fwrite(&record, sizeof(record), 1, out) == 1;
+    }
+    for (size_t i = 0; ok && i < count; i++) {
+        uint32_t statement = hlc_number(&numbers, program[i]) - 1;
+        ok = fwrite(&statement, sizeof(statement), 1, out) == 1;
     }
+    for (size_t i = 0; ok && i < imports_count; i++) {
+        uint32_t statement = (uint32_t)imports[i].statement;
+        ok = fwrite(&statement, sizeof(statement), 1, out) == 1;
+    }
+    for (size_t i = 0; ok && i < used_count; i++) {
+        const char* name = name_table_get(names, used[i]);
+        header.names_size += strlen(name) + 1;
+        ok = fwrite(name, strlen(name) + 1, 1, out) == 1;
+    }
+    for (size_t i = 0; ok && i < imports_count; i++) {
+        header.paths_size += strlen(imports[i].path) + 1;
+        ok = fwrite(imports[i].path, strlen(imports[i].path) + 1, 1, out) == 1;
+    }
+
+    // the sizes of the names are only known now
+    header.names = used_count;
+    ok = ok && fseek(out, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, out) == 1;
+
+    free(numbers.keys);
+    free(numbers.values);
+    free(order);
+    free(symbols);
+    free(used);
+    return ok;
 }
 
-struct ParserParseTuple {
-    Function** program; // we will execute this element by element
-    size_t functions;
-};
+// Save the program of `runtime` to `out`, it should be linked already.
+bool runtime_write_hlc(Runtime* runtime, FILE* out) {
+    bool ok = hlc_write(out, runtime->program, runtime->functions, runtime->names, runtime->imports, runtime->imports_count);
+    if (!ok) fprintf(stderr, "Error: Writing the compiled program failed\n");
+    return ok;
+}
 
-struct ParserParseTuple parser_parse(Parser* p) {
-    size_t capacity = 30;
-    Function** program = (Function**)malloc(capacity * sizeof(Function*));
-    if (program == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        struct ParserParseTuple error = {NULL, 0};
-        return error;
+// the content of the file at `path`, mapped in memory when possible
+static inline void* hlc_load(const char* path, size_t* size) {
+#ifdef HALF_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+        close(fd);
+        return NULL;
     }
+    // private: the fixes of the pointers stay in memory
+    void* data = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return NULL;
+    *size = (size_t)info.st_size;
+    return data;
+#else
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    void* data = length > 0 ? malloc((size_t)length) : NULL;
+    if (data != NULL && fread(data, (size_t)length, 1, file) != 1) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = data != NULL ? (size_t)length : 0;
+    return data;
+#endif
+}
 
-    p->functions = 0; // safe reset
-
-    while(!parser_end(p)) {
-        if (p->functions >= capacity) {
-            capacity *= 2;
-            Function** temp = (Function**)realloc(program, capacity * sizeof(Function*));
-            if (temp == NULL) {
-                fprintf(stderr, "Error: Memory reallocation failed\n");
-                free(program);
-                struct ParserParseTuple error = {NULL, 0};
-                return error;
-            }
-            program = temp;
-        }
+static inline void hlc_unload(void* data, size_t size) {
+    if (data == NULL) return;
+#ifdef HALF_MMAP
+    munmap(data, size);
+#else
+    (void)size;
+    free(data);
+#endif
+}
 
-        statement(p, program);
+void free_hlc_images(HlcImage* images) {
+    while (images != NULL) {
+        HlcImage* next = images->next;
+        hlc_unload(images->data, images->size);
+        free(images);
+        images = next;
     }
+}
 
-    struct ParserParseTuple tuple;
-    tuple.program = program;
-    tuple.functions = p->functions;
-    return tuple;
+// the string at `*chars` before `end`, `*chars` moves after it
+static inline const char* hlc_string(const char** chars, const char* end, size_t* length) {
+    const char* stop = *chars < end ? (const char*)memchr(*chars, '\0', (size_t)(end - *chars)) : NULL;
+    if (stop == NULL) return NULL;
+    const char* string = *chars;
+    *length = (size_t)(stop - string);
+    *chars = stop + 1;
+    return string;
 }
 
-/*
-    4. Half Runtime
+// Map the image at `path` for `runtime`, its names are interned in
+// runtime->names. `out` gets the statements and the imports of the image.
+// false, without message, when the file can't be read or isn't an image
+// of this build.
+static inline bool runtime_map_hlc(Runtime* runtime, const char* path, struct ParserParseTuple* out) {
+    size_t size = 0;
+    unsigned char* data = (unsigned char*)hlc_load(path, &size);
+    if (data == NULL) return false;
+
+    HlcHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok) memcpy(&header, data, sizeof(header));
+    ok = ok && header.magic == HLC_MAGIC && header.endian == HLC_ENDIAN &&
+         header.function_size == sizeof(Function) && header.pointer_size == sizeof(void*) &&
+         header.nodes < UINT32_MAX && header.statements < UINT32_MAX && header.imports < UINT32_MAX &&
+         header.names < UINT32_MAX && header.names_size <= size && header.paths_size <= size &&
+         size == sizeof(header) + header.nodes * sizeof(Function) + (header.statements + header.imports) * sizeof(uint32_t) +
+                 header.names_size + header.paths_size;
+    if (!ok) {
+        hlc_unload(data, size);
+        return false;
+    }
 
-    It takes the AST and interprate it within its context.
-    The Runtime run arbitrary code when it encouter a builtin function
-    (do not forget that a builtin function in Half is just a C function)
-*/
+    Function* nodes = (Function*)(data + sizeof(header));
+    const uint32_t* statements = (const uint32_t*)(data + sizeof(header) + header.nodes * sizeof(Function));
+    const uint32_t* positions = statements + header.statements;
+    const char* chars = (const char*)(positions + header.imports);
+    const char* end = chars + header.names_size;
+
+    // the symbols of the runtime for the symbols of the image
+    uint32_t* symbols = (uint32_t*)malloc((header.names + 1) * sizeof(uint32_t));
+    ok = symbols != NULL;
+    for (size_t i = 1; ok && i <= header.names; i++) {
+        size_t length;
+        const char* name = hlc_string(&chars, end, &length);
+        symbols[i] = name != NULL ? name_table_intern(runtime->names, name, length) : FUNCTION_NO_SYMBOL;
+        ok = symbols[i] != FUNCTION_NO_SYMBOL;
+    }
+    ok = ok && chars == end;
+
+    // the lambdas each node needs around it for its variables
+    uint32_t* free_vars = ok ? (uint32_t*)malloc((header.nodes + 1) * sizeof(uint32_t)) : NULL;
+    ok = ok && free_vars != NULL;
+
+    // turn the children into pointers, a child comes before its parent
+    for (size_t i = 0; ok && i < header.nodes; i++) {
+        Function* f = &nodes[i];
+        const unsigned char* flags = (const unsigned char*)f; // checked as bytes, any value isn't a bool
+        ok = f->kind <= FUNCTION_NUMERAL && f->symbol <= header.names &&
+             flags[offsetof(Function, interned)] == 1 && flags[offsetof(Function, pooled)] == 0;
+
+        // the children and the fields of its kind
+        size_t children = f->kind == FUNCTION_APPLY ? 2 : f->kind == FUNCTION_LAMBDA || f->kind == FUNCTION_DEFINE ? 1 : 0;
+        bool named = f->kind == FUNCTION_NAME || f->kind == FUNCTION_BUILTIN || f->kind == FUNCTION_DEFINE;
+        ok = ok && (f->body_count == children || (f->kind == FUNCTION_BUILTIN && f->body_count == 1)) &&
+             (f->symbol != FUNCTION_NO_SYMBOL) == named &&
+             (f->kind != FUNCTION_VARIABLE || f->index < header.nodes) &&
+             (f->kind != FUNCTION_BOOLEAN || f->index <= 1) &&
+             (f->kind != FUNCTION_NUMERAL || f->index > 0);
+
+        if (ok && f->kind == FUNCTION_LAMBDA && f->index != FUNCTION_NO_NAME) {
+            ok = f->index != FUNCTION_NO_SYMBOL && f->index <= header.names;
+            if (ok) f->index = symbols[f->index];
+        }
+        if (ok && f->symbol != FUNCTION_NO_SYMBOL) f->symbol = symbols[f->symbol];
+
+        uint32_t needed = ok && f->kind == FUNCTION_VARIABLE ? (uint32_t)f->index + 1 : 0;
+        for (size_t k = 0; ok && k < f->body_count; k++) {
+            size_t child = (size_t)(uintptr_t)f->body[k];
+            ok = child > 0 && child <= i && nodes[child - 1].kind != FUNCTION_DEFINE;
+            f->body[k] = ok ? &nodes[child - 1] : NULL;
+            if (ok && free_vars[child - 1] > needed) needed = free_vars[child - 1];
+        }
+        for (size_t k = f->body_count; ok && k < 2; k++) f->body[k] = NULL;
+        if (f->kind == FUNCTION_LAMBDA && needed > 0) needed--;
+        if (ok) free_vars[i] = needed;
+    }
+    free(symbols);
+
+    Function** program = ok ? (Function**)malloc((header.statements + 1) * sizeof(Function*)) : NULL;
+    ok = ok && program != NULL;
+    for (size_t i = 0; ok && i < header.statements; i++) {
+        // a statement is closed, its names are globals
+        ok = statements[i] < header.nodes && free_vars[statements[i]] == 0;
+        program[i] = ok ? &nodes[statements[i]] : NULL;
+    }
+    free(free_vars);
+
+    ParserImport* imports = ok && header.imports > 0 ? (ParserImport*)calloc(header.imports, sizeof(ParserImport)) : NULL;
+    ok = ok && (header.imports == 0 || imports != NULL);
+    end = chars + header.paths_size;
+    for (size_t i = 0; ok && i < header.imports; i++) {
+        size_t length;
+        const char* text = hlc_string(&chars, end, &length);
+        ok = text != NULL && positions[i] <= header.statements && (i == 0 || positions[i] >= positions[i - 1]);
+        imports[i].statement = positions[i];
+        imports[i].path = ok ? (char*)malloc(length + 1) : NULL;
+        ok = ok && imports[i].path != NULL;
+        if (ok) memcpy(imports[i].path, text, length + 1);
+    }
 
-struct Builtin {
-    char* name;
-    Function* (*func)(Function*);
-};
+    HlcImage* image = ok ? (HlcImage*)malloc(sizeof(HlcImage)) : NULL;
+    if (image == NULL) {
+        free(program);
+        free_imports(imports, header.imports);
+        hlc_unload(data, size);
+        return false;
+    }
+    image->data = data;
+    image->size = size;
+    image->next = runtime->images;
+    runtime->images = image;
+
+    out->program = program;
+    out->functions = header.statements;
+    out->imports = imports;
+    out->imports_count = header.imports;
+    out->errors = 0;
+    return true;
+}
 
-typedef struct {
-    Context* context;
-    Function** program;
-    size_t functions;
-    struct Builtin** builtins;
-    size_t builtins_count;
-    size_t exec_i;
-} Runtime;
+// The program of the .hlc file at `path`, ready to run. NULL when the file
+// can't be read or wasn't written by a build like this one.
+Runtime* new_runtime_hlc(const char* path) {
+    struct ParserParseTuple empty = {NULL, 0, NULL, NULL, new_function_pool(NULL, NULL, NULL), NULL, 0, 0};
+    Runtime* rtm = new_runtime(empty);
+    if (rtm == NULL) return NULL;
 
-int church_bool_value(Function* f) {
-    if (f == NULL || f->body_count != 1) return -1;
+    struct ParserParseTuple image;
+    if (!runtime_map_hlc(rtm, path, &image)) {
+        fprintf(stderr, "Error: Invalid compiled program '%s'\n", path);
+        free_runtime(rtm);
+        return NULL;
+    }
+    rtm->program = image.program;
+    rtm->functions = image.functions;
+    rtm->imports = image.imports;
+    rtm->imports_count = image.imports_count;
+    rtm->script = path;
+
+    // the program is linked already, only the definitions are numbered again
+    if (rtm->imports == NULL && runtime_link_grow(rtm)) {
+        for (size_t i = 0; i < rtm->functions; i++) {
+            Function* f = rtm->program[i];
+            if (f->kind != FUNCTION_DEFINE) continue;
+            if (f->symbol < rtm->links_count && rtm->links[f->symbol] == SIZE_MAX) {
+                rtm->links[f->symbol] = rtm->linked_definitions;
+            }
+            rtm->linked_definitions++;
+        }
+    }
+    return rtm;
+}
 
-    Function* inner = f->body[0];
-    if (inner == NULL || inner->body_count != 1) return -1;
+// the path of `path` imported by the file `from`
+static inline char* module_path(const char* from, const char* path) {
+    const char* slash = from != NULL && path[0] != '/' ? strrchr(from, '/') : NULL;
+    size_t dir = slash != NULL ? (size_t)(slash - from) + 1 : 0;
+    char* file = (char*)malloc(dir + strlen(path) + 1);
+    if (file == NULL) return NULL;
+    memcpy(file, from, dir);
+    strcpy(file + dir, path);
+    return file;
+}
 
-    Function* result = inner->body[0];
-    if (result == NULL || result->body_count != 0) return -1;
+// The file of the image of the module `hash` in the cache, its directory is
+// created. NULL when there is no cache.
+static inline char* module_cache_path(uint64_t hash) {
+#ifdef HALF_POSIX
+    const char* dir = getenv("HALF_CACHE");
+    const char* home = getenv("HOME");
+    if (dir == NULL && (home == NULL || home[0] == '\0')) return NULL;
+    if (dir != NULL && dir[0] == '\0') return NULL;
+
+    size_t length = dir != NULL ? strlen(dir) : strlen(home) + strlen("/.cache/half");
+    char* file = (char*)malloc(length + 32);
+    if (file == NULL) return NULL;
+    if (dir != NULL) {
+        strcpy(file, dir);
+    } else {
+        sprintf(file, "%s/.cache/half", home);
+    }
 
-    if (result->id == f->id) return 1;
-    if (result->id == inner->id) return 0;
-    return -1;
-}
+    // each directory of the path, the existing ones stay as they are
+    for (char* c = file + 1; *c != '\0'; c++) {
+        if (*c != '/') continue;
+        *c = '\0';
+        mkdir(file, 0777);
+        *c = '/';
+    }
+    mkdir(file, 0777);
 
-// :show builtin
+    sprintf(file + length, "/%016llx.hlc", (unsigned long long)hash);
+    return file;
+#else
+    (void)hash;
+    return NULL;
+#endif
+}
 
-unsigned char byte = 0;
-int bit_pos = 0;
+// Save the image of a module to `file`, a program loading it at the same
+// time sees either the whole image or none.
+static inline void module_cache_write(Runtime* runtime, const char* file, struct ParserParseTuple* parsed) {
+#ifdef HALF_POSIX
+    // a file of its own for each runtime, whether in another process or not
+    char* temp = (char*)malloc(strlen(file) + 64);
+    if (temp == NULL) return;
+    sprintf(temp, "%s.%ld.%p", file, (long)getpid(), (void*)runtime);
+
+    FILE* out = fopen(temp, "wb");
+    bool ok = out != NULL && hlc_write(out, parsed->program, parsed->functions, runtime->names, parsed->imports, parsed->imports_count);
+    if (out != NULL) ok = fclose(out) == 0 && ok;
+    if (!ok || rename(temp, file) != 0) remove(temp);
+    free(temp);
+#else
+    (void)runtime;
+    (void)file;
+    (void)parsed;
+#endif
+}
 
-void write_bit(int bit) {
-    byte |= (bit << (7 - bit_pos));
-    bit_pos++;
-    if (bit_pos == 8) {
-        putchar(byte);
-        byte = 0;
-        bit_pos = 0;
+// true when the module `hash` is loaded already, it is marked loaded otherwise
+static inline bool runtime_module_loaded(Runtime* runtime, uint64_t hash) {
+    for (size_t i = 0; i < runtime->modules_count; i++) {
+        if (runtime->modules[i] == hash) return true;
     }
+    if (runtime->modules_count >= runtime->modules_capacity) {
+        size_t capacity = runtime->modules_capacity > 0 ? runtime->modules_capacity * 2 : 8;
+        uint64_t* temp = (uint64_t*)realloc(runtime->modules, capacity * sizeof(uint64_t));
+        if (temp == NULL) return false;
+        runtime->modules = temp;
+        runtime->modules_capacity = capacity;
+    }
+    runtime->modules[runtime->modules_count++] = hash;
+    return false;
 }
 
-void flush_bits() {
-    if (bit_pos > 0) {
-        putchar(byte);
-        byte = 0;
-        bit_pos = 0;
+// the statements of a program with its modules
+typedef struct {
+    Function** program;
+    size_t count, capacity;
+} ModuleProgram;
+
+static inline bool module_program_push(ModuleProgram* m, Function* f) {
+    if (m->count >= m->capacity) {
+        size_t capacity = m->capacity > 0 ? m->capacity * 2 : 32;
+        Function** temp = (Function**)realloc(m->program, capacity * sizeof(Function*));
+        if (temp == NULL) {
+            fprintf(stderr, "Error: Memory reallocation failed\n");
+            return false;
+        }
+        m->program = temp;
+        m->capacity = capacity;
     }
+    m->program[m->count++] = f;
+    return true;
 }
 
-Function* show_builtin(Function* f) {
-    int b = church_bool_value(f);
-    if (b >= 0) {
-        write_bit(b);
+static inline bool runtime_splice(Runtime* runtime, const char* from, struct ParserParseTuple* parsed, ModuleProgram* out);
+
+// Add the statements of the module `path` imported by `from` to `out`.
+static inline bool runtime_import(Runtime* runtime, const char* from, const char* path, ModuleProgram* out) {
+    char* file = module_path(from, path);
+    FILE* fptr = file != NULL ? fopen(file, "rb") : NULL;
+    if (fptr == NULL) {
+        fprintf(stderr, "Error: Can't import '%s'\n", file != NULL ? file : path);
+        free(file);
+        return false;
     }
-    return f;
-}
 
-void runtime_add_builtin(Runtime* runtime, const char* name, Function* (*func)(Function*)) {
-    if (runtime->builtins_count >= 8) {
-        return;
+    fseek(fptr, 0, SEEK_END);
+    long fsize = ftell(fptr);
+    fseek(fptr, 0, SEEK_SET);
+    char* source = fsize >= 0 ? (char*)malloc((size_t)fsize + 1) : NULL;
+    bool ok = source != NULL && fread(source, 1, (size_t)fsize, fptr) == (size_t)fsize;
+    fclose(fptr);
+    if (!ok) {
+        fprintf(stderr, "Error: Can't import '%s'\n", file);
+        free(source);
+        free(file);
+        return false;
     }
+    source[fsize] = '\0';
 
-    struct Builtin* bltn = (struct Builtin*)malloc(sizeof(struct Builtin));
-    if (bltn == NULL) return;
+    // FNV-1a of the text
+    uint64_t hash = 14695981039346656037ULL;
+    for (long i = 0; i < fsize; i++) {
+        hash = (hash ^ (unsigned char)source[i]) * 1099511628211ULL;
+    }
 
-    bltn->name = strdup(name);
-    bltn->func = func;
+    if (runtime_module_loaded(runtime, hash)) {
+        free(source);
+        free(file);
+        return true;
+    }
 
-    runtime->builtins[runtime->builtins_count++] = bltn;
-}
+    struct ParserParseTuple parsed;
+    char* cached = module_cache_path(hash);
+    if (cached == NULL || !runtime_map_hlc(runtime, cached, &parsed)) {
+        // no image, or one the loader rejects (damaged, or saved by another
+        // build): the module is parsed and its image replaced
+        parsed = lex_parse(source, runtime->names, runtime->interned, runtime->pool, 0);
+        // a module in error is parsed again to report its errors
+        if (cached != NULL && parsed.program != NULL && parsed.errors == 0) {
+            module_cache_write(runtime, cached, &parsed);
+        } else if (cached != NULL) {
+            remove(cached);
+        }
+    }
+    free(cached);
+    free(source);
 
-// :read builtin
+    ok = parsed.program != NULL && runtime_splice(runtime, file, &parsed, out);
+    free(file);
+    return ok;
+}
 
-const char* input_data = NULL;
-size_t input_pos = 0;
-int input_bit = 0;
+// Add the statements of `parsed`, read from the file `from`, to `out` with
+// the modules it imports. The statements and imports of `parsed` are freed.
+static inline bool runtime_splice(Runtime* runtime, const char* from, struct ParserParseTuple* parsed, ModuleProgram* out) {
+    bool ok = true;
+    size_t next = 0;
+    for (size_t i = 0; i <= parsed->functions; i++) {
+        for (; next < parsed->imports_count && parsed->imports[next].statement <= i; next++) {
+            ok = runtime_import(runtime, from, parsed->imports[next].path, out) && ok;
+        }
+        if (i < parsed->functions && !module_program_push(out, parsed->program[i])) {
+            free_function(parsed->program[i]);
+            ok = false;
+        }
+    }
 
-void update_input_data(const char* new_input) {
-    input_data = new_input;
+    free(parsed->program);
+    free_imports(parsed->imports, parsed->imports_count);
+    parsed->program = NULL;
+    parsed->functions = 0;
+    parsed->imports = NULL;
+    parsed->imports_count = 0;
+    return ok;
 }
 
-Function* make_church_true() {
-    // \x.\y.x
-    static size_t id = 10000;
-    Function* x_ref = new_function(id, "x", NULL, 0);
-    Function* body_array1[1] = {x_ref};
-    Function* inner = new_function(id + 1, "y", body_array1, 1);
-    Function* body_array2[1] = {inner};
-    Function* outer = new_function(id, "x", body_array2, 1);
-    id += 2;
-    return outer;
+// Put the modules imported by `parsed`, read from the file `from`, in place
+// of their import statements.
+bool runtime_splice_imports(Runtime* runtime, const char* from, struct ParserParseTuple* parsed) {
+    ModuleProgram out = {NULL, 0, 0};
+    bool ok = runtime_splice(runtime, from, parsed, &out);
+    parsed->program = out.program != NULL ? out.program : (Function**)malloc(sizeof(Function*));
+    parsed->functions = out.count;
+    return ok;
 }
 
-Function* make_church_false() {
-    // \x.\y.y
-    static size_t id = 20000;
-    Function* y_ref = new_function(id + 1, "y", NULL, 0);
-    Function* body_array1[1] = {y_ref};
-    Function* inner = new_function(id + 1, "y", body_array1, 1);
-    Function* body_array2[1] = {inner};
-    Function* outer = new_function(id, "x", body_array2, 1);
-    id += 2;
-    return outer;
+// Load the modules imported by the program of `runtime`, relative to
+// runtime->script. runtime_run does it when it wasn't done.
+bool runtime_load_imports(Runtime* runtime) {
+    if (runtime->imports == NULL) return true;
+
+    struct ParserParseTuple parsed = {runtime->program, runtime->functions, NULL, NULL, NULL, runtime->imports, runtime->imports_count, 0};
+    runtime->imports = NULL;
+    runtime->imports_count = 0;
+    bool ok = runtime_splice_imports(runtime, runtime->script, &parsed);
+    runtime->program = parsed.program;
+    runtime->functions = parsed.functions;
+
+    // the definitions of the modules are linked with the program
+    free(runtime->links);
+    free(runtime->link_states);
+    runtime->links = NULL;
+    runtime->link_states = NULL;
+    runtime->links_count = 0;
+    runtime->linked_definitions = 0;
+    return ok;
 }
 
-int read_bit() {
-    if (input_data == NULL || input_data[input_pos] == '\0') {
-        return -1;
-    }
+/*
+    11. Half Batch
+
+    runtime_run_batch runs the program of a runtime against many inputs
+    (`half --batch`), the script is parsed and linked once for all of them.
+    Its functions are then marked interned, like the nodes of an image: the
+    engines never modify them, the workers share them without copy nor lock.
+
+    Each worker thread has a Runtime of its own, with a copy of the names,
+    links and builtins of the program and its own FunctionPool, Context and
+    buffers. It runs an input at a time, taking the next one as soon as it
+    is done, and resets its state between two inputs. The output of an input
+    is kept in memory and returned with it: the outputs are in input order,
+    whatever the order of the runs.
+
+    A builtin added to the runtime is called by every worker with the same
+    `user`, it must be safe to call from several threads.
+*/
 
-    int bit = (input_data[input_pos] >> (7 - input_bit)) & 1;
-    input_bit++;
+// An input of runtime_run_batch and the output of its run
+typedef struct {
+    const void* input;
+    size_t input_size;
+    unsigned char* output; // allocated with malloc, NULL when the run failed
+    size_t output_size;
+} BatchItem;
 
-    if (input_bit == 8) {
-        input_bit = 0;
-        input_pos++;
+typedef struct {
+    Runtime* runtime; // the program
+    BatchItem* items;
+    size_t count;
+    size_t next; // the first input no worker took
+    bool failed;
+#ifdef HALF_THREADS
+    pthread_mutex_t lock; // of `next` and `failed`
+#endif
+} Batch;
+
+// Mark the functions of the program interned, they are shared from now on.
+// A function already interned only has interned children.
+static inline bool runtime_freeze(Runtime* runtime) {
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < runtime->functions; i++) {
+        ok = work_stack_push(&stack, &runtime->program[i]);
+        while (ok && stack.count > 0) {
+            Function* f = *(Function**)work_stack_pop(&stack);
+            if (f == NULL || f->interned) continue;
+            f->interned = true;
+            for (size_t k = 0; ok && k < f->body_count; k++) {
+                ok = work_stack_push(&stack, &f->body[k]);
+            }
+        }
     }
-
-    return bit;
+    free_work_stack(&stack);
+    return ok;
 }
 
-Function* read_builtin(Function* f) {
-    int bit = read_bit();
-    if (bit < 0) {
-        return f;
+// Load, link and freeze the program of `runtime` for the workers.
+static inline bool runtime_share(Runtime* runtime) {
+    if (runtime->imports != NULL) runtime_load_imports(runtime);
+    if (runtime->links == NULL && runtime->program != NULL) runtime_link(runtime);
+    if ((runtime->links == NULL && !runtime_link_grow(runtime)) || !runtime_freeze(runtime)) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
     }
-    return bit ? make_church_true() : make_church_false();
+    return true;
 }
 
-Runtime* new_runtime(Function** program, size_t functions) {
-    Runtime* rtm = (Runtime*)malloc(sizeof(Runtime));
-    if (rtm == NULL) return NULL;
+#ifdef HALF_THREADS
+static inline size_t half_processors() {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 0 ? (size_t)online : 1;
+}
+#endif
+
+static inline void free_batch_worker(Runtime* worker) {
+    if (worker == NULL) return;
+    // the program belongs to the runtime of the batch
+    worker->program = NULL;
+    worker->functions = 0;
+    free_runtime(worker);
+}
 
-    size_t capacity = 8;
-    struct Builtin** builtins = (struct Builtin**)malloc(capacity * sizeof(struct Builtin*));
-    if (builtins == NULL) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        free(rtm);
-        return NULL;
+// a runtime sharing the program of `runtime`
+static inline Runtime* new_batch_worker(Runtime* runtime) {
+    NameTable* names = copy_name_table(runtime->names);
+    if (names == NULL) return NULL;
+    struct ParserParseTuple empty = {NULL, 0, names, NULL, new_function_pool(NULL, NULL, NULL), NULL, 0, 0};
+    Runtime* worker = new_runtime(empty);
+    if (worker == NULL) return NULL;
+
+    worker->program = runtime->program;
+    worker->functions = runtime->functions;
+    worker->engine = runtime->engine;
+    worker->script = runtime->script;
+    runtime_output_memory(worker);
+
+    worker->links = (size_t*)malloc((runtime->links_count + 1) * sizeof(size_t));
+    worker->link_states = (uint8_t*)malloc(runtime->links_count + 1);
+    bool ok = worker->pool != NULL && worker->links != NULL && worker->link_states != NULL;
+    if (ok) {
+        memcpy(worker->links, runtime->links, (runtime->links_count + 1) * sizeof(size_t));
+        memcpy(worker->link_states, runtime->link_states, runtime->links_count + 1);
+        worker->links_count = runtime->links_count;
+        worker->linked_definitions = runtime->linked_definitions;
     }
 
-    rtm->builtins = builtins;
-    rtm->context = new_context();
-    rtm->program = program;
-    rtm->functions = functions;
-    rtm->exec_i = 0;
+    for (size_t i = 0; ok && i < runtime->builtins_count; i++) {
+        struct Builtin* b = runtime->builtins[i];
+        if (b == NULL) continue;
+        ok = runtime_add_builtin(worker, name_table_get(runtime->names, b->symbol), b->arity, b->strictness, b->func, b->user);
+    }
 
-    if (rtm->context == NULL) {
-        free(rtm->context);
-        free(rtm);
+    if (!ok) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        free_batch_worker(worker);
         return NULL;
     }
+    return worker;
+}
 
-    runtime_add_builtin(rtm, "show", show_builtin);
-    runtime_add_builtin(rtm, "read", read_builtin);
+// Run the program of `worker` on the input of `item`, from a clean state.
+static inline bool batch_run(Runtime* worker, BatchItem* item) {
+    context_clear(worker->context);
+    function_pool_reset(worker->pool);
+    worker->output.count = 0;
+    worker->output.byte = 0;
+    worker->output.bit_pos = 0;
+    worker->exec_i = 0;
+    runtime_input_memory(worker, item->input, item->input_size);
+
+    runtime_run(worker);
+
+    size_t size;
+    const unsigned char* data = runtime_output_data(worker, &size);
+    item->output = (unsigned char*)malloc(size > 0 ? size : 1);
+    item->output_size = item->output != NULL ? size : 0;
+    if (item->output == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+    memcpy(item->output, data, size);
+    return true;
+}
 
-    return rtm;
+// the next input of `batch`, batch->count when there is none. `ok` is
+// false when the previous one failed.
+static inline size_t batch_next(Batch* batch, bool ok) {
+#ifdef HALF_THREADS
+    pthread_mutex_lock(&batch->lock);
+#endif
+    if (!ok) batch->failed = true;
+    size_t i = batch->next < batch->count ? batch->next++ : batch->count;
+#ifdef HALF_THREADS
+    pthread_mutex_unlock(&batch->lock);
+#endif
+    return i;
 }
 
-void free_runtime(Runtime* rtm) {
-    if (rtm == NULL) return;
+static inline void* batch_worker(void* user) {
+    Batch* batch = (Batch*)user;
+    Runtime* worker = new_batch_worker(batch->runtime);
 
-    if (rtm->program != NULL) {
-        for (size_t i = 0; i < rtm->functions; i++) {
-            free_function(rtm->program[i]);
-        }
-        free(rtm->program);
+    bool ok = worker != NULL;
+    for (size_t i = batch_next(batch, ok); i < batch->count; i = batch_next(batch, ok)) {
+        ok = worker != NULL && batch_run(worker, &batch->items[i]);
     }
+    free_batch_worker(worker);
+    return NULL;
+}
 
-    if (rtm->context != NULL) {
-        free_context(rtm->context);
+// Run the program of `runtime` once for each of the `count` inputs of
+// `items`, on `threads` threads (one per processor when 0). The output of
+// each run is put in its item, the caller frees it. The functions of the
+// program are shared by the runs: they are only freed with the pool of the
+// runtime. false when a run failed.
+bool runtime_run_batch(Runtime* runtime, BatchItem* items, size_t count, size_t threads) {
+    for (size_t i = 0; i < count; i++) {
+        items[i].output = NULL;
+        items[i].output_size = 0;
     }
 
-    if (rtm->builtins != NULL) {
-        for (size_t i = 0; i < rtm->builtins_count; i++) {
-            if (rtm->builtins[i] != NULL) {
-                free(rtm->builtins[i]->name);
-                free(rtm->builtins[i]);
-            }
-        }
-        free(rtm->builtins);
+    if (!runtime_share(runtime)) return false;
+
+    Batch batch;
+    batch.runtime = runtime;
+    batch.items = items;
+    batch.count = count;
+    batch.next = 0;
+    batch.failed = false;
+
+#ifdef HALF_THREADS
+    if (threads == 0) threads = half_processors();
+    if (threads > count) threads = count;
+    if (pthread_mutex_init(&batch.lock, NULL) != 0) {
+        fprintf(stderr, "Error: Can't create a lock\n");
+        return false;
     }
 
-    free(rtm);
+    // the calling thread is a worker too, it runs alone when no thread starts
+    pthread_t* ids = threads > 1 ? (pthread_t*)malloc((threads - 1) * sizeof(pthread_t)) : NULL;
+    size_t started = 0;
+    while (ids != NULL && started < threads - 1 && pthread_create(&ids[started], NULL, batch_worker, &batch) == 0) {
+        started++;
+    }
+    batch_worker(&batch);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+    free(ids);
+    pthread_mutex_destroy(&batch.lock);
+#else
+    (void)threads;
+    batch_worker(&batch);
+#endif
+    return !batch.failed;
 }
 
-static struct Builtin* runtime_find_builtin(Runtime* runtime, const char* name) {
-    for (size_t i = 0; i < runtime->builtins_count; i++) {
-        if (runtime->builtins[i] != NULL &&
-            strcmp(runtime->builtins[i]->name, name) == 0) {
-            return runtime->builtins[i];
+/*
+    12. Half Parallel
+
+    Half is pure but for its builtins, so a statement whose only effect is
+    its output can be reduced before its turn, at the same time as others.
+    When runtime->threads isn't 1 (`--parallel`), runtime_run gives these
+    statements to a pool of worker threads, each one with a Runtime of its
+    own sharing the program (see "11. Half Batch"). A worker takes the next
+    statements nobody took yet, a share of them leaving as many to the other
+    workers, adds the definitions before them to its Context and runs them
+    with their output kept in memory.
+
+    The calling thread runs the program in order: the definitions and the
+    statements with other effects (:read, :readbyte, :ast, the builtins of
+    an embedder) itself, and for the other statements it appends the bits
+    their worker wrote to the output, waiting for them when they aren't
+    done. A statement no worker took yet is run by the calling thread, so
+    nothing waits on a worker that is busy elsewhere. The output is the one
+    of a sequential run, bit for bit. The workers stay PARALLEL_AHEAD
+    statements per thread ahead of the output at most, which bounds the
+    memory of the outputs waiting for their turn.
+
+    A statement is only split from the others, its own reduction happens on
+    a single thread: a program runs faster when its work is spread over
+    several statements.
+*/
+
+#define PARALLEL_AHEAD 16
+
+typedef enum {
+    PARALLEL_FREE,    // no statement, or one not taken yet
+    PARALLEL_RUNNING, // taken by a worker
+    PARALLEL_DONE,    // its output is ready
+    PARALLEL_FAILED,  // its output couldn't be kept, the calling thread runs it again
+} Parallel_State;
+
+// the output of the statements run by a worker
+typedef struct {
+    uint8_t state; // a Parallel_State
+    size_t statements; // run in a row from this one
+    unsigned char* bytes;
+    size_t count;
+    unsigned char byte; // the bits after the bytes, from the most significant
+    int bit_pos;        // the number of these bits
+} ParallelOutput;
+
+typedef struct {
+    Runtime* runtime;
+    bool* pure; // the statements a worker can run
+    size_t next;    // the first statement nobody took
+    size_t current; // the statement of the calling thread
+    size_t window;  // the statements after `current` a worker can take
+    size_t threads;
+    ParallelOutput* outputs; // of the statements from i in outputs[i % window]
+    bool stop;
+    size_t waiting;    // the workers waiting for `current` to move
+    bool main_waiting; // the calling thread waits for a worker
+#ifdef HALF_THREADS
+    pthread_mutex_t lock; // of all the fields above
+    pthread_cond_t moved; // `current` moved, or `stop`
+    pthread_cond_t done;  // a worker is done with its statements
+#endif
+} Parallel;
+
+// Whether a builtin can be called out of turn: it only writes the output.
+static inline bool parallel_builtin(Runtime* runtime, uint32_t symbol) {
+    struct Builtin* b = runtime_find_builtin(runtime, symbol);
+    return b != NULL && (b->func == show_builtin || b->func == showbyte_builtin);
+}
+
+// Whether the term `f` calls a builtin with an effect other than the
+// output, directly or through a definition in `effects`. true when it
+// runs out of memory.
+static inline bool parallel_effect(Runtime* runtime, Function* f, const bool* effects, size_t definitions) {
+    Function* local[WORK_STACK_LOCAL];
+    WorkStack stack;
+    work_stack_init(&stack, sizeof(Function*), local, WORK_STACK_LOCAL);
+
+    // the nodes shared in the term (with --hash-cons) are seen once
+    HlcNumbers seen = {NULL, NULL, 0, 16};
+    seen.keys = (Function**)calloc(seen.capacity, sizeof(Function*));
+    seen.values = (uint32_t*)malloc(seen.capacity * sizeof(uint32_t));
+    bool effect = seen.keys == NULL || seen.values == NULL || !work_stack_push(&stack, &f);
+    while (!effect && stack.count > 0) {
+        Function* node = *(Function**)work_stack_pop(&stack);
+        if (node == NULL || hlc_number(&seen, node) != 0) continue;
+        if (!hlc_numbers_add(&seen, node, 0)) effect = true;
+
+        if (node->kind == FUNCTION_BUILTIN && !parallel_builtin(runtime, node->symbol)) effect = true;
+        if (node->kind == FUNCTION_NAME && node->symbol < runtime->links_count) {
+            size_t d = runtime->links[node->symbol];
+            if (d < definitions && effects[d]) effect = true;
+        }
+        for (size_t k = 0; !effect && k < node->body_count; k++) {
+            effect = !work_stack_push(&stack, &node->body[k]);
         }
     }
-    return NULL;
+    free_work_stack(&stack);
+    free(seen.keys);
+    free(seen.values);
+    return effect;
 }
 
-Function* eval_builtin(Runtime* runtime, Function* f) {
-    if (f == NULL) return NULL;
-
-    for (size_t i = 0; i < f->body_count; i++) {
-        f->body[i] = eval_builtin(runtime, f->body[i]);
+// The statements of the program a worker can run, NULL when it fails.
+static inline bool* parallel_statements(Runtime* runtime) {
+    size_t definitions = 0;
+    for (size_t i = 0; i < runtime->functions; i++) {
+        if (runtime->program[i]->kind == FUNCTION_DEFINE) definitions++;
     }
 
-    if (f->builtin && f->name != NULL) {
-        struct Builtin* builtin = runtime_find_builtin(runtime, f->name);
-        if (builtin != NULL) {
-            Function* arg = (f->body_count > 0 && f->body[0] != NULL)
-                ? eval_builtin(runtime, f->body[0])
-                : NULL;
-            if (arg != NULL) {
-                arg = reduce_function(arg, runtime->context);
-                arg = eval_builtin(runtime, arg);
+    bool* pure = (bool*)malloc(runtime->functions + 1);
+    bool* effects = (bool*)calloc(definitions + 1, sizeof(bool));
+    bool ok = pure != NULL && effects != NULL;
+
+    // A definition has an effect when it uses one that has, which may come
+    // after it: until nothing changes.
+    for (bool changed = ok; changed;) {
+        changed = false;
+        for (size_t i = 0, d = 0; i < runtime->functions; i++) {
+            Function* f = runtime->program[i];
+            if (f->kind != FUNCTION_DEFINE) continue;
+            if (!effects[d] && parallel_effect(runtime, f->body[0], effects, definitions)) {
+                effects[d] = true;
+                changed = true;
             }
-            return builtin->func(arg);
+            d++;
         }
     }
 
-    return reduce_function(f, runtime->context);
+    for (size_t i = 0; ok && i < runtime->functions; i++) {
+        Function* f = runtime->program[i];
+        pure[i] = f->kind != FUNCTION_DEFINE && !parallel_effect(runtime, f, effects, definitions);
+    }
+
+    free(effects);
+    if (!ok) {
+        free(pure);
+        return NULL;
+    }
+    return pure;
 }
 
-void runtime_run(Runtime* runtime) {
-    for (size_t i = 0; i < runtime->functions; i++) {
-        Function* f = runtime->program[i];
-        runtime->exec_i = i;
+// Run the statement `i` of the program, a definition is added to the Context.
+static inline void parallel_step(Runtime* runtime, size_t i) {
+    runtime->exec_i = i;
+    if (runtime->engine != RUNTIME_VM) {
+        runtime_run_statement(runtime, runtime->program[i]);
+    } else if (runtime->bytecode->defines[i] != VM_NONE) {
+        context_add(runtime->context, runtime->bytecode->names[runtime->bytecode->defines[i]], NULL);
+    } else {
+        vm_run(runtime, i);
+    }
+}
+
+// Append the output of a worker to the output of the runtime.
+static inline void parallel_write(Runtime* runtime, ParallelOutput* o) {
+    for (size_t i = 0; i < o->count; i++) {
+        output_bits8(&runtime->output, o->bytes[i]);
+    }
+    for (int k = 0; k < o->bit_pos; k++) {
+        output_bit(&runtime->output, (o->byte >> (7 - k)) & 1);
+    }
+    free(o->bytes);
+    o->bytes = NULL;
+}
 
-        if (f->builtin && f->name != NULL) {
-            struct Builtin* builtin = runtime_find_builtin(runtime, f->name);
+#ifdef HALF_THREADS
+static inline void* parallel_worker(void* user) {
+    Parallel* p = (Parallel*)user;
+    Runtime* worker = new_batch_worker(p->runtime);
+    if (worker != NULL && worker->engine == RUNTIME_VM) {
+        worker->bytecode = new_bytecode(worker->program, worker->functions);
+    }
+    if (worker == NULL || (worker->engine == RUNTIME_VM && worker->bytecode == NULL)) {
+        // the calling thread runs the statements without it
+        free_batch_worker(worker);
+        return NULL;
+    }
 
-            if (builtin != NULL) {
-                Function* arg = (f->body_count > 0 && f->body[0] != NULL)
-                    ? eval_builtin(runtime, f->body[0])
-                    : NULL;
-                Function* result = builtin->func(arg);
+    size_t defined = 0; // the statements before it are in the Context
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->next < p->runtime->functions && !p->pure[p->next]) p->next++;
+        if (p->stop || p->next >= p->runtime->functions) break;
+        if (p->next >= p->current + p->window) {
+            p->waiting++;
+            pthread_cond_wait(&p->moved, &p->lock);
+            p->waiting--;
+            continue;
+        }
+        // a share of the statements the workers can take, in a row
+        size_t i = p->next;
+        size_t share = (p->current + p->window - i) / p->threads;
+        while (p->next < p->runtime->functions && p->pure[p->next] && (p->next == i || p->next - i < share)) p->next++;
+        ParallelOutput* o = &p->outputs[i % p->window];
+        o->state = PARALLEL_RUNNING;
+        size_t end = p->next;
+        pthread_mutex_unlock(&p->lock);
+
+        for (; defined < i; defined++) {
+            if (!p->pure[defined] && worker->program[defined]->kind == FUNCTION_DEFINE) parallel_step(worker, defined);
+        }
+        for (; defined < end; defined++) {
+            function_pool_reset(worker->pool);
+            parallel_step(worker, defined);
+        }
 
-                if (result != NULL) {
-                    result = reduce_function(result, runtime->context);
-                }
-            }
+        ParallelOutput result = {PARALLEL_DONE, end - i, NULL, worker->output.count, worker->output.byte, worker->output.bit_pos};
+        result.bytes = (unsigned char*)malloc(result.count > 0 ? result.count : 1);
+        if (result.bytes != NULL) {
+            memcpy(result.bytes, worker->output.buffer, result.count);
         } else {
-            context_add(runtime->context, f);
+            result.state = PARALLEL_FAILED;
         }
+        worker->output.count = 0;
+        worker->output.byte = 0;
+        worker->output.bit_pos = 0;
+
+        pthread_mutex_lock(&p->lock);
+        *o = result;
+        if (p->main_waiting) pthread_cond_signal(&p->done);
     }
-    flush_bits();
-}
+    pthread_mutex_unlock(&p->lock);
 
-const char* get_filename_ext(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if(!dot || dot == filename) return "";
-    return dot + 1;
+    free_batch_worker(worker);
+    return NULL;
 }
+#endif
+
+// Run the program of `runtime` on runtime->threads threads, see "12. Half
+// Parallel". false when the threads can't be started, nothing ran then.
+bool runtime_run_parallel(Runtime* runtime) {
+#ifdef HALF_THREADS
+    size_t threads = runtime->threads > 0 ? runtime->threads : half_processors();
+    if (threads < 2 || runtime->program == NULL || !runtime_share(runtime)) return false;
+    if (runtime->engine == RUNTIME_VM && runtime->bytecode == NULL) {
+        runtime->bytecode = new_bytecode(runtime->program, runtime->functions);
+        if (runtime->bytecode == NULL) return false;
+    }
 
-const char* read_script(const char* path) {
-    FILE* fptr;
-    fptr = fopen(path, "r");
-    if (fptr == NULL) {
-        fprintf(stderr, "The file is not opened.\n");
+    Parallel p;
+    p.runtime = runtime;
+    p.pure = parallel_statements(runtime);
+    p.next = 0;
+    p.current = 0;
+    p.window = PARALLEL_AHEAD * threads;
+    p.threads = threads;
+    p.outputs = (ParallelOutput*)calloc(p.window, sizeof(ParallelOutput));
+    p.stop = false;
+    p.waiting = 0;
+    p.main_waiting = false;
+    pthread_t* ids = (pthread_t*)malloc((threads - 1) * sizeof(pthread_t));
+    bool lock = p.pure != NULL && p.outputs != NULL && ids != NULL && pthread_mutex_init(&p.lock, NULL) == 0;
+    bool moved = lock && pthread_cond_init(&p.moved, NULL) == 0;
+    bool done = moved && pthread_cond_init(&p.done, NULL) == 0;
+    if (!done) {
+        if (moved) pthread_cond_destroy(&p.moved);
+        if (lock) pthread_mutex_destroy(&p.lock);
+        free(p.pure);
+        free(p.outputs);
+        free(ids);
+        return false;
     }
 
-    if (strcmp(get_filename_ext(path), "half") != 0 && strcmp(get_filename_ext(path), "hl") != 0) {
-        fprintf(stderr, "Invalid file extension. Expected '.half' or '.hl'\n");
-        exit(1);
+    size_t started = 0;
+    while (started < threads - 1 && pthread_create(&ids[started], NULL, parallel_worker, &p) == 0) {
+        started++;
     }
 
-    fseek(fptr, 0, SEEK_END);
-    long fsize = ftell(fptr);
-    fseek(fptr, 0, SEEK_SET);
-    char *string = malloc(fsize + 1);
-    fread(string, fsize, 1, fptr);
-    fclose(fptr);
-    string[fsize] = 0;
+    for (size_t i = 0; i < runtime->functions; i++) {
+        pthread_mutex_lock(&p.lock);
+        p.current = i;
+        if (p.waiting > 0) pthread_cond_broadcast(&p.moved);
+
+        if (!p.pure[i] || i >= p.next) {
+            // not taken by a worker
+            if (p.pure[i]) p.next = i + 1;
+            pthread_mutex_unlock(&p.lock);
+            parallel_step(runtime, i);
+            continue;
+        }
 
-    return string;
-}
+        ParallelOutput* o = &p.outputs[i % p.window];
+        p.main_waiting = true;
+        while (o->state == PARALLEL_RUNNING) {
+            pthread_cond_wait(&p.done, &p.lock);
+        }
+        p.main_waiting = false;
+        ParallelOutput result = *o;
+        o->state = PARALLEL_FREE;
+        pthread_mutex_unlock(&p.lock);
 
-struct ParserParseTuple lex_parse_script(const char* source) {
-    Lexer* l = new_lexer(source);
-    struct LexerLexTuple lout = lexer_lex(l);
-    free_lexer(l);
+        if (result.state == PARALLEL_DONE) {
+            parallel_write(runtime, &result);
+        } else {
+            for (size_t k = 0; k < result.statements; k++) parallel_step(runtime, i + k);
+        }
+        i += result.statements - 1;
+    }
 
-    Parser* p = new_parser(lout.array, lout.counter);
-    struct ParserParseTuple pout = parser_parse(p);
-    free(p);
-    return pout;
+    pthread_mutex_lock(&p.lock);
+    p.stop = true;
+    pthread_cond_broadcast(&p.moved);
+    pthread_mutex_unlock(&p.lock);
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+    }
+
+    pthread_cond_destroy(&p.moved);
+    pthread_cond_destroy(&p.done);
+    pthread_mutex_destroy(&p.lock);
+    free(p.pure);
+    free(p.outputs);
+    free(ids);
+    return true;
+#else
+    (void)runtime;
+    return false;
+#endif
 }
 
 /*
@@ -2,37 +2,287 @@
 #include <string.h>
 #include <stdlib.h>
 
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [--engine=rewrite|machine|net|vm] [--hash-cons] [--optimize | --stream] [--parallel [--threads=N]] script.hl [input...]\n", program);
+    fprintf(stderr, "       %s [--optimize] --emit-c script.hl > script.c\n", program);
+    fprintf(stderr, "       %s [--optimize] [--hash-cons] --compile script.hl -o script.hlc\n", program);
+    fprintf(stderr, "       %s [--engine=rewrite|machine|net|vm] [--parallel [--threads=N]] script.hlc [input...]\n", program);
+    fprintf(stderr, "       %s [--engine=rewrite|machine|net|vm] [--hash-cons] [--optimize] [--threads=N] --batch script.hl|script.hlc [input...]\n", program);
+}
+
+// the lines of stdin, without their '\n'
+static char** read_lines(size_t* count) {
+    size_t size = 0, capacity = 4096;
+    char* text = (char*)malloc(capacity);
+    while (text != NULL) {
+        size += fread(text + size, 1, capacity - size, stdin);
+        if (size < capacity) break;
+        char* temp = (char*)realloc(text, capacity * 2);
+        if (temp == NULL) free(text);
+        text = temp;
+        capacity *= 2;
+    }
+    if (text == NULL) return NULL;
+
+    size_t lines = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (text[i] == '\n') lines++;
+    }
+    if (size > 0 && text[size - 1] != '\n') lines++;
+
+    // the lines point in `text`, freed with the first one
+    char** result = (char**)malloc((lines + 1) * sizeof(char*));
+    if (result == NULL) {
+        free(text);
+        return NULL;
+    }
+    result[0] = text;
+    *count = 0;
+    for (size_t i = 0, start = 0; i <= size && *count < lines; i++) {
+        if (i == size || text[i] == '\n') {
+            text[i] = '\0';
+            result[(*count)++] = text + start;
+            start = i + 1;
+        }
+    }
+    if (lines == 0) free(text);
+    return result;
+}
+
+// Run the program of `rtm` against each input, the arguments or the lines
+// of stdin when there is none, and print the outputs in input order, one
+// per line.
+static int run_batch(Runtime* rtm, size_t threads, int argc, char* argv[]) {
+    size_t count = (size_t)argc;
+    char** inputs = argv;
+    char** lines = NULL;
+    if (argc == 0) {
+        lines = read_lines(&count);
+        if (lines == NULL) {
+            fprintf(stderr, "Error: Can't read the inputs\n");
+            return 1;
+        }
+        inputs = lines;
+    }
+
+    BatchItem* items = (BatchItem*)malloc((count + 1) * sizeof(BatchItem));
+    if (items == NULL) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        if (lines != NULL && count > 0) free(lines[0]);
+        free(lines);
+        return 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        items[i].input = inputs[i];
+        items[i].input_size = strlen(inputs[i]);
+    }
+
+    bool ok = runtime_run_batch(rtm, items, count, threads);
+    for (size_t i = 0; i < count; i++) {
+        fwrite(items[i].output, 1, items[i].output_size, stdout);
+        fputc('\n', stdout);
+        free(items[i].output);
+    }
+    free(items);
+    if (lines != NULL && count > 0) free(lines[0]);
+    free(lines);
+    return ok ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc > 1) {
-        const char* script = read_script(argv[1]);
-        struct ParserParseTuple pout = lex_parse_script(script);
-        if (argc > 2) {
-            size_t total_len = 0;
-            for (int i = 2; i < argc; i++) {
-                total_len += strlen(argv[i]);
-                if (i < argc - 1) {
-                    total_len++; // spaces
-                }
+    Runtime_Engine engine = RUNTIME_MACHINE;
+    bool hash_cons = false;
+    bool emit_c = false;
+    bool optimize = false;
+    bool stream = false;
+    bool compile = false;
+    bool batch = false;
+    bool parallel = false;
+    size_t threads = 0;
+    bool threads_set = false;
+
+    int first = 1;
+    while (first < argc && strncmp(argv[first], "--", 2) == 0) {
+        if (strcmp(argv[first], "--engine=rewrite") == 0) {
+            engine = RUNTIME_REWRITE;
+        } else if (strcmp(argv[first], "--engine=machine") == 0) {
+            engine = RUNTIME_MACHINE;
+        } else if (strcmp(argv[first], "--engine=net") == 0) {
+            engine = RUNTIME_NET;
+        } else if (strcmp(argv[first], "--engine=vm") == 0) {
+            engine = RUNTIME_VM;
+        } else if (strcmp(argv[first], "--hash-cons") == 0) {
+            hash_cons = true;
+        } else if (strcmp(argv[first], "--emit-c") == 0) {
+            emit_c = true;
+        } else if (strcmp(argv[first], "--optimize") == 0) {
+            optimize = true;
+        } else if (strcmp(argv[first], "--stream") == 0) {
+            stream = true;
+        } else if (strcmp(argv[first], "--compile") == 0) {
+            compile = true;
+        } else if (strcmp(argv[first], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[first], "--parallel") == 0) {
+            parallel = true;
+        } else if (strncmp(argv[first], "--threads=", 10) == 0 && argv[first][10] != '\0') {
+            char* end;
+            threads = strtoul(argv[first] + 10, &end, 10);
+            threads_set = true;
+            if (*end != '\0') {
+                usage(argv[0]);
+                return 1;
             }
-            total_len++; // '\0'
-            
-            char* combined = malloc(total_len);
-            combined[0] = '\0';
-            
-            for (int i = 2; i < argc; i++) {
-                strcat(combined, argv[i]);
-                if (i < argc - 1) {
-                    strcat(combined, " ");
-                }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+        first++;
+    }
+
+    // the whole program is needed to optimize or compile it
+    if (stream && (optimize || emit_c || compile)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (batch && (stream || emit_c || compile)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (parallel && (stream || emit_c || compile || batch)) {
+        usage(argv[0]);
+        return 1;
+    }
+    // only the runs of --batch and the statements of --parallel use threads
+    if (threads_set && !parallel && !batch) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // a compiled program is already parsed, linked and optimized
+    if (argc > first && strcmp(get_filename_ext(argv[first]), "hlc") == 0) {
+        if (stream || optimize || emit_c || compile || hash_cons) {
+            usage(argv[0]);
+            return 1;
+        }
+        Runtime* rtm = new_runtime_hlc(argv[first]);
+        if (rtm == NULL) return 1;
+
+        rtm->engine = engine;
+        if (batch) {
+            int status = run_batch(rtm, threads, argc - first - 1, argv + first + 1);
+            free_runtime(rtm);
+            return status;
+        }
+
+        char* combined = join_arguments(argc - first - 1, argv + first + 1);
+        if (combined != NULL) {
+            runtime_input_memory(rtm, combined, strlen(combined));
+        }
+
+        rtm->threads = parallel ? threads : 1;
+        runtime_run(rtm);
+        free_runtime(rtm);
+        free(combined);
+        return 0;
+    }
+
+    if (compile) {
+        if (emit_c || argc != first + 3 || strcmp(argv[first + 1], "-o") != 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        const char* script = read_script(argv[first]);
+        if (script == NULL) return 1;
+        struct ParserParseTuple pout = lex_parse_script(script, hash_cons ? new_intern_table() : NULL, new_function_pool(NULL, NULL, NULL));
+        free((void*)script);
+        Runtime* rtm = new_runtime(pout);
+        if (rtm == NULL) return 1;
+        rtm->script = argv[first];
+        runtime_load_imports(rtm);
+        if (optimize) {
+            runtime_optimize(rtm);
+        }
+        runtime_link(rtm);
+
+        FILE* out = fopen(argv[first + 2], "wb");
+        if (out == NULL) {
+            fprintf(stderr, "Error: Can't create '%s'\n", argv[first + 2]);
+            free_runtime(rtm);
+            return 1;
+        }
+        bool ok = runtime_write_hlc(rtm, out);
+        ok = fclose(out) == 0 && ok;
+        free_runtime(rtm);
+        return ok ? 0 : 1;
+    }
+
+    if (argc > first && stream) {
+        FILE* file = open_script(argv[first]);
+        if (file == NULL) return 1;
+        struct ParserParseTuple empty = {NULL, 0, NULL, hash_cons ? new_intern_table() : NULL, new_function_pool(NULL, NULL, NULL), NULL, 0, 0};
+        Runtime* rtm = new_runtime(empty);
+        if (rtm == NULL) {
+            fclose(file);
+            return 1;
+        }
+
+        char* combined = join_arguments(argc - first - 1, argv + first + 1);
+        if (combined != NULL) {
+            runtime_input_memory(rtm, combined, strlen(combined));
+        }
+
+        rtm->engine = engine;
+        rtm->script = argv[first];
+        bool ok = runtime_run_stream(rtm, file);
+        fclose(file);
+        free_runtime(rtm);
+        free(combined);
+        return ok ? 0 : 1;
+    }
+
+    if (argc > first) {
+        const char* script = read_script(argv[first]);
+        if (script == NULL) return 1;
+        struct ParserParseTuple pout = lex_parse_script(script, hash_cons && !emit_c ? new_intern_table() : NULL, new_function_pool(NULL, NULL, NULL));
+        free((void*)script);
+        Runtime* rtm = new_runtime(pout);
+        if (rtm == NULL) return 1;
+        rtm->script = argv[first];
+        runtime_load_imports(rtm);
+        if (optimize) {
+            runtime_optimize(rtm);
+        }
+
+        if (emit_c) {
+            runtime_link(rtm);
+            rtm->bytecode = new_bytecode(rtm->program, rtm->functions);
+            if (rtm->bytecode == NULL) {
+                free_runtime(rtm);
+                return 1;
             }
-            
-            update_input_data(combined);
-            free(combined);
+            bytecode_emit_c(rtm->bytecode, rtm->names, stdout);
+            free_runtime(rtm);
+            return 0;
+        }
+
+        rtm->engine = engine;
+        if (batch) {
+            int status = run_batch(rtm, threads, argc - first - 1, argv + first + 1);
+            free_runtime(rtm);
+            return status;
         }
 
-        Runtime* rtm = new_runtime(pout.program, pout.functions);
+        char* combined = join_arguments(argc - first - 1, argv + first + 1);
+        if (combined != NULL) {
+            runtime_input_memory(rtm, combined, strlen(combined));
+        }
+
+        rtm->threads = parallel ? threads : 1;
         runtime_run(rtm);
+        free_runtime(rtm);
+        free(combined);
     }
-    
+
     return 0;
 }
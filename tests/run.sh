@@ -0,0 +1,86 @@
+#!/bin/sh
+# Run the tests of Half: tests/run.sh [path/to/half]
+# Each test prints FAIL with what it ran when it fails, the exit status is
+# 1 when a test failed.
+
+half=${1:-./half}
+dir=$(dirname "$0")
+failed=0
+
+# the output of a command as hexadecimal bytes
+output() {
+    "$@" | od -An -tx1 | tr -d ' \n'
+}
+
+check() {
+    name=$1
+    expected=$2
+    actual=$3
+    if [ "$actual" != "$expected" ]; then
+        echo "FAIL: $name: expected '$expected', got '$actual'"
+        failed=1
+    fi
+}
+
+# A long statement runs in bounded memory: the machine and the VM collect
+# the closures it doesn't reach anymore.
+for engine in machine vm net; do
+    check "countdown.hl --engine=$engine" 80 "$(ulimit -v 131072; output "$half" --engine=$engine "$dir/countdown.hl")"
+done
+
+# The engines agree on lambdas whose body is nested 200000 levels deep, on
+# the right (x (x (... x))) and on the left (((x x) x) ... x): the net
+# engine reads them back in linear time.
+temp=$(mktemp -d)
+awk 'BEGIN {
+    n = 200000
+    printf ":ast \\x."
+    for (i = 1; i < n; i++) printf "x ("
+    printf "x"
+    for (i = 1; i < n; i++) printf ")"
+    printf "\n:ast \\x."
+    for (i = 1; i < n; i++) printf "("
+    printf "x"
+    for (i = 1; i < n; i++) printf " x)"
+    printf "\n"
+}' > "$temp/deep.hl"
+for engine in machine vm net; do
+    "$half" --engine=$engine "$temp/deep.hl" > "$temp/$engine.txt" 2>&1
+done
+check "deep.hl --engine=machine" "(\\x.(x" "$(head -c 6 "$temp/machine.txt")"
+for engine in vm net; do
+    if ! cmp -s "$temp/machine.txt" "$temp/$engine.txt"; then
+        echo "FAIL: deep.hl --engine=$engine: the output differs from --engine=machine"
+        failed=1
+    fi
+done
+rm -rf "$temp"
+
+# With --parallel the definitions and the statements reading the input run
+# on the calling thread, the output is the one of a sequential run.
+for engine in machine vm net; do
+    check "definitions.hl --parallel --engine=$engine" 030f6f48696b \
+        "$(output "$half" --parallel --threads=4 --engine=$engine "$dir/definitions.hl" ok)"
+done
+
+# --threads=N is only used by --parallel and --batch
+if "$half" --threads=4 "$dir/definitions.hl" ok > /dev/null 2>&1; then
+    echo "FAIL: --threads=4 without --parallel or --batch: accepted"
+    failed=1
+fi
+
+# The programs built with --emit-c run on the VM, and collect the same way.
+cc=${CC:-cc}
+if command -v "$cc" > /dev/null; then
+    temp=$(mktemp -d)
+    if "$half" --emit-c "$dir/countdown.hl" > "$temp/countdown.c" &&
+       "$cc" -O2 -I "$dir/.." "$temp/countdown.c" -o "$temp/countdown"; then
+        check "countdown.hl --emit-c" 80 "$(ulimit -v 131072; output "$temp/countdown")"
+    else
+        echo "FAIL: countdown.hl --emit-c: the program doesn't build"
+        failed=1
+    fi
+    rm -rf "$temp"
+fi
+
+exit $failed